@@ -29,6 +29,7 @@ namespace RoRnet {
 #define RORNET_MAX_MESSAGE_LENGTH   8192   //!< maximum size of a RoR message. 8192 bytes = 8 kibibytes
 #define RORNET_LAN_BROADCAST_PORT   13000  //!< port used to send the broadcast announcement in LAN mode
 #define RORNET_MAX_USERNAME_LEN     40     //!< port used to send the broadcast announcement in LAN mode
+#define RORNET_MAX_COMPRESSED_INPUT 32768  //!< maximum uncompressed size of the content of a MSG2_COMPRESSED
 
 #define RORNET_VERSION              "RoRnet_2.45"
 
@@ -66,6 +67,23 @@ enum MessageType
 
     MSG2_NO_RANK,                      //!< client has no ranked status
 
+    MSG2_STREAM_DATA_DELTA,            //!< stream data as difference to the previous payload of the stream; only sent to
+                                       //!< clients with "delta" in UserInfo::sessionoptions. The payload is a sequence of
+                                       //!< runs over the previous payload (same length): byte `0x80|(n-1)` = n bytes unchanged,
+                                       //!< byte `n-1` (< 0x80) followed by n bytes to XOR with the previous ones.
+                                       //!< Any STREAM_DATA[_DISCARDABLE] of the stream replaces the previous payload.
+    MSG2_COMPRESSED,                   //!< one or more complete messages (header + payload), compressed as one LZ4 block
+                                       //!< with RORNET_LZ4_DICTIONARY as dictionary; only sent to clients with "lz4" in
+                                       //!< UserInfo::sessionoptions. Payload: uint32_t uncompressed size, then the block.
+    MSG2_BUNDLE,                       //!< several messages in one; payload: per message a BundleEntryHeader followed by its payload.
+                                       //!< Server sends it only to clients with "bundle" in UserInfo::sessionoptions; accepted from any client.
+    MSG2_UDP_CHANNEL,                  //!< server->client after MSG2_WELCOME, to clients with "udp" in UserInfo::sessionoptions: UdpChannelInfo.
+                                       //!< From then on MSG2_STREAM_DATA_DISCARDABLE may travel as UDP datagrams (UdpDatagramHeader,
+                                       //!< Header, payload) to/from the server's port; server only uses it once it received a datagram,
+                                       //!< and sends such data with command MSG2_STREAM_DATA.
+                                       //!< Not offered to clients which also have "delta" in UserInfo::sessionoptions.
+                                       //!< An empty message of this type in a datagram is a keepalive (send at least every few seconds).
+
     // Legacy values (RoRnet_2.38 and earlier)
     MSG2_WRONG_VER_LEGACY = 1003,      //!< Wrong version
 
@@ -117,6 +135,13 @@ enum Netmask
     NETMASK_ENGINE_MODE_MANUAL_RANGES = BITMASK(30)  //!< engine mode
 };
 
+/// Preset dictionary for MSG2_COMPRESSED: strings common in stream registrations, user info and chat
+static const char RORNET_LZ4_DICTIONARY[] =
+    "default\0chat\0character\0.truck\0.car\0.load\0.trailer\0.airplane\0.boat\0.train\0.fixed\0.machine\0"
+    "SERVER: \0MOTD: \0Rules: \0Host(general): \0Host(private): \0"
+    "RoR\0RoRnet_2.45\0normal\0bot\0en-US\0de-DE\0fr-FR\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
+
 // -------------------------------- structs -----------------------------------
 // Only use datatypes with defined binary sizes (avoid bool, int, wchar_t...)
 // Prefer alignment to 4 or 2 bytes (put int32/float/etc. fields on top)
@@ -131,6 +156,27 @@ struct Header                      //!< Common header for every packet
     uint32_t size;                 //!< size of the attached data block
 };
 
+struct UdpChannelInfo              //!< Payload of MSG2_UDP_CHANNEL
+{
+    uint32_t token;                //!< to put in every datagram
+    uint32_t port;                 //!< UDP port of the server
+};
+
+struct UdpDatagramHeader           //!< Precedes the Header of a message sent over the UDP channel
+{
+    int32_t  uid;                  //!< the client's user ID (also in datagrams from the server)
+    uint32_t token;                //!< from UdpChannelInfo
+    uint32_t sequence;             //!< per direction and client; datagrams older than the newest one received are stale
+};
+
+struct BundleEntryHeader           //!< Compact Header of a message inside MSG2_BUNDLE
+{
+    uint16_t command;              //!< the command of this message: MSG2_* (not MSG2_BUNDLE)
+    int16_t  source;               //!< source of this message; ignored when received by the server
+    uint16_t streamid;             //!< streamid for this message
+    uint16_t size;                 //!< size of the attached data block
+};
+
 struct StreamRegister              //!< Sent from the client to server and vice versa, to broadcast a new stream
 {
     int32_t type;                  //!< stream type
@@ -78,7 +78,7 @@ bool GetUrlAsString(const std::string& url, CURLcode& curl_result, long& respons
     return true;
 }
 
-bool CurlRequestThreadFunc(CurlTaskContext context)
+bool CurlRequestTaskFunc(CurlTaskContext context)
 {
     context.ctc_script_engine->curlStatus(CURL_STATUS_START, 0, 0, context.ctc_displayname, "");
     std::string data;
@@ -50,7 +50,7 @@ struct CurlTaskContext
 
 bool GetUrlAsString(const std::string& url, CURLcode& curl_result, long& response_code, std::string& response_payload);
 
-bool CurlRequestThreadFunc(CurlTaskContext task);
+bool CurlRequestTaskFunc(CurlTaskContext task); //!< Run as a TaskExecutor task
 
 
 
@@ -27,6 +27,7 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 #include "config.h"
 #include "messaging.h"
 #include "CurlHelpers.h"
+#include "taskexecutor.h"
 #include "scriptstdstring/scriptstdstring.h" // angelscript addon
 #include "scriptmath/scriptmath.h" // angelscript addon
 #include "scriptmath3d/scriptmath3d.h" // angelscript addon
@@ -55,8 +56,6 @@ using namespace std;
 
 #endif
 
-#include <thread>
-#include <future>
 
 
 // Stream_register_t wrapper
@@ -74,8 +73,8 @@ ScriptEngine::ScriptEngine(Sequencer *seq) : seq(seq),
 }
 
 ScriptEngine::~ScriptEngine() {
-    // Stop thread first
-    this->StopTimerThread();
+    // Stop timer first
+    this->StopTimer();
 
     // Clean up
     deleteAllCallbacks();
@@ -851,48 +850,46 @@ void ScriptEngine::curlStatus(CurlStatusType type, int n1, int n2, string displa
     }
 }
 
-void ScriptEngine::TimerThreadMain() {
-    while (this->GetTimerThreadState() == ThreadState::RUNNING) {
-        // sleep 200 miliseconds
-#ifndef _WIN32
-        usleep(200000);
-#else // _WIN32
-        Sleep(200);
-#endif // _WIN32
-
+void ScriptEngine::TimerTick() {
+    if (this->GetTimerState() == ThreadState::RUNNING) {
         // call script
         seq->frameStepScripts(200);
     }
+
+    // Next tick in 200 miliseconds
+    std::lock_guard<std::mutex> scoped_lock(m_timer_mutex);
+    if (m_timer_state == ThreadState::RUNNING &&
+        TaskExecutor::SubmitAfter(TaskExecutor::TASK_SCRIPT_TIMER, 200, [this] { this->TimerTick(); })) {
+        return;
+    }
+    m_timer_tick_pending = false;
+    m_timer_cond.notify_all();
 }
 
-void ScriptEngine::EnsureTimerThreadRunning() {
-    std::lock_guard<std::mutex> scoped_lock(m_timer_thread_mutex);
-    if (m_timer_thread_state == ThreadState::NOT_RUNNING) {
-        Logger::Log(LOG_DEBUG, "ScriptEngine: starting framestep thread");
-        m_timer_thread = std::thread(&ScriptEngine::TimerThreadMain, this);
-        m_timer_thread_state = ThreadState::RUNNING;
-    }    
+void ScriptEngine::EnsureTimerRunning() {
+    std::lock_guard<std::mutex> scoped_lock(m_timer_mutex);
+    if (m_timer_state == ThreadState::NOT_RUNNING) {
+        Logger::Log(LOG_DEBUG, "ScriptEngine: starting framestep timer");
+        if (TaskExecutor::SubmitAfter(TaskExecutor::TASK_SCRIPT_TIMER, 200, [this] { this->TimerTick(); })) {
+            m_timer_state = ThreadState::RUNNING;
+            m_timer_tick_pending = true;
+        }
+    }
 }
 
-ScriptEngine::ThreadState ScriptEngine::GetTimerThreadState() {
-    std::lock_guard<std::mutex> scoped_lock(m_timer_thread_mutex);
-    return m_timer_thread_state;
+ScriptEngine::ThreadState ScriptEngine::GetTimerState() {
+    std::lock_guard<std::mutex> scoped_lock(m_timer_mutex);
+    return m_timer_state;
 }
 
-void ScriptEngine::StopTimerThread() {
-    {
-        std::lock_guard<std::mutex> scoped_lock(m_timer_thread_mutex);
-        if (m_timer_thread_state != ThreadState::RUNNING)
-            return;
-        m_timer_thread_state = ThreadState::STOP_REQUESTED;
-    }
+void ScriptEngine::StopTimer() {
+    std::unique_lock<std::mutex> uni_lock(m_timer_mutex);
+    if (m_timer_state != ThreadState::RUNNING)
+        return;
+    m_timer_state = ThreadState::STOP_REQUESTED;
 
-    m_timer_thread.join();
-    
-    {
-        std::lock_guard<std::mutex> scoped_lock(m_timer_thread_mutex);
-        m_timer_thread_state = ThreadState::NOT_RUNNING;
-    }
+    m_timer_cond.wait(uni_lock, [this] { return !m_timer_tick_pending; });
+    m_timer_state = ThreadState::NOT_RUNNING;
 }
 
 void ScriptEngine::setException(const std::string &message) {
@@ -984,9 +981,9 @@ void ScriptEngine::addCallback(const std::string &type, asIScriptFunction *func,
     tmp.func = func;
     callbacks[type].push_back(tmp);
 
-    // Do we need to start the frameStep thread?
+    // Do we need to start the frameStep timer?
     if (type == "frameStep") {
-        this->EnsureTimerThreadRunning();
+        this->EnsureTimerRunning();
     }
 
     // finished :)
@@ -1122,7 +1119,7 @@ void ServerScript::setUserName(int uid, const string &username) {
     Client *c = seq->getClient(uid);
     if (!c) return;
     std::string username_sane = Str::SanitizeUtf8(username.begin(), username.end());
-    strncpy(c->user.username, username_sane.c_str(), RORNET_MAX_USERNAME_LEN);
+    seq->SetClientNick(c, username_sane);
 }
 
 std::string ServerScript::getUserAuth(int uid) {
@@ -1146,6 +1143,7 @@ void ServerScript::setUserAuthRaw(int uid, int authmode) {
     Client *c = seq->getClient(uid);
     if (!c) return;
     c->user.authstatus = authmode & ~(RoRnet::AUTH_RANKED | RoRnet::AUTH_BANNED);
+    seq->PublishRecipients();
 }
 
 int ServerScript::getUserColourNum(int uid) {
@@ -1157,7 +1155,7 @@ int ServerScript::getUserColourNum(int uid) {
 void ServerScript::setUserColourNum(int uid, int num) {
     Client *c = seq->getClient(uid);
     if (!c) return;
-    c->user.colournum = num;
+    seq->SetClientColour(c, num);
 }
 
 std::string ServerScript::getUserToken(int uid) {
@@ -1181,7 +1179,7 @@ std::string ServerScript::getUserIPAddress(int uid) {
 }
 
 std::string ServerScript::getServerTerrain() {
-    return Config::getTerrainName();
+    return seq->GetRoom().terrain;
 }
 
 int ServerScript::sendGameCommand(int uid, std::string cmd) {
@@ -1195,8 +1193,9 @@ void ServerScript::curlRequestAsync(std::string url, string displayname) {
     context.ctc_displayname = displayname;
     context.ctc_script_engine = this->mse;
 
-    std::packaged_task<void(CurlTaskContext)> pktask(CurlRequestThreadFunc);
-    std::thread(std::move(pktask), context).detach();
+    if (!TaskExecutor::Submit(TaskExecutor::TASK_HTTP_REQUEST, [context] { CurlRequestTaskFunc(context); })) {
+        Logger::Log(LOG_ERROR, "curlRequestAsync(): too much background work, request to '%s' dropped", url.c_str());
+    }
 #endif
 }
 
@@ -1264,13 +1263,13 @@ std::string ServerScript::get_protocolVersion() {
     return std::string(RORNET_VERSION);
 }
 
-unsigned int ServerScript::get_maxClients() { return Config::getMaxClients(); }
+unsigned int ServerScript::get_maxClients() { return seq->GetRoom().max_clients; }
 
-std::string ServerScript::get_serverName() { return Config::getServerName(); }
+std::string ServerScript::get_serverName() { return seq->GetRoom().name; }
 
 std::string ServerScript::get_IPAddr() { return Config::getIPAddr(); }
 
-unsigned int ServerScript::get_listenPort() { return Config::getListenPort(); }
+unsigned int ServerScript::get_listenPort() { return seq->GetRoom().port; }
 
 int ServerScript::get_serverMode() { return (int)Config::getServerMode(); }
 
@@ -24,9 +24,9 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 
 #include "UnicodeStrings.h"
 #include "CurlHelpers.h"
+#include <condition_variable>
 #include <map>
 #include <mutex>
-#include <thread>
 #include <vector>
 #include "angelscript.h"
 #include "rornet.h"
@@ -147,10 +147,10 @@ public:
      */
     bool callbackExists(const std::string &type, asIScriptFunction *func, asIScriptObject *obj);
 
-    // Timer thread control
-    void        EnsureTimerThreadRunning();
-    void        StopTimerThread();
-    ThreadState GetTimerThreadState();
+    // Timer control; the timer is a recurring TaskExecutor task
+    void        EnsureTimerRunning();
+    void        StopTimer();
+    ThreadState GetTimerState();
 
 protected:
     Sequencer *seq;
@@ -158,10 +158,11 @@ protected:
     asIScriptContext *context;              //!< context in which all scripting happens
     std::map<std::string, callbackList> callbacks; //!< A map containing the script callbacks by type.
 
-    // Timer thread context
-    std::thread m_timer_thread;
-    ThreadState m_timer_thread_state = ThreadState::NOT_RUNNING;
-    std::mutex  m_timer_thread_mutex;
+    // Timer context
+    ThreadState m_timer_state = ThreadState::NOT_RUNNING;
+    bool        m_timer_tick_pending = false; //!< A tick is scheduled or running
+    std::mutex  m_timer_mutex;
+    std::condition_variable m_timer_cond;
 
     /**
      * This function initialzies the engine and registeres all types
@@ -205,9 +206,9 @@ protected:
     void LineCallback(asIScriptContext *ctx, void *param);
 
     /**
-     * A loop that periodically the frameStep() script callback.
+     * Calls the frameStep() script callback, then schedules the next tick.
      */
-    void TimerThreadMain();
+    void TimerTick();
 };
 
 class ServerScript {
@@ -0,0 +1,148 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "aoi.h"
+
+#include "config.h"
+#include "logger.h"
+#include "rornet.h"
+#include "sequencer.h"
+
+#include <cmath>
+#include <cstring>
+
+// Character stream data, as sent by RoR (`Character::SendStreamData()`)
+static const int32_t CHARACTER_CMD_POSITION = 1;
+
+// --------------------------------
+// Static functions
+
+bool AreaOfInterest::IsActive()
+{
+    return Config::getAoiNearRadius() > 0.f;
+}
+
+void AreaOfInterest::CheckConfig()
+{
+    if (!AreaOfInterest::IsActive()) {
+        Logger::Log(LOG_INFO, "area of interest: disabled");
+    } else if (Config::getAoiFarRadius() > 0.f) {
+        Logger::Log(LOG_INFO, "area of interest: all updates within %.0fm, every %u. within %.0fm, none beyond",
+            Config::getAoiNearRadius(), Config::getAoiMidInterval(), Config::getAoiFarRadius());
+    } else {
+        Logger::Log(LOG_INFO, "area of interest: all updates within %.0fm, every %u. beyond",
+            Config::getAoiNearRadius(), Config::getAoiMidInterval());
+    }
+}
+
+bool AreaOfInterest::ExtractPosition(int stream_type, const char *payload, unsigned int len, Position &out_pos)
+{
+    size_t offset = 0;
+    if (stream_type == STREAM_REG_TYPE_VEHICLE) {
+        offset = sizeof(RoRnet::VehicleState);
+    } else if (stream_type == STREAM_REG_TYPE_CHARACTER) {
+        int32_t command = 0;
+        if (len < sizeof(command)) {
+            return false;
+        }
+        std::memcpy(&command, payload, sizeof(command));
+        if (command != CHARACTER_CMD_POSITION) {
+            return false;
+        }
+        offset = sizeof(command);
+    } else {
+        return false;
+    }
+
+    if (len < offset + sizeof(Position)) {
+        return false;
+    }
+    std::memcpy(&out_pos, payload + offset, sizeof(Position)); // Payload is unaligned
+    return std::isfinite(out_pos.x) && std::isfinite(out_pos.y) && std::isfinite(out_pos.z);
+}
+
+bool AreaOfInterest::ShouldForward(AreaOfInterest const& recipient, Position const& source_pos, unsigned int update_index)
+{
+    Position viewer;
+    if (!recipient.GetPosition(viewer)) {
+        return true;
+    }
+
+    const float dx = source_pos.x - viewer.x;
+    const float dy = source_pos.y - viewer.y;
+    const float dz = source_pos.z - viewer.z;
+    const float dist_sq = dx*dx + dy*dy + dz*dz;
+
+    const float near_radius = Config::getAoiNearRadius();
+    if (dist_sq <= near_radius * near_radius) {
+        return true;
+    }
+    const float far_radius = Config::getAoiFarRadius();
+    if (far_radius > 0.f && dist_sq > far_radius * far_radius) {
+        return false;
+    }
+    return (update_index % Config::getAoiMidInterval()) == 0;
+}
+
+// --------------------------------
+// Instance functions
+
+AreaOfInterest::AreaOfInterest()
+    : m_pos_x(0.f)
+    , m_pos_y(0.f)
+    , m_pos_z(0.f)
+    , m_has_position(false)
+{}
+
+void AreaOfInterest::SetPosition(Position const& pos)
+{
+    m_pos_x.store(pos.x, std::memory_order_relaxed);
+    m_pos_y.store(pos.y, std::memory_order_relaxed);
+    m_pos_z.store(pos.z, std::memory_order_relaxed);
+    m_has_position.store(true, std::memory_order_release);
+}
+
+bool AreaOfInterest::TrackStreamData(int msg_type, int stream_type, unsigned int stream_id, const char *payload,
+                                     unsigned int len, Position &out_pos, unsigned int &out_update_index)
+{
+    if (!AreaOfInterest::IsActive() || !AreaOfInterest::ExtractPosition(stream_type, payload, len, out_pos)) {
+        return false;
+    }
+    this->SetPosition(out_pos);
+
+    // Reliable stream data always goes through
+    if (msg_type != RoRnet::MSG2_STREAM_DATA_DISCARDABLE) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_update_counts_mutex);
+    out_update_index = m_update_counts[stream_id]++;
+    return true;
+}
+
+bool AreaOfInterest::GetPosition(Position &out_pos) const
+{
+    if (!m_has_position.load(std::memory_order_acquire)) {
+        return false;
+    }
+    out_pos.x = m_pos_x.load(std::memory_order_relaxed);
+    out_pos.y = m_pos_y.load(std::memory_order_relaxed);
+    out_pos.z = m_pos_z.load(std::memory_order_relaxed);
+    return true;
+}
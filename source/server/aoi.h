@@ -0,0 +1,75 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/// @file Area-of-interest filtering of stream data
+
+#include "prerequisites.h"
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+/// One instance per `Client` (see 'sequencer.h').
+/// Tracks where the client is, as reported by its own actor and character streams, and
+/// decides at which rate positional updates of other clients' streams are forwarded to it:
+///  - within `aoi-near-radius`: every update
+///  - within `aoi-far-radius`: every `aoi-mid-interval`-th update
+///  - beyond: none
+/// Clients whose position is unknown yet receive everything.
+class AreaOfInterest
+{
+public:
+    struct Position {
+        float x, y, z;
+    };
+
+    static bool IsActive();
+    static void CheckConfig();
+
+    /// Reads the position from stream data of a vehicle (first node, right after `RoRnet::VehicleState`)
+    /// or character (position command) stream. @return false if the payload doesn't carry one.
+    static bool ExtractPosition(int stream_type, const char *payload, unsigned int len, Position &out_pos);
+
+    /// @param update_index See TrackStreamData().
+    static bool ShouldForward(AreaOfInterest const& recipient, Position const& source_pos, unsigned int update_index);
+
+    AreaOfInterest();
+
+    void SetPosition(Position const& pos); //!< From the threads processing this client's inbound messages
+    bool GetPosition(Position &out_pos) const;
+
+    /// Call for each stream data message the client sends. Thread safe: with the UDP channel, the client's
+    /// stream data arrives over TCP and UDP at the same time. Updates the client's position. @return true if the message is subject to filtering; gives its
+    /// position and running number among the positional updates of the stream.
+    bool TrackStreamData(int msg_type, int stream_type, unsigned int stream_id, const char *payload, unsigned int len,
+                         Position &out_pos, unsigned int &out_update_index);
+
+private:
+    // Read by the fan-out of other clients; a torn read just mixes two nearby positions.
+    std::atomic<float>     m_pos_x;
+    std::atomic<float>     m_pos_y;
+    std::atomic<float>     m_pos_z;
+    std::atomic<bool>      m_has_position;
+
+    std::mutex             m_update_counts_mutex; //!< Leaf lock
+    std::unordered_map<unsigned int, unsigned int> m_update_counts; //!< stream ID -> positional updates
+};
@@ -0,0 +1,466 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bridge.h"
+
+#include "config.h"
+#include "logger.h"
+#include "messaging.h"
+#include "rornet.h"
+#include "sequencer.h"
+#include "SocketW.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+#ifdef _WIN32
+#   define poll WSAPoll
+#else
+#   include <poll.h>
+#   include <sys/socket.h>
+#endif
+
+static const char *BRIDGE_HELLO = "rorserver-bridge";
+
+static void ShutdownSocket(SWInetSocket *socket) {
+    SWBaseSocket::SWBaseError error;
+    int fd = socket->get_fd(&error);
+    if (fd < 0) {
+        return;
+    }
+#ifdef _WIN32
+    shutdown(fd, SD_BOTH);
+#else
+    shutdown(fd, SHUT_RDWR);
+#endif
+}
+
+Bridge::Bridge(Sequencer *sequencer) :
+        m_sequencer(sequencer),
+        m_running(false),
+        m_pending_accepts(0),
+        m_stat_messages_out(0),
+        m_stat_messages_in(0),
+        m_stat_dropped(0) {
+}
+
+Bridge::~Bridge() {
+    this->Stop();
+}
+
+bool Bridge::Start(unsigned int listen_port, std::vector<std::string> const& peers) {
+    std::vector<std::pair<std::string, unsigned int>> addresses;
+    for (std::string const& peer : peers) {
+        const size_t colon = peer.rfind(':');
+        const unsigned int port = (colon != std::string::npos) ? (unsigned int) atoi(peer.c_str() + colon + 1) : 0;
+        if (colon == 0 || port == 0 || port > 65535) {
+            Logger::Log(LOG_ERROR, "Bridge: invalid peer '%s', expected 'host:port'", peer.c_str());
+            return false;
+        }
+        addresses.push_back(std::make_pair(peer.substr(0, colon), port));
+    }
+
+    if (listen_port != 0) {
+        SWBaseSocket::SWBaseError error;
+        m_listen_socket = new SWInetSocket();
+        m_listen_socket->bind(listen_port, &error);
+        if (error != SWBaseSocket::ok) {
+            Logger::Log(LOG_ERROR, "Bridge: cannot bind port %u: %s", listen_port, error.get_error().c_str());
+            delete m_listen_socket;
+            m_listen_socket = nullptr;
+            return false;
+        }
+        m_listen_socket->listen();
+    }
+
+    m_running = true;
+    if (m_listen_socket != nullptr) {
+        m_accept_thread = std::thread(&Bridge::AcceptThreadMain, this);
+        Logger::Log(LOG_INFO, "Bridge: accepting links on port %u", listen_port);
+    }
+    for (auto const& address : addresses) {
+        m_connect_threads.push_back(std::thread(&Bridge::ConnectThreadMain, this, address.first, address.second));
+    }
+    return true;
+}
+
+void Bridge::Stop() {
+    if (!m_running.exchange(false)) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_wait_mutex); // The connect threads may be about to wait
+    }
+    m_wait_cond.notify_all();
+    if (m_listen_socket != nullptr) {
+        ShutdownSocket(m_listen_socket); // Unblocks accept()
+        m_accept_thread.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_links_mutex);
+        for (std::shared_ptr<Link>& link : m_links) {
+            this->CloseLink(link.get());
+        }
+    }
+    for (std::thread& thread : m_connect_threads) {
+        thread.join();
+    }
+    m_connect_threads.clear();
+    this->JoinFinishedLinkThreads(/*all=*/true);
+
+    if (m_listen_socket != nullptr) {
+        SWBaseSocket::SWBaseError error;
+        m_listen_socket->disconnect(&error);
+        delete m_listen_socket;
+        m_listen_socket = nullptr;
+    }
+}
+
+bool Bridge::IsForwarded(int type) {
+    switch (type) {
+    case RoRnet::MSG2_USER_JOIN:
+    case RoRnet::MSG2_USER_INFO:
+    case RoRnet::MSG2_USER_LEAVE:
+    case RoRnet::MSG2_STREAM_REGISTER:
+    case RoRnet::MSG2_STREAM_UNREGISTER:
+    case RoRnet::MSG2_STREAM_DATA:
+    case RoRnet::MSG2_STREAM_DATA_DISCARDABLE:
+    case RoRnet::MSG2_UTF8_CHAT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void Bridge::Forward(MessagePtr const& msg) {
+    std::lock_guard<std::mutex> lock(m_links_mutex);
+    if (m_links.empty()) {
+        return;
+    }
+    // Clients get discardable stream data as regular stream data; the peer must know it's discardable
+    MessagePtr framed = msg;
+    if (msg->GetType() == RoRnet::MSG2_STREAM_DATA_DISCARDABLE) {
+        framed = Message::CreateVerbatim(msg->GetType(), msg->GetSource(), msg->GetStreamId(),
+                                         msg->GetPayloadLength(), msg->GetPayload());
+    }
+    for (std::shared_ptr<Link>& link : m_links) {
+        this->Enqueue(link.get(), framed);
+    }
+}
+
+void Bridge::ActivateLink(int link_id, std::vector<MessagePtr> const& intro) {
+    std::lock_guard<std::mutex> lock(m_links_mutex);
+    for (std::shared_ptr<Link>& link : m_links) {
+        if (link->id != link_id) {
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> link_lock(link->mutex);
+            if (link->closed) {
+                return;
+            }
+            for (MessagePtr const& msg : intro) {
+                link->queue.push_back(msg);
+                link->queued_bytes += msg->GetWireLength();
+            }
+            link->active = true;
+        }
+        link->cond.notify_one();
+        return;
+    }
+}
+
+Bridge::Stats Bridge::TakeStats() {
+    Stats stats;
+    {
+        std::lock_guard<std::mutex> lock(m_links_mutex);
+        stats.links = m_links.size();
+    }
+    stats.messages_out = m_stat_messages_out.exchange(0);
+    stats.messages_in = m_stat_messages_in.exchange(0);
+    stats.dropped = m_stat_dropped.exchange(0);
+    return stats;
+}
+
+void Bridge::AcceptThreadMain() {
+    SWBaseSocket::SWBaseError error;
+    const int listen_fd = m_listen_socket->get_fd(&error);
+    while (m_running) {
+        pollfd pfd;
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        const int res = poll(&pfd, 1, ACCEPT_POLL_INTERVAL_MS);
+        this->JoinFinishedLinkThreads(/*all=*/false);
+        if (res <= 0 || !(pfd.revents & POLLIN) || !m_running) {
+            continue;
+        }
+
+        SWInetSocket *socket = (SWInetSocket *) m_listen_socket->accept(&error);
+        if (socket == nullptr || error != SWBaseSocket::ok) {
+            delete socket;
+            continue;
+        }
+        const std::string peer = socket->get_peerAddr(&error);
+        if (m_pending_accepts >= MAX_PENDING_ACCEPTS) {
+            Logger::Log(LOG_WARN, "Bridge: too many pending links, refusing %s", peer.c_str());
+            socket->disconnect(&error);
+            delete socket;
+            continue;
+        }
+        ++m_pending_accepts; // Until the handshake is over
+
+        std::unique_ptr<LinkThread> link_thread(new LinkThread());
+        LinkThread *handle = link_thread.get();
+        {
+            std::lock_guard<std::mutex> lock(m_links_mutex);
+            m_link_threads.push_back(std::move(link_thread));
+        }
+        handle->thread = std::thread([this, socket, peer, handle] {
+            this->RunLink(socket, peer, /*accepted=*/true);
+            handle->done = true;
+        });
+    }
+}
+
+void Bridge::ConnectThreadMain(std::string host, unsigned int port) {
+    const std::string peer = host + ":" + std::to_string(port);
+    while (m_running) {
+        SWInetSocket *socket = new SWInetSocket();
+        SWBaseSocket::SWBaseError error;
+        if (socket->connect(port, host, &error) && error == SWBaseSocket::ok) {
+            this->RunLink(socket, peer, /*accepted=*/false); // Takes the socket
+        } else {
+            Logger::Log(LOG_VERBOSE, "Bridge: cannot connect to %s: %s", peer.c_str(), error.get_error().c_str());
+            delete socket;
+        }
+
+        std::unique_lock<std::mutex> lock(m_wait_mutex);
+        m_wait_cond.wait_for(lock, std::chrono::seconds(RECONNECT_INTERVAL_SEC), [this] { return !m_running; });
+    }
+}
+
+void Bridge::RunLink(SWInetSocket *socket, std::string const& peer, bool accepted) {
+    std::shared_ptr<Link> link = std::make_shared<Link>();
+    link->peer = peer;
+    link->socket = socket;
+    bool registered = false;
+    {
+        // Registered before the handshake, so Stop() can unblock it
+        std::lock_guard<std::mutex> lock(m_links_mutex);
+        if (m_running) {
+            link->id = m_next_link_id++;
+            m_links.push_back(link);
+            registered = true;
+        }
+    }
+
+    const bool linked = registered && this->Handshake(link.get());
+    if (accepted) {
+        --m_pending_accepts;
+    }
+    if (linked) {
+        Logger::Log(LOG_INFO, "Bridge: linked with %s", peer.c_str());
+        link->writer = std::thread(&Bridge::WriterThreadMain, this, link.get());
+        m_sequencer->ConnectBridgeLink(link->id); // Introduces our users, then activates the link
+
+        std::vector<char> payload(RORNET_MAX_MESSAGE_LENGTH);
+        for (;;) {
+            int type = 0;
+            int source = 0;
+            unsigned int streamid = 0;
+            unsigned int len = 0;
+            if (Messaging::SWReceiveMessage(socket, &type, &source, &streamid, &len, payload.data(),
+                                            (unsigned int) payload.size()) != 0) {
+                break;
+            }
+            ++m_stat_messages_in;
+            this->HandleMessage(link.get(), type, (unsigned int) source, streamid, payload.data(), len);
+        }
+        Logger::Log(LOG_INFO, "Bridge: link with %s closed", peer.c_str());
+    }
+
+    this->CloseLink(link.get());
+    if (link->writer.joinable()) {
+        link->writer.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_links_mutex);
+        m_links.erase(std::remove(m_links.begin(), m_links.end(), link), m_links.end());
+    }
+    if (registered) {
+        m_sequencer->DropBridgeUsers(link->id);
+    }
+
+    SWBaseSocket::SWBaseError error;
+    socket->disconnect(&error);
+    delete socket;
+}
+
+bool Bridge::Handshake(Link *link) {
+    // Both sides say hello; the versions and keys must match. A peer which stays silent doesn't get to hold the thread.
+    link->socket->set_timeout(HANDSHAKE_TIMEOUT_SEC, 0);
+    const std::string hello = std::string(BRIDGE_HELLO) + " " + RORNET_VERSION + " " + Config::getBridgeKey();
+    if (Messaging::SWSendMessage(link->socket, RoRnet::MSG2_HELLO, 0, 0, (unsigned int) hello.length(), hello.c_str()) != 0) {
+        Logger::Log(LOG_WARN, "Bridge: cannot send hello to %s", link->peer.c_str());
+        return false;
+    }
+
+    std::vector<char> payload(RORNET_MAX_MESSAGE_LENGTH);
+    int type = 0;
+    int source = 0;
+    unsigned int streamid = 0;
+    unsigned int len = 0;
+    if (Messaging::SWReceiveMessage(link->socket, &type, &source, &streamid, &len, payload.data(),
+                                    (unsigned int) payload.size()) != 0) {
+        Logger::Log(LOG_WARN, "Bridge: no hello from %s", link->peer.c_str());
+        return false;
+    }
+    if (type != RoRnet::MSG2_HELLO || std::string(payload.data(), len) != hello) {
+        Logger::Log(LOG_WARN, "Bridge: %s is not a bridge with the same protocol version and key", link->peer.c_str());
+        return false;
+    }
+    link->socket->set_timeout(0, 0); // Linked - the traffic may pause
+    return true;
+}
+
+void Bridge::WriterThreadMain(Link *link) {
+    std::vector<MessagePtr> batch;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(link->mutex);
+            link->cond.wait(lock, [link] { return link->closed || !link->queue.empty(); });
+            if (link->closed) {
+                break;
+            }
+            while (!link->queue.empty() && batch.size() < SEND_BATCH_MAX_MESSAGES) {
+                link->queued_bytes -= link->queue.front()->GetWireLength();
+                batch.push_back(std::move(link->queue.front()));
+                link->queue.pop_front();
+            }
+        }
+        if (Messaging::SWSendMessages(link->socket, batch) != 0) {
+            this->CloseLink(link);
+            break;
+        }
+        m_stat_messages_out += batch.size();
+        batch.clear();
+    }
+}
+
+void Bridge::HandleMessage(Link *link, int type, unsigned int source, unsigned int streamid,
+                           const char *payload, unsigned int len) {
+    if (!Bridge::IsForwarded(type)) {
+        return;
+    }
+
+    // The peer's user IDs may clash with ours - its users get IDs of this process
+    auto found = link->user_ids.find(source);
+    if (type == RoRnet::MSG2_USER_JOIN && found == link->user_ids.end()) {
+        found = link->user_ids.insert(std::make_pair(source, Sequencer::s_free_user_id++)).first;
+    } else if (found == link->user_ids.end()) {
+        return; // Not introduced
+    }
+    const unsigned int uid = found->second;
+
+    MessagePtr msg;
+    if (type == RoRnet::MSG2_USER_JOIN || type == RoRnet::MSG2_USER_INFO) {
+        if (len != sizeof(RoRnet::UserInfo)) {
+            return;
+        }
+        RoRnet::UserInfo user;
+        memcpy(&user, payload, sizeof(RoRnet::UserInfo));
+        user.uniqueid = uid;
+        msg = Message::Create(type, uid, streamid, sizeof(RoRnet::UserInfo), (const char *) &user);
+    } else if (type == RoRnet::MSG2_STREAM_REGISTER) {
+        if (len < sizeof(RoRnet::StreamRegister)) {
+            return;
+        }
+        RoRnet::StreamRegister reg;
+        memcpy(&reg, payload, sizeof(RoRnet::StreamRegister));
+        reg.origin_sourceid = (int32_t) uid;
+        msg = Message::Create(type, uid, streamid, sizeof(RoRnet::StreamRegister), (const char *) &reg);
+    } else {
+        msg = Message::Create(type, uid, streamid, len, payload);
+    }
+
+    if (type == RoRnet::MSG2_USER_LEAVE) {
+        link->user_ids.erase(found);
+    }
+    m_sequencer->ProcessBridgeMessage(link->id, msg);
+}
+
+void Bridge::Enqueue(Link *link, MessagePtr const& msg) {
+    bool overflow = false;
+    {
+        std::lock_guard<std::mutex> lock(link->mutex);
+        if (!link->active || link->closed) {
+            return;
+        }
+        if (link->queued_bytes > QUEUE_SOFT_LIMIT_BYTES && msg->GetType() == RoRnet::MSG2_STREAM_DATA_DISCARDABLE) {
+            ++m_stat_dropped;
+            return;
+        }
+        overflow = (link->queued_bytes > QUEUE_HARD_LIMIT_BYTES);
+        if (!overflow) {
+            link->queue.push_back(msg);
+            link->queued_bytes += msg->GetWireLength();
+        }
+    }
+    if (overflow) {
+        Logger::Log(LOG_WARN, "Bridge: queue limit exceeded, closing link with %s", link->peer.c_str());
+        this->CloseLink(link);
+        return;
+    }
+    link->cond.notify_one();
+}
+
+void Bridge::CloseLink(Link *link) {
+    {
+        std::lock_guard<std::mutex> lock(link->mutex);
+        if (link->closed) {
+            return;
+        }
+        link->closed = true;
+        link->queue.clear();
+        link->queued_bytes = 0;
+    }
+    link->cond.notify_all();
+    ShutdownSocket(link->socket);
+}
+
+void Bridge::JoinFinishedLinkThreads(bool all) {
+    std::vector<std::unique_ptr<LinkThread>> finished;
+    {
+        std::lock_guard<std::mutex> lock(m_links_mutex);
+        auto first_finished = std::stable_partition(m_link_threads.begin(), m_link_threads.end(),
+            [all](std::unique_ptr<LinkThread> const& link_thread) { return !all && !link_thread->done; });
+        std::move(first_finished, m_link_threads.end(), std::back_inserter(finished));
+        m_link_threads.erase(first_finished, m_link_threads.end());
+    }
+    for (std::unique_ptr<LinkThread>& link_thread : finished) {
+        link_thread->thread.join();
+    }
+}
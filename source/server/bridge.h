@@ -0,0 +1,130 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "message.h"
+#include "prerequisites.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/// Links a room with the same room on other server nodes (`bridge-port`, `bridge-peer` config options),
+/// so one session can be spread over several processes or machines.
+/// Each node forwards what its own clients do - joins, leaves, user info, stream registrations,
+/// stream data and chat - to its peers, RoRnet-framed over one TCP link per peer. The receiving node
+/// gives the peer's users IDs of its own and shows them to its clients as remote users.
+/// Discardable stream data keeps its type on the link (Message::CreateVerbatim()), so the receiving
+/// node queues it as discardable, too.
+/// Only local traffic is forwarded, so every node must be linked with every other one; of each pair,
+/// one node connects (`bridge-peer`) and the other accepts (`bridge-port`).
+/// Each link has a reader and a writer thread. Discardable stream data is dropped while the link's
+/// queue is over the soft limit; over the hard limit, the link is closed and reconnected.
+class Bridge {
+public:
+    static const unsigned int RECONNECT_INTERVAL_SEC = 5;
+    static const int          ACCEPT_POLL_INTERVAL_MS = 250;      //!< Upper bound for noticing shutdown
+    static const unsigned int HANDSHAKE_TIMEOUT_SEC = 10;
+    static const unsigned int MAX_PENDING_ACCEPTS = 8;           //!< Accepted connections still in the handshake; more are refused
+    static const size_t       QUEUE_SOFT_LIMIT_BYTES = 512 * 1024;
+    static const size_t       QUEUE_HARD_LIMIT_BYTES = 4 * 1024 * 1024;
+    static const size_t       SEND_BATCH_MAX_MESSAGES = 128;      //!< Per write, like Broadcaster's
+
+    struct Stats {
+        size_t links = 0;              //!< Currently up
+        size_t messages_out = 0;
+        size_t messages_in = 0;
+        size_t dropped = 0;            //!< Discardable stream data not forwarded, link queue full
+    };
+
+    Bridge(Sequencer *sequencer);
+    ~Bridge();
+
+    bool Start(unsigned int listen_port, std::vector<std::string> const& peers); //!< Port 0: don't accept links
+    void Stop(); //!< Closes the links; the sequencer drops their remote users
+
+    // Any thread
+    void Forward(MessagePtr const& msg); //!< Message of a local client, to all peers
+    void ActivateLink(int link_id, std::vector<MessagePtr> const& intro); //!< Called by the sequencer, with clients-mutex locked
+
+    static bool IsForwarded(int type); //!< Message types a bridge carries
+
+    Stats TakeStats();
+
+private:
+    struct Link {
+        int                      id = 0;
+        std::string              peer;            //!< For logging
+        SWInetSocket*            socket = nullptr;
+        std::thread              writer;
+
+        std::mutex               mutex;           //!< Protects the below; leaf lock
+        std::condition_variable  cond;
+        std::deque<MessagePtr>   queue;
+        size_t                   queued_bytes = 0;
+        bool                     active = false;  //!< Introduced to the peer, gets the live traffic
+        bool                     closed = false;
+
+        // Reader thread only
+        std::unordered_map<unsigned int, unsigned int> user_ids; //!< Peer's user ID -> ours
+    };
+
+    struct LinkThread {
+        std::thread              thread;
+        std::atomic<bool>        done;
+        LinkThread(): done(false) {}
+    };
+
+    void  AcceptThreadMain();
+    void  ConnectThreadMain(std::string host, unsigned int port);
+    void  RunLink(SWInetSocket *socket, std::string const& peer, bool accepted); //!< Returns when the link is closed
+    bool  Handshake(Link *link);
+    void  WriterThreadMain(Link *link);
+    void  HandleMessage(Link *link, int type, unsigned int source, unsigned int streamid,
+                        const char *payload, unsigned int len);
+    void  Enqueue(Link *link, MessagePtr const& msg);
+    void  CloseLink(Link *link); //!< Any thread; unblocks the link's threads
+    void  JoinFinishedLinkThreads(bool all);
+
+    Sequencer*                m_sequencer;
+    std::atomic<bool>         m_running;
+    SWInetSocket*             m_listen_socket = nullptr;
+    std::thread               m_accept_thread;
+    std::vector<std::thread>  m_connect_threads;
+    std::mutex                m_wait_mutex;     //!< For the reconnect waits
+    std::condition_variable   m_wait_cond;
+
+    std::mutex                m_links_mutex;    //!< Protects the below
+    std::vector<std::shared_ptr<Link>> m_links;
+    std::vector<std::unique_ptr<LinkThread>> m_link_threads; //!< Of the accepted links
+    int                       m_next_link_id = 1;
+    std::atomic<unsigned int> m_pending_accepts;
+
+    std::atomic<size_t>       m_stat_messages_out;
+    std::atomic<size_t>       m_stat_messages_in;
+    std::atomic<size_t>       m_stat_dropped;
+};
@@ -1,166 +1,627 @@
-/*
-This file is part of "Rigs of Rods Server" (Relay mode)
-
-Copyright 2007   Pierre-Michel Ricordel
-Copyright 2014+  Rigs of Rods Community
-
-"Rigs of Rods Server" is free software: you can redistribute it
-and/or modify it under the terms of the GNU General Public License
-as published by the Free Software Foundation, either version 3
-of the License, or (at your option) any later version.
-
-"Rigs of Rods Server" is distributed in the hope that it will
-be useful, but WITHOUT ANY WARRANTY; without even the implied
-warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
-See the GNU General Public License for more details.
-
-You should have received a copy of the GNU General Public License
-along with Foobar. If not, see <http://www.gnu.org/licenses/>.
-*/
-
-#include "broadcaster.h"
-
-#include "logger.h"
-#include "messaging.h"
-#include "SocketW.h"
-#include "sequencer.h"
-
-#include <cassert>
-#include <cstring>
-#include <map>
-#include <algorithm>
-
-Broadcaster::Broadcaster(Sequencer *sequencer) :
-    m_sequencer(sequencer) {
-}
-
-
-Broadcaster::~Broadcaster() {
-}
-
-
-void Broadcaster::Start(Client* client) {
-    std::lock_guard<std::mutex> scoped_lock(m_mutex);
-
-    m_client = client;
-    m_is_dropping_packets = false;
-    m_packet_drop_counter = 0;
-    m_packet_good_counter = 0;
-    m_msg_queue.clear();
-
-    m_thread = std::thread(&Broadcaster::ThreadMain, this);
-    m_thread_state = ThreadState::RUNNING;
-}
-
-
-void Broadcaster::Stop() {
-    {
-        std::lock_guard<std::mutex> scoped_lock(m_mutex);
-        switch (m_thread_state) {
-        case ThreadState::RUNNING:
-            Logger::Log(LOG_DEBUG, "Broadcaster::Stop() (client_id %d) Thread state is RUNNING -> stopping", m_client->GetUserId());
-            m_thread_state = ThreadState::STOP_REQUESTED;
-            break;
-        case ThreadState::NOT_RUNNING:
-            Logger::Log(LOG_DEBUG, "Broadcaster::Stop() (client_id %d) Thread state is NOT_RUNNING -> nothing to do", m_client->GetUserId());
-            return; // We're done here.
-        case ThreadState::STOP_REQUESTED:
-            Logger::Log(LOG_DEBUG, "Broadcaster::Stop() (client_id %d) Thread state is STOP_REQUESTED -> nothing to do", m_client->GetUserId());
-            return; // We're done here.
-        }
-    }
-
-    m_queue_cond.notify_one(); // Unblock the thread.
-    m_thread.join(); // Wait for thread to exit.
-
-    {
-        std::lock_guard<std::mutex> scoped_lock(m_mutex);
-        m_thread_state = ThreadState::NOT_RUNNING;
-    }
-}
-
-
-void Broadcaster::ThreadMain() {
-    Logger::Log(LOG_DEBUG, "Started broadcaster thread (client_id %d)", m_client->GetUserId());
-
-    bool exit_loop = false;
-    while (!exit_loop) {
-        QueueEntry message;
-        ThreadState state = this->ThreadWaitForMessage(message);
-
-        if (state == ThreadState::STOP_REQUESTED) {
-            Logger::Log(LOG_DEBUG, "Broadcaster thread (client_id %d) was requested to stop", m_client->GetUserId());
-            // Synchronously send all the remaining messages and exit.
-            std::lock_guard<std::mutex> scoped_lock(m_mutex);
-            while (!m_msg_queue.empty() && this->ThreadTransmitMessage(m_msg_queue.front())) {
-                m_msg_queue.pop_front();
-            }
-            exit_loop = true;
-        } else {
-            if (!this->ThreadTransmitMessage(message)) {
-                m_sequencer->disconnectClient(m_client->GetUserId(), "Broadcaster: Send error", true, true);
-                exit_loop = true;
-            }
-        }
-    }
-
-    Logger::Log(LOG_DEBUG, "Broadcaster thread (client_id %d) exits", m_client->GetUserId());
-}
-
-
-Broadcaster::ThreadState Broadcaster::ThreadWaitForMessage(QueueEntry& out_message) {
-    std::unique_lock<std::mutex> uni_lock(m_mutex); // Scoped
-    if (m_msg_queue.empty()) {
-        m_queue_cond.wait(uni_lock);
-    }
-    if (!m_msg_queue.empty()) {
-        out_message = m_msg_queue.front();
-        m_msg_queue.pop_front();
-    }
-    return m_thread_state;
-}
-
-
-bool Broadcaster::ThreadTransmitMessage(QueueEntry const& msg) {
-    int type = msg.type;
-    if (type == RoRnet::MSG2_INVALID)
-        return true; // No error.
-    if (type == RoRnet::MSG2_STREAM_DATA_DISCARDABLE)
-        type = RoRnet::MSG2_STREAM_DATA;
-
-    int res = Messaging::SWSendMessage(m_client->GetSocket(), type, msg.uid, msg.streamid, msg.datalen, msg.data);
-    return res == 0;
-}
-
-
-void Broadcaster::QueueMessage(int type, int uid, unsigned int streamid, unsigned int len, const char *data) {
-    QueueEntry msg;
-    msg.type = (RoRnet::MessageType)type;
-    msg.uid = uid;
-    msg.streamid = streamid;
-    msg.datalen = len;
-    std::memcpy(msg.data, data, len);
-
-    {
-        std::lock_guard<std::mutex> scoped_lock(m_mutex);
-        if (m_msg_queue.empty()) {
-            m_packet_drop_counter = 0;
-            m_is_dropping_packets = (++m_packet_good_counter > 3) ? false : m_is_dropping_packets;
-        } else if (type == RoRnet::MSG2_STREAM_DATA_DISCARDABLE) {
-            auto search = std::find_if(m_msg_queue.begin(), m_msg_queue.end(), [&](const QueueEntry& m)
-                    { return m.type == RoRnet::MSG2_STREAM_DATA_DISCARDABLE && m.uid == uid && m.streamid == streamid; });
-            if (search != m_msg_queue.end()) {
-                // Found outdated discardable streamdata -> replace it
-                (*search) = msg;
-                m_packet_good_counter = 0;
-                m_is_dropping_packets = (++m_packet_drop_counter > 3) ? true : m_is_dropping_packets;
-                Messaging::StatsAddOutgoingDrop(sizeof(RoRnet::Header) + msg.datalen); // Statistics
-                return;
-            }
-        }
-        m_msg_queue.push_back(msg);
-    }
-
-    m_queue_cond.notify_one();
-}
-
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "broadcaster.h"
+
+#include "config.h"
+#include "logger.h"
+#include "messaging.h"
+#include "poller.h"
+#include "SocketW.h"
+#include "sequencer.h"
+
+#include <cassert>
+#include <cstring>
+#include <map>
+#include <algorithm>
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif // __linux__
+
+Broadcaster::Broadcaster(Sequencer *sequencer) :
+    m_ring(RING_CAPACITY),
+    m_has_overflow(false),
+    m_consumer_parked(false),
+    m_queued_bytes(0),
+    m_over_hard_limit(false),
+    m_decimation(1),
+    m_decimated_count(0),
+    m_last_send_duration(0),
+    m_sequencer(sequencer),
+    m_is_dropping_packets(false) {
+    for (int i = 0; i < NUM_PRIORITIES; ++i) {
+        m_depth_messages[i] = 0;
+        m_depth_bytes[i] = 0;
+        m_depth_peak[i] = 0;
+    }
+#ifdef __linux__
+    m_wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_wake_fd < 0) {
+        Logger::Log(LOG_ERROR, "Broadcaster: eventfd() failed: %s", strerror(errno));
+    }
+#endif
+}
+
+
+Broadcaster::~Broadcaster() {
+#ifdef __linux__
+    if (m_wake_fd >= 0) {
+        close(m_wake_fd);
+    }
+#endif
+}
+
+
+void Broadcaster::Start(Client* client) {
+    std::lock_guard<std::mutex> scoped_lock(m_mutex);
+
+    m_client = client;
+    this->ResetQueue();
+
+    m_thread = std::thread(&Broadcaster::ThreadMain, this);
+    m_thread_state = ThreadState::RUNNING;
+}
+
+
+void Broadcaster::StartPolled(Client* client, Poller* poller) {
+    std::lock_guard<std::mutex> scoped_lock(m_mutex);
+
+    m_client = client;
+    m_poller = poller;
+    this->ResetQueue();
+    m_consumer_parked = true; // The poller only looks at us when notified.
+}
+
+
+void Broadcaster::ResetQueue() {
+    MessagePtr msg;
+    while (m_ring.TryPop(msg)) {}
+    m_overflow.clear();
+    m_has_overflow = false;
+    for (int i = 0; i < NUM_PRIORITIES; ++i) {
+        m_backlog[i].clear();
+        m_passed_over[i] = 0;
+        m_depth_messages[i] = 0;
+        m_depth_bytes[i] = 0;
+        m_depth_peak[i] = 0;
+    }
+    for (auto& pending : m_pending_by_source) {
+        pending.clear();
+    }
+    m_backlog_size = 0;
+    m_state_head_seq = 0;
+    m_discardable_index.clear();
+    m_queued_bytes = 0;
+    m_over_hard_limit = false;
+    m_soft_limit_bytes = Config::getQueueSoftLimitKb() * size_t(1024);
+    m_hard_limit_bytes = Config::getQueueHardLimitKb() * size_t(1024);
+    m_consumer_parked = false;
+    m_is_dropping_packets = false;
+    m_packet_drop_counter = 0;
+    m_packet_good_counter = 0;
+    m_delta_encoder.Clear();
+    m_decimation = 1;
+    m_decimation_counters.clear();
+    m_decimation_changed = std::chrono::steady_clock::now();
+    m_last_send_duration = std::chrono::milliseconds(0);
+}
+
+
+void Broadcaster::Stop() {
+    {
+        std::lock_guard<std::mutex> scoped_lock(m_mutex);
+        if (m_poller != nullptr) {
+            return; // Polled mode - there's no thread, the poller already released the client.
+        }
+        switch (m_thread_state) {
+        case ThreadState::RUNNING:
+            Logger::Log(LOG_DEBUG, "Broadcaster::Stop() (client_id %d) Thread state is RUNNING -> stopping", m_client->GetUserId());
+            m_thread_state = ThreadState::STOP_REQUESTED;
+            break;
+        case ThreadState::NOT_RUNNING:
+            Logger::Log(LOG_DEBUG, "Broadcaster::Stop() (client_id %d) Thread state is NOT_RUNNING -> nothing to do", m_client->GetUserId());
+            return; // We're done here.
+        case ThreadState::STOP_REQUESTED:
+            Logger::Log(LOG_DEBUG, "Broadcaster::Stop() (client_id %d) Thread state is STOP_REQUESTED -> nothing to do", m_client->GetUserId());
+            return; // We're done here.
+        }
+    }
+
+    this->WakeConsumer(); // Unblock the thread.
+    m_thread.join(); // Wait for thread to exit.
+
+    {
+        std::lock_guard<std::mutex> scoped_lock(m_mutex);
+        m_thread_state = ThreadState::NOT_RUNNING;
+    }
+}
+
+
+void Broadcaster::ThreadMain() {
+    Logger::Log(LOG_DEBUG, "Started broadcaster thread (client_id %d)", m_client->GetUserId());
+
+    bool exit_loop = false;
+    while (!exit_loop) {
+        this->DrainInbound();
+
+        if (this->GetThreadState() == ThreadState::STOP_REQUESTED) {
+            Logger::Log(LOG_DEBUG, "Broadcaster thread (client_id %d) was requested to stop", m_client->GetUserId());
+            // Synchronously send all the remaining messages and exit.
+            while (!this->IsBacklogEmpty() && this->ThreadTransmitBatch()) {}
+            exit_loop = true;
+        } else if (this->IsBacklogEmpty()) {
+            if (this->TryParkConsumer()) {
+                this->WaitForWakeup();
+            }
+        } else {
+            if (!this->ThreadTransmitBatch()) {
+                m_sequencer->disconnectClient(m_client->GetUserId(), "Broadcaster: Send error", true, true);
+                exit_loop = true;
+            }
+        }
+    }
+
+    Logger::Log(LOG_DEBUG, "Broadcaster thread (client_id %d) exits", m_client->GetUserId());
+}
+
+
+Broadcaster::ThreadState Broadcaster::GetThreadState() {
+    std::lock_guard<std::mutex> scoped_lock(m_mutex);
+    return m_thread_state;
+}
+
+
+bool Broadcaster::PopMessage(MessagePtr& out_message) {
+    for (;;) {
+        this->DrainInbound();
+        if (!this->IsBacklogEmpty()) {
+            out_message = m_use_bundling ? this->PopBacklogBundle() : this->PopBacklogFront();
+            if (m_use_compression && out_message->GetType() != RoRnet::MSG2_INVALID) {
+                out_message = m_compressor.Compress(out_message);
+            }
+            return true;
+        }
+        if (this->TryParkConsumer()) {
+            return false; // The next QueueMessage() will notify the poller.
+        }
+    }
+}
+
+
+bool Broadcaster::ThreadTransmitBatch() {
+    // Take everything queued, up to the cap, and hand it to the socket in one go
+    m_send_batch.clear();
+    size_t batch_bytes = 0;
+    while (!this->IsBacklogEmpty() && m_send_batch.size() < SEND_BATCH_MAX_MESSAGES) {
+        const size_t len = this->PeekBacklogFront()->GetWireLength();
+        if (!m_send_batch.empty() && batch_bytes + len > SEND_BATCH_MAX_BYTES) {
+            break;
+        }
+        MessagePtr msg = this->PopBacklogFront();
+        if (msg->GetType() == RoRnet::MSG2_INVALID) {
+            continue;
+        }
+        batch_bytes += len;
+        m_send_batch.push_back(std::move(msg));
+    }
+
+    // Bundle first; compressing a bundle saves more than compressing its parts
+    if (m_use_bundling) {
+        m_bundler.BundleBatch(m_send_batch);
+    }
+    if (m_use_compression) {
+        m_compressor.CompressBatch(m_send_batch);
+    }
+
+    // Out of the queue, but still pending - the send may wait for a slow peer, keep the teardown scheduler waiting, too
+    m_client->SetUnsentBytes(batch_bytes);
+    const auto send_start = std::chrono::steady_clock::now();
+    int res = m_send_batch.empty() ? 0 : Messaging::SWSendMessages(m_client->GetSocket(), m_send_batch);
+    m_last_send_duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - send_start);
+    m_client->SetUnsentBytes(0);
+    m_send_batch.clear(); // Release the buffers
+    return res == 0;
+}
+
+
+void Broadcaster::QueueMessage(MessagePtr const& msg) {
+    if (m_over_hard_limit.load(std::memory_order_relaxed)) {
+        Messaging::StatsAddOutgoingDrop((int)msg->GetWireLength()); // Statistics
+        return;
+    }
+    const size_t queued_bytes = (m_queued_bytes += msg->GetWireLength()); // Before the consumer can see it
+    if (queued_bytes > m_hard_limit_bytes) {
+        if (!m_over_hard_limit.exchange(true)) {
+            // The peer stopped reading. Callers may hold the clients-mutex, so the disconnect is deferred;
+            // meanwhile the queue stays closed, which bounds the memory it holds.
+            Logger::Log(LOG_WARN, "Broadcaster (client_id %d): outgoing queue exceeds %zu kB, disconnecting",
+                        m_client->GetUserId(), m_hard_limit_bytes / 1024);
+            m_sequencer->DisconnectStalledClient(m_client->GetUserId());
+        }
+        m_queued_bytes -= msg->GetWireLength();
+        Messaging::StatsAddOutgoingDrop((int)msg->GetWireLength()); // Statistics
+        return;
+    }
+
+    // Once reliable messages went to the overflow list, everything must follow them there to keep the order.
+    if (m_has_overflow.load(std::memory_order_acquire) || !m_ring.TryPush(msg)) {
+        if (msg->GetType() == RoRnet::MSG2_STREAM_DATA_DISCARDABLE) {
+            // Client is far behind; newer stream data will follow
+            m_is_dropping_packets = true;
+            m_queued_bytes -= msg->GetWireLength();
+            Messaging::StatsAddOutgoingDrop((int)msg->GetWireLength()); // Statistics
+            return;
+        }
+        std::lock_guard<std::mutex> scoped_lock(m_overflow_mutex);
+        m_overflow.push_back(msg);
+        m_has_overflow.store(true, std::memory_order_release);
+    }
+
+    // Pairs with the fence in TryParkConsumer(): either we see the consumer parked, or it sees our message.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_consumer_parked.load(std::memory_order_relaxed) && m_consumer_parked.exchange(false)) {
+        if (m_poller != nullptr) {
+            m_poller->NotifyOutbound(m_client);
+        } else {
+            this->WakeConsumer();
+        }
+    }
+}
+
+
+void Broadcaster::DrainInbound() {
+    this->UpdateDecimation();
+
+    MessagePtr msg;
+    while (m_ring.TryPop(msg)) {
+        this->AppendToBacklog(std::move(msg));
+    }
+
+    if (m_has_overflow.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> scoped_lock(m_overflow_mutex);
+        // Whatever entered the ring before the overflow started is older - take it first.
+        while (m_ring.TryPop(msg)) {
+            this->AppendToBacklog(std::move(msg));
+        }
+        for (MessagePtr& overflow_msg : m_overflow) {
+            this->AppendToBacklog(std::move(overflow_msg));
+        }
+        m_overflow.clear();
+        m_has_overflow.store(false, std::memory_order_release);
+    }
+}
+
+
+void Broadcaster::AppendToBacklog(MessagePtr msg) {
+    if (msg->GetType() == RoRnet::MSG2_STREAM_DATA_DISCARDABLE && m_decimation > 1 && this->IsDecimated(*msg)) {
+        m_queued_bytes -= msg->GetWireLength();
+        Messaging::StatsAddOutgoingDrop((int)msg->GetWireLength()); // Statistics
+        ++m_decimated_count;
+        return;
+    }
+
+    if (this->IsBacklogEmpty()) {
+        m_packet_drop_counter = 0;
+        m_is_dropping_packets = (++m_packet_good_counter > 3) ? false : m_is_dropping_packets.load();
+    } else if (msg->GetType() == RoRnet::MSG2_STREAM_DATA_DISCARDABLE) {
+        const uint64_t key = StreamKey(msg->GetSource(), msg->GetStreamId());
+        auto search = m_discardable_index.find(key);
+        if (search != m_discardable_index.end()) {
+            // Found outdated discardable streamdata -> replace it
+            MessagePtr& slot = m_backlog[PRIORITY_STREAM_STATE][search->second - m_state_head_seq];
+            m_queued_bytes -= slot->GetWireLength();
+            Messaging::StatsAddOutgoingDrop((int)slot->GetWireLength()); // Statistics
+            m_depth_bytes[PRIORITY_STREAM_STATE] += msg->GetWireLength();
+            m_depth_bytes[PRIORITY_STREAM_STATE] -= slot->GetWireLength();
+            slot = std::move(msg);
+            m_packet_good_counter = 0;
+            m_is_dropping_packets = (++m_packet_drop_counter > 3) ? true : m_is_dropping_packets.load();
+            {
+                std::lock_guard<std::mutex> scoped_lock(m_coalesce_stats_mutex);
+                ++m_coalesce_counts[key];
+            }
+            return;
+        }
+    }
+
+    // This overtakes older stream data of lower classes; whatever it makes obsolete mustn't arrive after it
+    switch (msg->GetType()) {
+    case RoRnet::MSG2_USER_LEAVE:
+        this->DropQueuedStreams(msg->GetSource());
+        break;
+    case RoRnet::MSG2_STREAM_UNREGISTER:
+    case RoRnet::MSG2_STREAM_DATA:
+        this->DropQueuedState(StreamKey(msg->GetSource(), msg->GetStreamId()));
+        break;
+    default:
+        break;
+    }
+
+    const Priority priority = GetPriority(msg->GetType());
+    if (priority == PRIORITY_STREAM_STATE) {
+        m_discardable_index[StreamKey(msg->GetSource(), msg->GetStreamId())] = m_state_head_seq + m_backlog[priority].size();
+    }
+    m_depth_bytes[priority] += msg->GetWireLength();
+    const size_t depth = ++m_depth_messages[priority];
+    if (depth > m_depth_peak[priority]) {
+        m_depth_peak[priority] = depth;
+    }
+    this->TrackPending(priority, msg->GetSource(), /*queued=*/true);
+    m_backlog[priority].push_back(std::move(msg));
+    ++m_backlog_size;
+}
+
+
+void Broadcaster::DropQueuedState(uint64_t stream_key) {
+    auto search = m_discardable_index.find(stream_key);
+    if (search != m_discardable_index.end()) {
+        MessagePtr& slot = m_backlog[PRIORITY_STREAM_STATE][search->second - m_state_head_seq];
+        m_discardable_index.erase(search);
+        this->DropQueued(slot, PRIORITY_STREAM_STATE);
+    }
+}
+
+
+void Broadcaster::DropQueuedStreams(int uid) {
+    for (int priority = PRIORITY_STREAM_EVENTS; priority < NUM_PRIORITIES; ++priority) {
+        for (MessagePtr& slot : m_backlog[priority]) {
+            if (slot == nullptr || slot->GetSource() != uid) {
+                continue;
+            }
+            if (slot->GetType() == RoRnet::MSG2_STREAM_DATA_DISCARDABLE) {
+                m_discardable_index.erase(StreamKey(slot->GetSource(), slot->GetStreamId()));
+            }
+            this->DropQueued(slot, static_cast<Priority>(priority));
+        }
+    }
+}
+
+
+void Broadcaster::DropQueued(MessagePtr& slot, Priority priority) {
+    const size_t len = slot->GetWireLength();
+    m_queued_bytes -= len;
+    Messaging::StatsAddOutgoingDrop((int)len); // Statistics
+    m_depth_bytes[priority] -= len;
+    --m_depth_messages[priority];
+    this->TrackPending(priority, slot->GetSource(), /*queued=*/false);
+    slot.reset(); // Skipped when it reaches the front
+    --m_backlog_size;
+}
+
+
+Broadcaster::Priority Broadcaster::GetPriority(RoRnet::MessageType type) {
+    switch (type) {
+    case RoRnet::MSG2_STREAM_DATA_DISCARDABLE:
+        return PRIORITY_STREAM_STATE;
+    case RoRnet::MSG2_STREAM_REGISTER:
+    case RoRnet::MSG2_STREAM_REGISTER_RESULT:
+    case RoRnet::MSG2_STREAM_UNREGISTER:
+    case RoRnet::MSG2_STREAM_DATA:
+        return PRIORITY_STREAM_EVENTS;
+    default:
+        return PRIORITY_CONTROL;
+    }
+}
+
+
+Broadcaster::Priority Broadcaster::NextPriority() {
+    int first = NUM_PRIORITIES;
+    for (int priority = 0; priority < NUM_PRIORITIES; ++priority) {
+        std::deque<MessagePtr>& queue = m_backlog[priority];
+        while (!queue.empty() && queue.front() == nullptr) {
+            queue.pop_front();
+            if (priority == PRIORITY_STREAM_STATE) {
+                ++m_state_head_seq;
+            }
+        }
+        if (!queue.empty() && first == NUM_PRIORITIES) {
+            first = priority;
+        }
+    }
+    assert(first < NUM_PRIORITIES);
+
+    // Strict priority, except that a class passed over for too long gets a turn - unless its front
+    // would overtake messages of the same user (i.e. the registration of the stream it updates)
+    for (int priority = NUM_PRIORITIES - 1; priority > first; --priority) {
+        if (!m_backlog[priority].empty() && m_passed_over[priority] >= PRIORITY_STARVATION_LIMIT &&
+            this->MayOvertake(static_cast<Priority>(priority))) {
+            return static_cast<Priority>(priority);
+        }
+    }
+    return static_cast<Priority>(first);
+}
+
+
+void Broadcaster::TrackPending(Priority priority, int source, bool queued) {
+    if (priority >= PRIORITY_STREAM_STATE) {
+        return;
+    }
+    std::unordered_map<int, unsigned int>& pending = m_pending_by_source[priority];
+    if (queued) {
+        ++pending[source];
+        return;
+    }
+    auto search = pending.find(source);
+    if (search != pending.end() && --search->second == 0) {
+        pending.erase(search);
+    }
+}
+
+
+bool Broadcaster::MayOvertake(Priority priority) {
+    const int source = m_backlog[priority].front()->GetSource();
+    for (int higher = 0; higher < priority; ++higher) {
+        if (m_pending_by_source[higher].count(source) > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void Broadcaster::TakeQueueDepths(QueueDepth (&out_depths)[NUM_PRIORITIES]) {
+    for (int priority = 0; priority < NUM_PRIORITIES; ++priority) {
+        out_depths[priority].messages = m_depth_messages[priority];
+        out_depths[priority].bytes = m_depth_bytes[priority];
+        out_depths[priority].peak_messages = m_depth_peak[priority].exchange(out_depths[priority].messages);
+    }
+}
+
+
+bool Broadcaster::IsDecimated(Message const& msg) {
+    // Counting per source stream keeps the updates of each stream evenly spaced
+    unsigned int& counter = m_decimation_counters[StreamKey(msg.GetSource(), msg.GetStreamId())];
+    return (counter++ % m_decimation) != 0;
+}
+
+
+void Broadcaster::UpdateDecimation() {
+    const auto now = std::chrono::steady_clock::now();
+    const auto since_change = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_decimation_changed).count();
+    const size_t queued_bytes = m_queued_bytes;
+    const unsigned int decimation = m_decimation;
+
+    const bool congested = m_is_dropping_packets || (queued_bytes > m_soft_limit_bytes) ||
+                           (m_last_send_duration.count() > DECIMATION_SLOW_SEND_MS);
+    if (congested) {
+        if (decimation < DECIMATION_MAX && since_change >= DECIMATION_BACKOFF_INTERVAL_MS) {
+            m_decimation = (decimation * 2 < DECIMATION_MAX) ? decimation * 2 : DECIMATION_MAX;
+            m_decimation_changed = now;
+            Logger::Log(LOG_DEBUG, "Broadcaster (client_id %d): sending every %u. stream update",
+                        m_client->GetUserId(), m_decimation.load());
+        }
+    } else if (decimation > 1) {
+        if (queued_bytes >= m_soft_limit_bytes / 8) {
+            m_decimation_changed = now; // Recover only after the queue stayed short for a while
+        } else if (since_change >= DECIMATION_RECOVERY_INTERVAL_MS) {
+            m_decimation = decimation - 1;
+            m_decimation_changed = now;
+            if (m_decimation == 1) {
+                m_decimation_counters.clear();
+            }
+        }
+    }
+}
+
+
+MessagePtr Broadcaster::PopBacklogFront() {
+    const Priority priority = this->NextPriority();
+    for (int lower = priority + 1; lower < NUM_PRIORITIES; ++lower) {
+        if (!m_backlog[lower].empty()) {
+            ++m_passed_over[lower];
+        }
+    }
+    m_passed_over[priority] = 0;
+
+    MessagePtr msg = std::move(m_backlog[priority].front());
+    m_backlog[priority].pop_front();
+    --m_backlog_size;
+    this->TrackPending(priority, msg->GetSource(), /*queued=*/false);
+    if (priority == PRIORITY_STREAM_STATE) {
+        // A discardable message is always the indexed one for its stream
+        m_discardable_index.erase(StreamKey(msg->GetSource(), msg->GetStreamId()));
+        ++m_state_head_seq;
+    }
+    m_queued_bytes -= msg->GetWireLength();
+    m_depth_bytes[priority] -= msg->GetWireLength();
+    --m_depth_messages[priority];
+    if (m_use_delta) {
+        return m_delta_encoder.Encode(msg);
+    }
+    return msg;
+}
+
+
+MessagePtr Broadcaster::PopBacklogBundle() {
+    MessagePtr msg = this->PopBacklogFront();
+    if (!MessageBundler::CanBundle(*msg)) {
+        return msg;
+    }
+
+    // Sizes are checked before popping; delta encoding only makes messages smaller
+    m_send_batch.clear();
+    size_t bundle_len = MessageBundler::EntryLength(*msg);
+    m_send_batch.push_back(std::move(msg));
+    while (!this->IsBacklogEmpty() && MessageBundler::CanBundle(*this->PeekBacklogFront()) &&
+           bundle_len + MessageBundler::EntryLength(*this->PeekBacklogFront()) <= MessageBundler::MAX_BUNDLE_PAYLOAD) {
+        MessagePtr next = this->PopBacklogFront();
+        bundle_len += MessageBundler::EntryLength(*next);
+        m_send_batch.push_back(std::move(next));
+    }
+
+    if (m_send_batch.size() == 1) {
+        msg = std::move(m_send_batch.front());
+    } else {
+        msg = m_bundler.Bundle(m_send_batch.data(), m_send_batch.size());
+    }
+    m_send_batch.clear(); // Release the buffers
+    return msg;
+}
+
+
+void Broadcaster::TakeCoalesceStats(std::unordered_map<uint64_t, unsigned int>& out_counts) {
+    std::lock_guard<std::mutex> scoped_lock(m_coalesce_stats_mutex);
+    out_counts.swap(m_coalesce_counts);
+    m_coalesce_counts.clear();
+}
+
+
+bool Broadcaster::TryParkConsumer() {
+    m_consumer_parked.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_ring.IsEmpty() && !m_has_overflow.load(std::memory_order_acquire)) {
+        return true;
+    }
+    m_consumer_parked.store(false); // A producer may have already cleared it and signalled; that's harmless.
+    return false;
+}
+
+
+void Broadcaster::WaitForWakeup() {
+#ifdef __linux__
+    uint64_t value;
+    if (read(m_wake_fd, &value, sizeof(value)) < 0 && errno != EINTR) {
+        Logger::Log(LOG_ERROR, "Broadcaster: eventfd read failed: %s", strerror(errno));
+    }
+#else
+    std::unique_lock<std::mutex> uni_lock(m_wake_mutex);
+    m_wake_cond.wait(uni_lock, [this] { return m_wake_pending; });
+    m_wake_pending = false;
+#endif
+}
+
+
+void Broadcaster::WakeConsumer() {
+#ifdef __linux__
+    uint64_t one = 1;
+    if (write(m_wake_fd, &one, sizeof(one)) < 0) {
+        Logger::Log(LOG_ERROR, "Broadcaster: eventfd write failed: %s", strerror(errno));
+    }
+#else
+    {
+        std::lock_guard<std::mutex> scoped_lock(m_wake_mutex);
+        m_wake_pending = true;
+    }
+    m_wake_cond.notify_one();
+#endif
+}
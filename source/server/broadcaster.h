@@ -1,81 +1,195 @@
-/*
-This file is part of "Rigs of Rods Server" (Relay mode)
-
-Copyright 2007   Pierre-Michel Ricordel
-Copyright 2014+  Rigs of Rods Community
-
-"Rigs of Rods Server" is free software: you can redistribute it
-and/or modify it under the terms of the GNU General Public License
-as published by the Free Software Foundation, either version 3
-of the License, or (at your option) any later version.
-
-"Rigs of Rods Server" is distributed in the hope that it will
-be useful, but WITHOUT ANY WARRANTY; without even the implied
-warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
-See the GNU General Public License for more details.
-
-You should have received a copy of the GNU General Public License
-along with Foobar. If not, see <http://www.gnu.org/licenses/>.
-*/
-
-#pragma once
-
-#include "rornet.h"
-#include "prerequisites.h"
-
-#include <condition_variable>
-#include <deque>
-#include <mutex>
-#include <thread>
-
-struct QueueEntry {
-    RoRnet::MessageType type = RoRnet::MSG2_INVALID;
-    int uid;
-    unsigned int streamid;
-    unsigned int datalen;
-    char data[RORNET_MAX_MESSAGE_LENGTH];
-};
-
-
-class Broadcaster {
-public:
-    static const int QUEUE_SOFT_LIMIT = 100;
-    static const int QUEUE_HARD_LIMIT = 300;
-
-    enum class ThreadState
-    {
-        NOT_RUNNING,      //!< Initial/terminal state - thread not running.
-        RUNNING,          //!< Thread running.
-        STOP_REQUESTED,   //!< Thread running.
-    };
-
-    Broadcaster(Sequencer *sequencer);
-    ~Broadcaster();
-
-    void Start(Client* client);
-    void Stop();
-
-    void QueueMessage(int msg_type, int client_id, unsigned int streamid, unsigned int payload_len, const char *payload);
-    bool IsDroppingPackets() const { return m_is_dropping_packets; }
-
-private:
-    void  ThreadMain();
-    ThreadState ThreadWaitForMessage(QueueEntry& out_message);
-    bool  ThreadTransmitMessage(QueueEntry const& message); //!< Returns false on error.
-
-    // Thread context
-    std::thread              m_thread;
-    ThreadState              m_thread_state = ThreadState::NOT_RUNNING;
-    std::mutex               m_mutex;
-
-    // Queue
-    std::deque<QueueEntry>   m_msg_queue;
-    std::condition_variable  m_queue_cond;
-
-    // Broadcaster state
-    Sequencer*               m_sequencer = nullptr;
-    Client*                  m_client = nullptr;
-    bool                     m_is_dropping_packets = false;
-    int                      m_packet_drop_counter = 0;
-    int                      m_packet_good_counter = 0;
-};
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "rornet.h"
+#include "bundle.h"
+#include "compression.h"
+#include "message.h"
+#include "mpsc_ring.h"
+#include "prerequisites.h"
+#include "streamdelta.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class Broadcaster {
+public:
+    static const size_t RING_CAPACITY = 1024;
+    static const size_t SEND_BATCH_MAX_BYTES = 64 * 1024;
+    static const size_t SEND_BATCH_MAX_MESSAGES = 128;
+
+    // Send rate control: of discardable stream data, only every n-th update per source stream is sent.
+    // Queue limits are in bytes (`queue-soft-limit`, `queue-hard-limit`): above the soft limit the rate
+    // is halved, it recovers below 1/8 of it; above the hard limit the client is disconnected.
+    static const unsigned int DECIMATION_MAX = 16;
+    static const int DECIMATION_SLOW_SEND_MS = 250;              //!< Send batch duration which halves the rate
+    static const int DECIMATION_BACKOFF_INTERVAL_MS = 500;
+    static const int DECIMATION_RECOVERY_INTERVAL_MS = 1000;
+
+    /// Outgoing messages are queued per class and sent strictly by priority, so session control
+    /// and stream (un)registrations don't wait behind position updates on a congested link.
+    /// Stream data a higher class makes obsolete (user left, stream gone, reliable data sent) is dropped.
+    enum Priority
+    {
+        PRIORITY_CONTROL,       //!< Session, chat, user info, kicks
+        PRIORITY_STREAM_EVENTS, //!< Stream (un)registration and reliable stream data
+        PRIORITY_STREAM_STATE,  //!< Discardable stream data
+        NUM_PRIORITIES
+    };
+    static const unsigned int PRIORITY_STARVATION_LIMIT = 16; //!< A class passed over this often goes next
+
+    struct QueueDepth {
+        size_t messages = 0;
+        size_t bytes = 0;
+        size_t peak_messages = 0; //!< Since the previous TakeQueueDepths()
+    };
+
+    enum class ThreadState
+    {
+        NOT_RUNNING,      //!< Initial/terminal state - thread not running.
+        RUNNING,          //!< Thread running.
+        STOP_REQUESTED,   //!< Thread running.
+    };
+
+    Broadcaster(Sequencer *sequencer);
+    ~Broadcaster();
+
+    void Start(Client* client);
+    void StartPolled(Client* client, Poller* poller); //!< No thread; the poller drains the queue.
+    void Stop();
+
+    void EnableDeltaEncoding() { m_use_delta = true; } //!< Call before starting
+    void EnableCompression() { m_use_compression = true; } //!< Call before starting
+    void EnableBundling() { m_use_bundling = true; } //!< Call before starting
+
+    void QueueMessage(MessagePtr const& msg); //!< Any thread; lock-free unless the ring is full.
+    bool PopMessage(MessagePtr& out_message); //!< Non-blocking; for the poller. Returns false if queue is empty.
+    bool IsDroppingPackets() const { return m_is_dropping_packets; }
+    size_t GetQueuedBytes() const { return m_queued_bytes; } //!< Wire bytes referenced by the queue (buffers may be shared with other clients)
+    unsigned int GetDecimation() const { return m_decimation; } //!< 1 = all stream updates are sent
+    size_t TakeDecimatedCount() { return m_decimated_count.exchange(0); }
+    void TakeQueueDepths(QueueDepth (&out_depths)[NUM_PRIORITIES]); //!< Per class; resets the peaks
+
+    static Priority GetPriority(RoRnet::MessageType type);
+
+    /// Coalesced discardable updates per source stream (key: see StreamKey()) since the last call.
+    void TakeCoalesceStats(std::unordered_map<uint64_t, unsigned int>& out_counts);
+
+    static uint64_t StreamKey(int uid, unsigned int streamid) { return (uint64_t(uint32_t(uid)) << 32) | streamid; }
+
+private:
+    void  ThreadMain();
+    ThreadState GetThreadState();
+    bool  ThreadTransmitBatch(); //!< Sends a batch from the backlog. Returns false on error.
+
+    // Consumer side (broadcaster thread or poller worker)
+    void  DrainInbound();                    //!< Moves the ring and overflow into the backlog
+    void  AppendToBacklog(MessagePtr msg);   //!< Coalesces discardable stream data
+    void  DropQueuedState(uint64_t stream_key); //!< Pending discardable update of the stream, if any
+    void  DropQueuedStreams(int uid);        //!< Everything queued about the user's streams
+    void  DropQueued(MessagePtr& slot, Priority priority); //!< Leaves a null entry in place
+    void  TrackPending(Priority priority, int source, bool queued); //!< Keeps m_pending_by_source up to date
+    bool  MayOvertake(Priority priority);    //!< No higher class has anything queued from the source of the class' front
+    bool  IsBacklogEmpty() const { return m_backlog_size == 0; }
+    Priority NextPriority();                 //!< Class to send from next; backlog must not be empty
+    MessagePtr const& PeekBacklogFront() { return m_backlog[this->NextPriority()].front(); }
+    bool  IsDecimated(Message const& msg);   //!< Skip this discardable update?
+    void  UpdateDecimation();                //!< Additive increase, multiplicative decrease of the send rate
+    MessagePtr PopBacklogFront();
+    MessagePtr PopBacklogBundle();           //!< Front message, bundled with the following ones if possible
+    bool  TryParkConsumer();                 //!< False if messages arrived meanwhile
+    void  WaitForWakeup();
+
+    void  WakeConsumer();
+    void  ResetQueue();
+
+    // Thread context
+    std::thread              m_thread;
+    ThreadState              m_thread_state = ThreadState::NOT_RUNNING;
+    std::mutex               m_mutex;       //!< Protects thread state; not taken when queueing
+
+    // Inbound: written by any thread
+    MpscRing<MessagePtr>     m_ring;
+    std::mutex               m_overflow_mutex;
+    std::vector<MessagePtr>  m_overflow;     //!< Reliable messages which didn't fit into the ring
+    std::atomic<bool>        m_has_overflow;
+    std::atomic<bool>        m_consumer_parked;
+    std::atomic<size_t>      m_queued_bytes;
+    std::atomic<bool>        m_over_hard_limit; //!< Set once; further messages are dropped
+    size_t                   m_soft_limit_bytes = 0;
+    size_t                   m_hard_limit_bytes = 0;
+
+    // Outbound: consumer only
+    std::deque<MessagePtr>   m_backlog[NUM_PRIORITIES]; //!< Messages are shared with the queues of all other recipients; null = dropped
+    size_t                   m_backlog_size = 0;    //!< Not counting dropped entries
+    unsigned int             m_passed_over[NUM_PRIORITIES] = {}; //!< Times a non-empty class wasn't picked, in a row
+    std::vector<MessagePtr>  m_send_batch;
+    uint64_t                 m_state_head_seq = 0;  //!< Running number of the front entry of the PRIORITY_STREAM_STATE queue
+    std::unordered_map<uint64_t, uint64_t> m_discardable_index; //!< Pending discardable message per source stream -> running number
+    std::unordered_map<int, unsigned int> m_pending_by_source[PRIORITY_STREAM_STATE]; //!< Queued messages of the upper classes per source user
+
+    // Queue depth per class: consumer only, except for the stats
+    std::atomic<size_t>      m_depth_messages[NUM_PRIORITIES];
+    std::atomic<size_t>      m_depth_bytes[NUM_PRIORITIES];
+    std::atomic<size_t>      m_depth_peak[NUM_PRIORITIES];
+
+    StreamDeltaEncoder       m_delta_encoder; //!< Consumer only
+    bool                     m_use_delta = false;
+    MessageBundler           m_bundler;       //!< Consumer only
+    bool                     m_use_bundling = false;
+    PayloadCompressor        m_compressor;    //!< Consumer only
+    bool                     m_use_compression = false;
+
+    // Send rate control: consumer only, except for the stats
+    std::atomic<unsigned int> m_decimation;
+    std::atomic<size_t>      m_decimated_count;
+    std::unordered_map<uint64_t, unsigned int> m_decimation_counters; //!< Discardable updates seen per source stream
+    std::chrono::steady_clock::time_point m_decimation_changed;
+    std::chrono::milliseconds m_last_send_duration;
+
+    std::mutex               m_coalesce_stats_mutex;  //!< Leaf lock
+    std::unordered_map<uint64_t, unsigned int> m_coalesce_counts;
+
+    // Wakeup of a parked broadcaster thread
+#ifdef __linux__
+    int                      m_wake_fd = -1; //!< eventfd
+#else
+    std::mutex               m_wake_mutex;
+    std::condition_variable  m_wake_cond;
+    bool                     m_wake_pending = false;
+#endif
+
+    // Broadcaster state
+    Sequencer*               m_sequencer = nullptr;
+    Client*                  m_client = nullptr;
+    Poller*                  m_poller = nullptr; //!< Set in polled mode (epoll backend)
+    std::atomic<bool>        m_is_dropping_packets;
+    int                      m_packet_drop_counter = 0;
+    int                      m_packet_good_counter = 0;
+};
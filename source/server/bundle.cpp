@@ -0,0 +1,97 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bundle.h"
+
+#include <cstdint>
+#include <cstring>
+
+bool MessageBundler::CanBundle(Message const& msg)
+{
+    switch (msg.GetType()) {
+    case RoRnet::MSG2_INVALID:
+    case RoRnet::MSG2_BUNDLE:
+    case RoRnet::MSG2_COMPRESSED:
+        return false;
+    default:
+        break;
+    }
+    return msg.GetSource() >= INT16_MIN && msg.GetSource() <= INT16_MAX &&
+           msg.GetStreamId() <= UINT16_MAX &&
+           msg.GetPayloadLength() <= MAX_ENTRY_PAYLOAD;
+}
+
+MessagePtr MessageBundler::Bundle(const MessagePtr *msgs, size_t count)
+{
+    m_payload.clear();
+    for (size_t i = 0; i < count; ++i) {
+        const Message& msg = *msgs[i];
+        RoRnet::BundleEntryHeader entry;
+        entry.command  = static_cast<uint16_t>(msg.GetHeader().command); // As it would go on the wire
+        entry.source   = static_cast<int16_t>(msg.GetSource());
+        entry.streamid = static_cast<uint16_t>(msg.GetStreamId());
+        entry.size     = static_cast<uint16_t>(msg.GetPayloadLength());
+
+        const char *entry_bytes = reinterpret_cast<const char*>(&entry);
+        m_payload.insert(m_payload.end(), entry_bytes, entry_bytes + sizeof(entry));
+        m_payload.insert(m_payload.end(), msg.GetPayload(), msg.GetPayload() + msg.GetPayloadLength());
+    }
+    return Message::Create(RoRnet::MSG2_BUNDLE, 0, 0, static_cast<unsigned int>(m_payload.size()), m_payload.data());
+}
+
+void MessageBundler::BundleBatch(std::vector<MessagePtr>& batch)
+{
+    m_result.clear();
+    size_t pos = 0;
+    while (pos < batch.size()) {
+        size_t end = pos;
+        size_t bundle_len = 0;
+        while (end < batch.size() && MessageBundler::CanBundle(*batch[end]) &&
+               bundle_len + MessageBundler::EntryLength(*batch[end]) <= MAX_BUNDLE_PAYLOAD) {
+            bundle_len += MessageBundler::EntryLength(*batch[end]);
+            ++end;
+        }
+
+        if (end - pos >= 2) {
+            m_result.push_back(this->Bundle(&batch[pos], end - pos));
+        } else {
+            end = pos + 1; // Not bundleable, or nothing to bundle it with
+            m_result.push_back(std::move(batch[pos]));
+        }
+        pos = end;
+    }
+    batch.swap(m_result);
+    m_result.clear(); // Release the buffers
+}
+
+bool BundleReader::Next(RoRnet::BundleEntryHeader &out_header, const char *&out_payload)
+{
+    if (static_cast<size_t>(m_end - m_pos) < sizeof(RoRnet::BundleEntryHeader)) {
+        return false;
+    }
+    std::memcpy(&out_header, m_pos, sizeof(out_header)); // Payload is unaligned
+    const char *payload = m_pos + sizeof(out_header);
+    if (static_cast<size_t>(m_end - payload) < out_header.size) {
+        return false;
+    }
+    out_payload = payload;
+    m_pos = payload + out_header.size;
+    return true;
+}
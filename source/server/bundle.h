@@ -0,0 +1,67 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/// @file Packing several messages into one `RoRnet::MSG2_BUNDLE` and back
+
+#include "message.h"
+#include "rornet.h"
+
+#include <vector>
+
+#define BUNDLE_SESSION_OPTION "bundle" //!< Token in `RoRnet::UserInfo::sessionoptions`
+
+/// One instance per recipient, used by whoever sends its queue (single thread).
+/// Replaces runs of consecutive small messages by bundles; order is preserved.
+class MessageBundler
+{
+public:
+    static const size_t MAX_ENTRY_PAYLOAD = 1024; //!< Bigger messages gain too little to be worth the copy
+    static const size_t MAX_BUNDLE_PAYLOAD = RORNET_MAX_MESSAGE_LENGTH - 1 - sizeof(RoRnet::Header); //!< Stays below the send limit
+
+    /// Fits a `RoRnet::BundleEntryHeader` and isn't a container itself
+    static bool CanBundle(Message const& msg);
+    static size_t EntryLength(Message const& msg) { return sizeof(RoRnet::BundleEntryHeader) + msg.GetPayloadLength(); }
+
+    /// @param msgs All must pass CanBundle() and fit MAX_BUNDLE_PAYLOAD together.
+    MessagePtr Bundle(const MessagePtr *msgs, size_t count);
+
+    void BundleBatch(std::vector<MessagePtr>& batch);
+
+private:
+    std::vector<char>        m_payload;
+    std::vector<MessagePtr>  m_result;
+};
+
+/// Walks the entries of a received `RoRnet::MSG2_BUNDLE`
+class BundleReader
+{
+public:
+    BundleReader(const char *payload, unsigned int len): m_pos(payload), m_end(payload + len) {}
+
+    /// @return False at the end, or if the rest is malformed (see IsMalformed()).
+    bool Next(RoRnet::BundleEntryHeader &out_header, const char *&out_payload);
+    bool IsMalformed() const { return m_pos != m_end; }
+
+private:
+    const char *m_pos;
+    const char *m_end;
+};
@@ -0,0 +1,145 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "clientregistry.h"
+
+#include "sequencer.h"
+#include "UnicodeStrings.h"
+
+#include <cassert>
+
+static void DecrementCount(std::unordered_map<std::string, unsigned int>& counts, std::string const& key) {
+    auto found = counts.find(key);
+    if (found != counts.end() && --found->second == 0) {
+        counts.erase(found);
+    }
+}
+
+void ClientRegistry::Reserve(size_t count) {
+    m_clients.reserve(count);
+    m_by_id.reserve(count);
+}
+
+void ClientRegistry::Add(Client* client) {
+    Entry entry;
+    entry.index = m_clients.size();
+    entry.nick = Str::SanitizeUtf8(client->user.username);
+    entry.ip = client->GetIpAddress();
+    entry.colour = client->user.colournum;
+
+    ++m_nick_count[entry.nick];
+    ++m_ip_count[entry.ip];
+    this->AddColour(entry.colour);
+
+    m_clients.push_back(client);
+    m_by_id[client->user.uniqueid] = entry;
+}
+
+void ClientRegistry::Remove(Client* client) {
+    auto found = m_by_id.find(client->user.uniqueid);
+    if (found == m_by_id.end()) {
+        return;
+    }
+    const Entry& entry = found->second;
+    assert(m_clients[entry.index] == client);
+
+    DecrementCount(m_nick_count, entry.nick);
+    DecrementCount(m_ip_count, entry.ip);
+    this->RemoveColour(entry.colour);
+
+    // Fill the gap with the last client
+    Client* last = m_clients.back();
+    m_clients[entry.index] = last;
+    m_by_id[last->user.uniqueid].index = entry.index;
+    m_clients.pop_back();
+
+    m_by_id.erase(found);
+}
+
+Client* ClientRegistry::FindById(unsigned int uid) const {
+    auto found = m_by_id.find(uid);
+    return (found != m_by_id.end()) ? m_clients[found->second.index] : nullptr;
+}
+
+bool ClientRegistry::IsNickTaken(std::string const& sanitized_nick) const {
+    return m_nick_count.find(sanitized_nick) != m_nick_count.end();
+}
+
+size_t ClientRegistry::CountByIp(std::string const& ip) const {
+    auto found = m_ip_count.find(ip);
+    return (found != m_ip_count.end()) ? found->second : 0;
+}
+
+int ClientRegistry::GetFreeColour() const {
+    for (size_t w = 0; w < m_colour_bits.size(); ++w) {
+        uint64_t free_bits = ~m_colour_bits[w];
+        if (free_bits != 0) {
+            int bit = 0;
+            while ((free_bits & 1) == 0) {
+                free_bits >>= 1;
+                ++bit;
+            }
+            return static_cast<int>(w * 64) + bit;
+        }
+    }
+    return static_cast<int>(m_colour_bits.size() * 64);
+}
+
+void ClientRegistry::UpdateNick(Client* client, std::string const& sanitized_nick) {
+    auto found = m_by_id.find(client->user.uniqueid);
+    if (found == m_by_id.end()) {
+        return;
+    }
+    DecrementCount(m_nick_count, found->second.nick);
+    found->second.nick = sanitized_nick;
+    ++m_nick_count[sanitized_nick];
+}
+
+void ClientRegistry::UpdateColour(Client* client, int colour) {
+    auto found = m_by_id.find(client->user.uniqueid);
+    if (found == m_by_id.end()) {
+        return;
+    }
+    this->RemoveColour(found->second.colour);
+    found->second.colour = colour;
+    this->AddColour(colour);
+}
+
+void ClientRegistry::AddColour(int colour) {
+    if (colour < 0 || colour > MAX_TRACKED_COLOUR) {
+        return;
+    }
+    if (static_cast<size_t>(colour) >= m_colour_count.size()) {
+        m_colour_count.resize(colour + 1, 0);
+        m_colour_bits.resize(colour / 64 + 1, 0);
+    }
+    if (m_colour_count[colour]++ == 0) {
+        m_colour_bits[colour / 64] |= (uint64_t(1) << (colour % 64));
+    }
+}
+
+void ClientRegistry::RemoveColour(int colour) {
+    if (colour < 0 || static_cast<size_t>(colour) >= m_colour_count.size() || m_colour_count[colour] == 0) {
+        return;
+    }
+    if (--m_colour_count[colour] == 0) {
+        m_colour_bits[colour / 64] &= ~(uint64_t(1) << (colour % 64));
+    }
+}
@@ -0,0 +1,76 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "prerequisites.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Connected clients with constant-time lookups: a dense array for iteration (removal
+/// swaps the last client into the gap), hash indexes on user ID, sanitized nickname and
+/// IP address, and a bitmap of the player colours in use.
+/// Not thread-safe; the Sequencer guards it with the clients-mutex.
+class ClientRegistry {
+public:
+    typedef std::vector<Client*>::const_iterator const_iterator;
+
+    static const int MAX_TRACKED_COLOUR = 1023; //!< Script-assigned colours beyond are not tracked
+
+    void        Reserve(size_t count);
+    void        Add(Client* client);    //!< Call once user ID, nickname and colour are final.
+    void        Remove(Client* client);
+
+    Client*     FindById(unsigned int uid) const;
+    bool        IsNickTaken(std::string const& sanitized_nick) const;
+    size_t      CountByIp(std::string const& ip) const;
+    int         GetFreeColour() const;  //!< Lowest colour nobody uses.
+
+    void        UpdateNick(Client* client, std::string const& sanitized_nick);
+    void        UpdateColour(Client* client, int colour);
+
+    // Container interface, so the Sequencer can keep iterating like over a vector.
+    size_t          size() const                 { return m_clients.size(); }
+    bool            empty() const                { return m_clients.empty(); }
+    Client*         operator[](size_t i) const   { return m_clients[i]; }
+    const_iterator  begin() const                { return m_clients.begin(); }
+    const_iterator  end() const                  { return m_clients.end(); }
+
+private:
+    struct Entry {
+        size_t       index;     //!< Position in `m_clients`
+        std::string  nick;      //!< Sanitized, as indexed
+        std::string  ip;
+        int          colour;
+    };
+
+    void        AddColour(int colour);
+    void        RemoveColour(int colour);
+
+    std::vector<Client*>                          m_clients;
+    std::unordered_map<unsigned int, Entry>       m_by_id;
+    std::unordered_map<std::string, unsigned int> m_nick_count;
+    std::unordered_map<std::string, unsigned int> m_ip_count;
+    std::vector<unsigned int>                     m_colour_count;
+    std::vector<uint64_t>                         m_colour_bits;  //!< Bit set = colour in use
+};
@@ -0,0 +1,146 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "compression.h"
+
+#include "rornet.h"
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef WITH_LZ4
+#   include <lz4.h>
+#endif
+
+static const size_t SIZE_FIELD_LEN = sizeof(uint32_t);
+
+bool PayloadCompressor::IsAvailable()
+{
+#ifdef WITH_LZ4
+    return true;
+#else
+    return false;
+#endif
+}
+
+PayloadCompressor::PayloadCompressor()
+#ifdef WITH_LZ4
+    : m_stream(nullptr)
+#endif
+{}
+
+PayloadCompressor::~PayloadCompressor()
+{
+#ifdef WITH_LZ4
+    if (m_stream != nullptr) {
+        LZ4_freeStream(m_stream);
+    }
+#endif
+}
+
+MessagePtr PayloadCompressor::Compress(MessagePtr const& msg)
+{
+    if (msg->GetWireLength() < MIN_INPUT_BYTES) {
+        return msg;
+    }
+    MessagePtr compressed = this->CompressRange(&msg, 1);
+    return (compressed != nullptr) ? compressed : msg;
+}
+
+void PayloadCompressor::CompressBatch(std::vector<MessagePtr>& batch)
+{
+    m_result.clear();
+    size_t pos = 0;
+    while (pos < batch.size()) {
+        // Group as many messages as fit the receiver's limit
+        size_t end = pos;
+        size_t raw_len = 0;
+        while (end < batch.size() && raw_len + batch[end]->GetWireLength() <= RORNET_MAX_COMPRESSED_INPUT) {
+            raw_len += batch[end]->GetWireLength();
+            ++end;
+        }
+        if (end == pos) {
+            end = pos + 1; // Can't happen with messages of legal size, but don't get stuck
+        }
+
+        MessagePtr compressed;
+        if (raw_len >= MIN_INPUT_BYTES) {
+            compressed = this->CompressRange(&batch[pos], end - pos);
+        }
+        if (compressed != nullptr) {
+            m_result.push_back(std::move(compressed));
+        } else {
+            for (size_t i = pos; i < end; ++i) {
+                m_result.push_back(std::move(batch[i]));
+            }
+        }
+        pos = end;
+    }
+    batch.swap(m_result);
+    m_result.clear(); // Release the buffers
+}
+
+MessagePtr PayloadCompressor::CompressRange(const MessagePtr *msgs, size_t count)
+{
+#ifdef WITH_LZ4
+    m_input.clear();
+    for (size_t i = 0; i < count; ++i) {
+        m_input.insert(m_input.end(), msgs[i]->GetWireData(), msgs[i]->GetWireData() + msgs[i]->GetWireLength());
+    }
+    if (m_input.size() > RORNET_MAX_COMPRESSED_INPUT) {
+        return nullptr;
+    }
+
+    if (m_stream == nullptr) {
+        m_stream = LZ4_createStream();
+        if (m_stream == nullptr) {
+            return nullptr;
+        }
+    }
+    LZ4_loadDict(m_stream, RoRnet::RORNET_LZ4_DICTIONARY, sizeof(RoRnet::RORNET_LZ4_DICTIONARY)); // Resets the stream
+
+    // Must come out smaller than the input, and below the senders' message limit
+    size_t capacity = m_input.size() - 1;
+    if (capacity > RORNET_MAX_MESSAGE_LENGTH - 1) {
+        capacity = RORNET_MAX_MESSAGE_LENGTH - 1;
+    }
+    if (capacity <= SIZE_FIELD_LEN + sizeof(RoRnet::Header)) {
+        return nullptr;
+    }
+    capacity -= SIZE_FIELD_LEN + sizeof(RoRnet::Header);
+
+    m_output.resize(SIZE_FIELD_LEN + capacity);
+    const int block_len = LZ4_compress_fast_continue(m_stream, m_input.data(), m_output.data() + SIZE_FIELD_LEN,
+                                                     static_cast<int>(m_input.size()), static_cast<int>(capacity), 1);
+    if (block_len <= 0) {
+        return nullptr;
+    }
+    const uint32_t raw_len = static_cast<uint32_t>(m_input.size());
+    std::memcpy(m_output.data(), &raw_len, SIZE_FIELD_LEN);
+
+    // The original source is only informative; each inner message carries its own
+    return Message::Create(RoRnet::MSG2_COMPRESSED, msgs[0]->GetSource(), 0,
+                           static_cast<unsigned int>(SIZE_FIELD_LEN + block_len), m_output.data());
+#else
+    (void)msgs;
+    (void)count;
+    return nullptr;
+#endif
+}
@@ -0,0 +1,65 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/// @file LZ4 compression of outgoing data for clients which negotiated it (see `RoRnet::MSG2_COMPRESSED`)
+
+#include "message.h"
+
+#include <vector>
+
+#define COMPRESSION_SESSION_OPTION "lz4" //!< Token in `RoRnet::UserInfo::sessionoptions`
+
+#ifdef WITH_LZ4
+union LZ4_stream_u;
+#endif
+
+/// One instance per recipient, used by whoever sends its queue (single thread).
+/// Packs messages, alone or several consecutive ones, into `MSG2_COMPRESSED` wherever that
+/// is smaller on the wire. Small messages are left alone unless they can be grouped.
+/// Without LZ4 support compiled in, nothing is ever compressed.
+class PayloadCompressor
+{
+public:
+    static const size_t MIN_INPUT_BYTES = 256; //!< Less isn't worth the CPU
+
+    static bool IsAvailable();
+
+    PayloadCompressor();
+    ~PayloadCompressor();
+
+    /// @return The message to send in place of `msg` - itself or a compressed one.
+    MessagePtr Compress(MessagePtr const& msg);
+
+    /// Replaces runs of consecutive messages in `batch` by their compressed form.
+    void CompressBatch(std::vector<MessagePtr>& batch);
+
+private:
+    /// @return Null if not worth it
+    MessagePtr CompressRange(const MessagePtr *msgs, size_t count);
+
+#ifdef WITH_LZ4
+    LZ4_stream_u*            m_stream; //!< Created on first use
+#endif
+    std::vector<char>        m_input;
+    std::vector<char>        m_output;
+    std::vector<MessagePtr>  m_result;
+};
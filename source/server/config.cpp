@@ -23,9 +23,12 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 #include "logger.h"
 #include "sequencer.h"
 #include "sha1_util.h"
+#include "aoi.h"
+#include "compression.h"
 #include "spamfilter.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 
@@ -68,12 +71,21 @@ static unsigned int s_max_clients(16);
 static unsigned int s_heartbeat_retry_count(5);
 static unsigned int s_heartbeat_retry_seconds(15);
 static unsigned int s_heartbeat_interval_sec(60);
+static unsigned int s_network_threads(2);
+static unsigned int s_task_threads(4);
 
 static bool s_print_stats(false);
 static bool s_foreground(false);
 static bool s_show_version(false);
 static bool s_show_help(false);
 static bool s_ranked_only(false);
+static bool s_hub_thread(false);
+static bool s_compression(true);
+static unsigned int s_tick_rate(0); // 0 = relay stream data on arrival
+static bool s_udp_channel(false);
+static unsigned int s_queue_soft_limit_kb(128);  // Per client; above it stream updates are rate-limited
+static unsigned int s_queue_hard_limit_kb(8192); // Per client; above it the client is disconnected
+static std::string s_bridge_key;
 
 // Vehicle spawn limits
 static size_t s_max_vehicles(20);
@@ -81,15 +93,32 @@ static int    s_spawn_interval_sec(0);
 static int    s_max_spawn_rate(0);
 
 static ServerType s_server_mode(SERVER_AUTO);
+#ifdef __linux__
+static NetworkBackend s_network_backend(NETWORK_BACKEND_EPOLL);
+#else
+static NetworkBackend s_network_backend(NETWORK_BACKEND_THREADS);
+#endif
 
 static int s_spamfilter_msg_interval_sec(0); // 0 disables spamfilter
 static int s_spamfilter_msg_count(0); // 0 disables spamfilter
 static int s_spamfilter_gag_duration_sec(10);
 
+static float s_aoi_near_radius(0.f); // 0 disables area of interest
+static float s_aoi_far_radius(0.f); // 0 = no limit
+static unsigned int s_aoi_mid_interval(4);
+
+// Rooms
+static std::vector<std::string> s_room_files;
+static std::vector<RoomConfig> s_rooms;
+static unsigned int s_bridge_port(0);
+static std::vector<std::string> s_bridge_peers;
+
 // ============================== Functions ===================================
 
 namespace Config {
 
+    bool SetupRooms();
+
     void ShowHelp() {
         printf(
                 "Usage: rorserver [OPTIONS]\n"
@@ -117,6 +146,18 @@ namespace Config {
                         " -log-file <server.log>       Sets the filename of the log\n"
                         " -script-file <script.as>     Server script to execute\n"
                         " -print-stats                 Prints stats to the console\n"
+                        " -room <room.cfg>             Hosts an additional room with the settings in <room.cfg>\n"
+                        " -network-backend <threads|epoll> Client I/O model (defaults to epoll on Linux, threads elsewhere)\n"
+                        " -network-threads <num>       Number of epoll worker threads (defaults to 2)\n"
+                        " -task-threads <num>          Number of threads for background work (defaults to 4)\n"
+                        " -hub-thread                  Route all messages through a single hub thread\n"
+                        " -tick-rate <hz>              Relay discardable stream data at a fixed rate (defaults to 0 = on arrival)\n"
+                        " -udp-channel                 Offer clients UDP for discardable stream data (Linux only)\n"
+                        " -queue-soft-limit <kB>       Outgoing queue size per client which rate-limits stream data (defaults to 128)\n"
+                        " -queue-hard-limit <kB>       Outgoing queue size per client which disconnects it (defaults to 8192)\n"
+                        " -bridge-port <port>          Accept links from other server nodes on <port>\n"
+                        " -bridge-peer <host:port>     Link with the server node at <host:port> (repeatable)\n"
+                        " -bridge-key <key>            Shared key of the linked server nodes\n"
                         " -version                     Prints the server version numbers\n"
                         " -fg                          Starts the server in the foreground (background by default)\n"
                         " -resource-dir <path>         Sets the path to the resource directory\n"
@@ -189,7 +230,35 @@ namespace Config {
             return 0;
         }
 
+        if (getNetworkBackend() == NETWORK_BACKEND_EPOLL) {
+            Logger::Log(LOG_INFO, "network:    epoll, %u worker threads", getNetworkThreads());
+        } else {
+            Logger::Log(LOG_INFO, "network:    thread per client");
+        }
+        Logger::Log(LOG_INFO, "background: %u task threads", getTaskThreads());
+        if (getHubThread()) {
+            Logger::Log(LOG_INFO, "routing:    hub thread");
+        }
+        if (getUdpChannel()) {
+            Logger::Log(LOG_INFO, "UDP channel: on port %u, for clients which request it", getListenPort());
+        }
+        if (getTickRate() > 0) {
+            Logger::Log(LOG_INFO, "stream relay: latest state every tick, %u ticks per second", getTickRate());
+        }
+        if (getQueueHardLimitKb() <= getQueueSoftLimitKb()) {
+            Logger::Log(LOG_WARN, "queue-hard-limit must be above queue-soft-limit, using %u kB", getQueueSoftLimitKb() * 2);
+            setQueueHardLimitKb(getQueueSoftLimitKb() * 2);
+        }
+        Logger::Log(LOG_INFO, "outgoing queue limits: %u kB (rate-limit stream data), %u kB (disconnect)",
+                    getQueueSoftLimitKb(), getQueueHardLimitKb());
+        if (getCompression() && PayloadCompressor::IsAvailable()) {
+            Logger::Log(LOG_INFO, "compression: LZ4 for clients which request it");
+        } else {
+            Logger::Log(LOG_INFO, "compression: disabled");
+        }
+
         SpamFilter::CheckConfig();
+        AreaOfInterest::CheckConfig();
 
         Logger::Log(LOG_INFO, "server is%s password protected",
                     getPublicPassword().empty() ? " NOT" : "");
@@ -198,7 +267,16 @@ namespace Config {
                     getRankedOnly() ? "" : " NOT");
 
         return getMaxClients() && getListenPort() && !getIPAddr().empty() &&
-               !getTerrainName().empty();
+               !getTerrainName().empty() && SetupRooms();
+    }
+
+    inline void SetConfNetworkBackend(std::string const &val) {
+        if (val.compare("epoll") == 0)
+            setNetworkBackend(NETWORK_BACKEND_EPOLL);
+        else if (val.compare("threads") == 0)
+            setNetworkBackend(NETWORK_BACKEND_THREADS);
+        else
+            Logger::Log(LOG_WARN, "Unknown network backend '%s', using the default", val.c_str());
     }
 
 #define HANDLE_ARG_VALUE(_NAME_, _BLOCK_)           \
@@ -268,8 +346,20 @@ namespace Config {
             HANDLE_ARG_VALUE("max-clients", { setMaxClients(atoi(value)); });
             HANDLE_ARG_VALUE("vehicle-limit", { setMaxVehicles(atoi(value)); });
             HANDLE_ARG_VALUE("port", { setListenPort(atoi(value)); });
+            HANDLE_ARG_VALUE("room", { s_room_files.push_back(value); });
+            HANDLE_ARG_VALUE("network-backend", { SetConfNetworkBackend(value); });
+            HANDLE_ARG_VALUE("network-threads", { setNetworkThreads(atoi(value)); });
+            HANDLE_ARG_VALUE("task-threads", { setTaskThreads(atoi(value)); });
+            HANDLE_ARG_VALUE("tick-rate", { setTickRate(atoi(value)); });
+            HANDLE_ARG_VALUE("queue-soft-limit", { setQueueSoftLimitKb(atoi(value)); });
+            HANDLE_ARG_VALUE("queue-hard-limit", { setQueueHardLimitKb(atoi(value)); });
+            HANDLE_ARG_VALUE("bridge-port", { s_bridge_port = atoi(value); });
+            HANDLE_ARG_VALUE("bridge-peer", { s_bridge_peers.push_back(value); });
+            HANDLE_ARG_VALUE("bridge-key", { setBridgeKey(value); });
 
             HANDLE_ARG_FLAG ("print-stats", { setPrintStats(true); });
+            HANDLE_ARG_FLAG ("hub-thread", { setHubThread(true); });
+            HANDLE_ARG_FLAG ("udp-channel", { setUdpChannel(true); });
             HANDLE_ARG_FLAG ("foreground", { setForeground(true); });
             HANDLE_ARG_FLAG ("fg", { setForeground(true); });
             HANDLE_ARG_FLAG ("inet", { setServerMode(SERVER_INET); });
@@ -297,6 +387,8 @@ namespace Config {
 
     bool isPublic() { return !getPublicPassword().empty(); }
 
+    std::vector<RoomConfig> const &getRooms() { return s_rooms; }
+
     unsigned int getMaxClients() { return s_max_clients; }
 
     const std::string &getServerName() { return s_server_name; }
@@ -317,6 +409,26 @@ namespace Config {
 
     bool getPrintStats() { return s_print_stats; }
 
+    NetworkBackend getNetworkBackend() { return s_network_backend; }
+
+    unsigned int getNetworkThreads() { return s_network_threads; }
+
+    unsigned int getTaskThreads() { return s_task_threads; }
+
+    bool getHubThread() { return s_hub_thread; }
+
+    bool getCompression() { return s_compression; }
+
+    unsigned int getTickRate() { return s_tick_rate; }
+
+    bool getUdpChannel() { return s_udp_channel; }
+
+    unsigned int getQueueSoftLimitKb() { return s_queue_soft_limit_kb; }
+
+    unsigned int getQueueHardLimitKb() { return s_queue_hard_limit_kb; }
+
+    std::string const &getBridgeKey() { return s_bridge_key; }
+
     bool getForeground() { return s_foreground; }
 
     bool getRankedOnly() { return s_ranked_only; }
@@ -365,6 +477,12 @@ namespace Config {
 
     int getSpamFilterGagDurationSec() { return s_spamfilter_gag_duration_sec; }
 
+    float getAoiNearRadius() { return s_aoi_near_radius; }
+
+    float getAoiFarRadius() { return s_aoi_far_radius; }
+
+    unsigned int getAoiMidInterval() { return s_aoi_mid_interval; }
+
     bool setScriptName(const std::string &name) {
         if (name.empty()) return false;
         s_scriptname = name;
@@ -414,6 +532,26 @@ namespace Config {
 
     void setPrintStats(bool value) { s_print_stats = value; }
 
+    void setNetworkBackend(NetworkBackend backend) { s_network_backend = backend; }
+
+    void setNetworkThreads(unsigned int num) { s_network_threads = (num > 0) ? num : 1; }
+
+    void setTaskThreads(unsigned int num) { s_task_threads = (num > 0) ? num : 1; }
+
+    void setHubThread(bool value) { s_hub_thread = value; }
+
+    void setCompression(bool value) { s_compression = value; }
+
+    void setTickRate(unsigned int hz) { s_tick_rate = (hz > 1000) ? 1000 : hz; }
+
+    void setUdpChannel(bool value) { s_udp_channel = value; }
+
+    void setBridgeKey(const std::string &key) { s_bridge_key = key; }
+
+    void setQueueSoftLimitKb(unsigned int kb) { s_queue_soft_limit_kb = (kb > 0) ? kb : 1; }
+
+    void setQueueHardLimitKb(unsigned int kb) { s_queue_hard_limit_kb = kb; }
+
     void setAuthFile(const std::string &file) { s_authfile = file; }
 
     void setMOTDFile(const std::string &file) { s_motdfile = file; }
@@ -446,6 +584,12 @@ namespace Config {
 
     void setSpamFilterGagDurationSec(int sec) { s_spamfilter_gag_duration_sec = sec; }
 
+    void setAoiNearRadius(float meters) { s_aoi_near_radius = std::max(meters, 0.f); }
+
+    void setAoiFarRadius(float meters) { s_aoi_far_radius = std::max(meters, 0.f); }
+
+    void setAoiMidInterval(unsigned int num) { s_aoi_mid_interval = (num > 0) ? num : 1; }
+
     void setHeartbeatIntervalSec(unsigned sec) {
         s_heartbeat_interval_sec = sec;
         Logger::Log(LOG_VERBOSE, "Hearbeat interval is %d seconds", sec);
@@ -499,6 +643,7 @@ namespace Config {
         else if (strcmp(key, "password") == 0) { setPublicPass(VAL_STR (value)); }
         else if (strcmp(key, "ip") == 0) { setIPAddr(VAL_STR (value)); }
         else if (strcmp(key, "port") == 0) { setListenPort(VAL_INT (value)); }
+        else if (strcmp(key, "room") == 0) { s_room_files.push_back(VAL_STR (value)); }
         else if (strcmp(key, "mode") == 0) { SetConfServerMode(VAL_STR (value)); }
         else if (strcmp(key, "printstats") == 0) { setPrintStats(VAL_BOOL(value)); }
         else if (strcmp(key, "foreground") == 0) { setForeground(VAL_BOOL(value)); }
@@ -518,6 +663,18 @@ namespace Config {
         else if (strcmp(key, "verbosity") == 0) { Logger::SetLogLevel(LOGTYPE_DISPLAY, (LogLevel) VAL_INT(value)); }
         else if (strcmp(key, "logverbosity") == 0) { Logger::SetLogLevel(LOGTYPE_FILE, (LogLevel) VAL_INT(value)); }
         else if (strcmp(key, "heartbeat-interval") == 0) { setHeartbeatIntervalSec(VAL_INT(value)); }
+        else if (strcmp(key, "network-backend") == 0) { SetConfNetworkBackend(VAL_STR (value)); }
+        else if (strcmp(key, "network-threads") == 0) { setNetworkThreads(VAL_INT (value)); }
+        else if (strcmp(key, "task-threads") == 0) { setTaskThreads(VAL_INT (value)); }
+        else if (strcmp(key, "hub-thread") == 0) { setHubThread(VAL_BOOL(value)); }
+        else if (strcmp(key, "compression") == 0) { setCompression(VAL_BOOL(value)); }
+        else if (strcmp(key, "tick-rate") == 0) { setTickRate(VAL_INT(value)); }
+        else if (strcmp(key, "udp-channel") == 0) { setUdpChannel(VAL_BOOL(value)); }
+        else if (strcmp(key, "queue-soft-limit") == 0) { setQueueSoftLimitKb(VAL_INT(value)); }
+        else if (strcmp(key, "queue-hard-limit") == 0) { setQueueHardLimitKb(VAL_INT(value)); }
+        else if (strcmp(key, "bridge-port") == 0) { s_bridge_port = VAL_INT(value); }
+        else if (strcmp(key, "bridge-peer") == 0) { s_bridge_peers.push_back(VAL_STR (value)); }
+        else if (strcmp(key, "bridge-key") == 0) { setBridgeKey(VAL_STR (value)); }
 
         // Vehicle spawn limits
         else if (strcmp(key, "vehiclelimit") == 0) { setMaxVehicles(VAL_INT (value)); }
@@ -529,18 +686,44 @@ namespace Config {
         else if (strcmp(key, "spamfilter-msg-count")    == 0) { setSpamFilterMsgCount(VAL_INT(value)); }
         else if (strcmp(key, "spamfilter-gag-duration") == 0) { setSpamFilterGagDurationSec(VAL_INT(value)); }
 
+        // Area of interest
+        else if (strcmp(key, "aoi-near-radius")  == 0) { setAoiNearRadius(static_cast<float>(atof(value))); }
+        else if (strcmp(key, "aoi-far-radius")   == 0) { setAoiFarRadius(static_cast<float>(atof(value))); }
+        else if (strcmp(key, "aoi-mid-interval") == 0) { setAoiMidInterval(VAL_INT(value)); }
+
         else {
             Logger::Log(LOG_WARN, "Unknown key '%s' (value: '%s') in config file.", key, value);
         }
     }
 
-    void LoadConfigFile(const std::string &filename) {
-        Logger::Log(LOG_INFO, "loading config file %s ...", filename.c_str());
+    // Settings which a room file may override
+    static bool IsRoomKey(const char *key) {
+        static const char *room_keys[] = {
+            "name", "terrain", "port", "slots", "password", "scriptname",
+            "motdfile", "rulesfile", "blacklistfile", "vehiclelimit", "bridge-port", "bridge-peer"
+        };
+        for (const char *room_key : room_keys) {
+            if (strcmp(key, room_key) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void ProcessRoomEntry(const char *key, const char *value) {
+        // Unlike in the main config, an empty value means "none" - a room may drop what it inherited
+        if (strcmp(key, "password") == 0 && value[0] == '\0') { s_public_password.clear(); }
+        else if (strcmp(key, "scriptname") == 0 && value[0] == '\0') { s_scriptname.clear(); }
+        else { ProcessConfigEntry(key, value); }
+    }
+
+    static bool ParseConfigFile(const std::string &filename, bool is_room) {
+        Logger::Log(LOG_INFO, "loading %s file %s ...", is_room ? "room" : "config", filename.c_str());
 
         FILE *f = fopen(filename.c_str(), "r");
         if (f == nullptr) {
-            Logger::Log(LOG_ERROR, "Failed to open config file %s ...", filename.c_str());
-            return;
+            Logger::Log(LOG_ERROR, "Failed to open %s file %s ...", is_room ? "room" : "config", filename.c_str());
+            return false;
         }
 
         size_t line_num = 0;
@@ -574,13 +757,120 @@ namespace Config {
             Str::TrimAscii(val_start, val_end);
             *key_end = '\0';
             *val_end = '\0';
-            ProcessConfigEntry(key_start, val_start);
+            if (!is_room) {
+                ProcessConfigEntry(key_start, val_start);
+            } else if (IsRoomKey(key_start)) {
+                ProcessRoomEntry(key_start, val_start);
+            } else {
+                Logger::Log(LOG_WARN, "Key '%s' can't be set per room, ignored (room file %s)", key_start,
+                            filename.c_str());
+            }
         }
 
         if (!feof(f)) {
             Logger::Log(LOG_ERROR, "Error reading line %u from config file %s", line_num, filename.c_str());
         }
         fclose(f);
+        return true;
+    }
+
+    void LoadConfigFile(const std::string &filename) {
+        ParseConfigFile(filename, /*is_room=*/false);
+    }
+
+    // The room settings live in the same variables as the top-level ones; a room file is
+    // applied on top of a copy of the first room, then the first room is put back.
+    static RoomConfig CaptureRoom() {
+        RoomConfig room;
+        room.name = s_server_name;
+        room.terrain = s_terrain_name;
+        room.password = s_public_password;
+        room.script = s_scriptname;
+        room.motd_file = s_motdfile;
+        room.rules_file = s_rulesfile;
+        room.blacklist_file = s_blacklistfile;
+        room.port = s_listen_port;
+        room.max_clients = s_max_clients;
+        room.max_vehicles = static_cast<unsigned int>(s_max_vehicles);
+        room.bridge_port = s_bridge_port;
+        room.bridge_peers = s_bridge_peers;
+        return room;
+    }
+
+    static void ApplyRoom(RoomConfig const &room) {
+        s_server_name = room.name;
+        s_terrain_name = room.terrain;
+        s_public_password = room.password;
+        s_scriptname = room.script;
+        s_motdfile = room.motd_file;
+        s_rulesfile = room.rules_file;
+        s_blacklistfile = room.blacklist_file;
+        s_listen_port = room.port;
+        s_max_clients = room.max_clients;
+        s_max_vehicles = room.max_vehicles;
+        s_bridge_port = room.bridge_port;
+        s_bridge_peers = room.bridge_peers;
+    }
+
+    bool SetupRooms() {
+        s_rooms.clear();
+        s_rooms.push_back(CaptureRoom());
+
+        for (std::string const &filename : s_room_files) {
+            RoomConfig defaults = s_rooms.front();
+            defaults.port = 0; // Each room needs its own
+            defaults.bridge_port = 0;
+            defaults.bridge_peers.clear();
+            ApplyRoom(defaults);
+            const bool loaded = ParseConfigFile(filename, /*is_room=*/true);
+            RoomConfig room = CaptureRoom();
+            ApplyRoom(s_rooms.front());
+
+            if (!loaded) {
+                return false;
+            }
+            if (room.port == 0) {
+                Logger::Log(LOG_ERROR, "Room file %s: port not specified", filename.c_str());
+                return false;
+            }
+            for (RoomConfig const &other : s_rooms) {
+                if (other.port == room.port) {
+                    Logger::Log(LOG_ERROR, "Room file %s: port %u is already used by room '%s'", filename.c_str(),
+                                room.port, other.name.c_str());
+                    return false;
+                }
+            }
+            s_rooms.push_back(room);
+        }
+
+        for (RoomConfig const &room : s_rooms) {
+            if (room.bridge_port == 0) {
+                continue;
+            }
+            for (RoomConfig const &other : s_rooms) {
+                if (other.port == room.bridge_port || (&other != &room && other.bridge_port == room.bridge_port)) {
+                    Logger::Log(LOG_ERROR, "Room '%s': bridge port %u is already used by room '%s'", room.name.c_str(),
+                                room.bridge_port, other.name.c_str());
+                    return false;
+                }
+            }
+        }
+
+        for (RoomConfig const &room : s_rooms) {
+            if (room.bridge_port != 0 || !room.bridge_peers.empty()) {
+                Logger::Log(LOG_INFO, "bridge:     room '%s', links accepted on port %u (0 = none), %zu peers%s",
+                            room.name.c_str(), room.bridge_port, room.bridge_peers.size(),
+                            getBridgeKey().empty() ? ", no key" : "");
+            }
+        }
+
+        if (s_rooms.size() > 1) {
+            for (RoomConfig const &room : s_rooms) {
+                Logger::Log(LOG_INFO, "room:       '%s', terrain %s, port %u, %u slots%s", room.name.c_str(),
+                            room.terrain.c_str(), room.port, room.max_clients, room.HasPassword() ? ", password" : "");
+            }
+        }
+        return true;
     }
 
 } //namespace Config
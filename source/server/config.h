@@ -22,6 +22,8 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 
 #include "UnicodeStrings.h"
 
+#include <vector>
+
 // server modes
 enum ServerType {
     SERVER_LAN = 0,
@@ -29,6 +31,31 @@ enum ServerType {
     SERVER_AUTO
 };
 
+// network backends
+enum NetworkBackend {
+    NETWORK_BACKEND_THREADS = 0, //!< One receiver and one broadcaster thread per client
+    NETWORK_BACKEND_EPOLL        //!< Fixed set of epoll worker threads (Linux only)
+};
+
+/// Settings of one hosted room. The first room is made of the top-level settings;
+/// each `room` config file adds another one, starting from a copy of the first.
+struct RoomConfig {
+    std::string  name;
+    std::string  terrain;
+    std::string  password;       //!< SHA1 hash; empty if the room is public
+    std::string  script;         //!< Empty if scripting is disabled
+    std::string  motd_file;
+    std::string  rules_file;
+    std::string  blacklist_file;
+    unsigned int port = 0;
+    unsigned int max_clients = 0;
+    unsigned int max_vehicles = 0;
+    unsigned int bridge_port = 0;                //!< Accepts links from other nodes; 0 if not
+    std::vector<std::string> bridge_peers;       //!< "host:port" of the nodes to link with
+
+    bool HasPassword() const { return !password.empty(); }
+};
+
 namespace Config {
 
 //! runs a check that all the required fields are present
@@ -43,6 +70,9 @@ namespace Config {
 //! checks if a password has been set for server access
     bool isPublic();
 
+//! the rooms hosted by this process; valid after checkConfig()
+    std::vector<RoomConfig> const &getRooms();
+
 //! getter function
 //!@{
     unsigned int getMaxClients();
@@ -63,6 +93,20 @@ namespace Config {
 
     bool getPrintStats();
 
+    NetworkBackend getNetworkBackend();
+
+    unsigned int getNetworkThreads();
+
+    unsigned int getTaskThreads();
+
+    bool getHubThread();
+    bool getCompression();
+    unsigned int getTickRate();
+    bool getUdpChannel();
+    unsigned int getQueueSoftLimitKb();
+    unsigned int getQueueHardLimitKb();
+    std::string const &getBridgeKey();
+
     bool getEnableScripting();
 
     bool getForeground();
@@ -110,6 +154,11 @@ namespace Config {
     int getSpamFilterMsgIntervalSec();
     int getSpamFilterMsgCount();
     int getSpamFilterGagDurationSec();
+
+    // Area of interest
+    float getAoiNearRadius();
+    float getAoiFarRadius();
+    unsigned int getAoiMidInterval();
 //!@}
 
 //! setter functions
@@ -132,6 +181,20 @@ namespace Config {
 
     void setPrintStats(bool value);
 
+    void setNetworkBackend(NetworkBackend backend);
+
+    void setNetworkThreads(unsigned int num);
+
+    void setTaskThreads(unsigned int num);
+
+    void setHubThread(bool value);
+    void setCompression(bool value);
+    void setTickRate(unsigned int hz);
+    void setUdpChannel(bool value);
+    void setBridgeKey(const std::string &key);
+    void setQueueSoftLimitKb(unsigned int kb);
+    void setQueueHardLimitKb(unsigned int kb);
+
     void setHeartbeatIntervalSec(unsigned sec);
 
     void setForeground(bool value);
@@ -167,6 +230,11 @@ namespace Config {
     void setSpamFilterMsgIntervalSec(int sec);
     void setSpamFilterMsgCount(int count);
     void setSpamFilterGagDurationSec(int sec);
+
+    // Area of interest
+    void setAoiNearRadius(float meters);
+    void setAoiFarRadius(float meters);
+    void setAoiMidInterval(unsigned int num);
 //!@}
 
 } // namespace Config
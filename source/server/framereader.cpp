@@ -0,0 +1,92 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "framereader.h"
+
+#include <cassert>
+#include <cstring>
+
+FrameReader::Result FrameReader::NextFrame(RoRnet::Header &out_header, char *&out_payload) {
+    this->RestoreTerminatedByte();
+
+    const size_t available = m_write_pos - m_read_pos;
+    if (available < sizeof(RoRnet::Header)) {
+        return Result::NEED_DATA;
+    }
+
+    // The buffer has no alignment guarantees - copy the header out
+    std::memcpy(&out_header, m_buffer.data() + m_read_pos, sizeof(RoRnet::Header));
+    if (out_header.size > RORNET_MAX_MESSAGE_LENGTH) {
+        return Result::OVERSIZED;
+    }
+    const size_t frame_len = sizeof(RoRnet::Header) + out_header.size;
+    if (available < frame_len) {
+        return Result::NEED_DATA;
+    }
+
+    out_payload = m_buffer.data() + m_read_pos + sizeof(RoRnet::Header);
+    m_read_pos += frame_len;
+
+    // Terminate the payload; this overwrites the first byte of the next frame, which is
+    // put back before the buffer is used again.
+    m_terminated_pos = m_read_pos;
+    m_terminated_byte = m_buffer[m_read_pos];
+    m_buffer[m_read_pos] = '\0';
+    m_is_terminated = true;
+    return Result::FRAME;
+}
+
+char* FrameReader::GetWritePtr() {
+    this->RestoreTerminatedByte();
+
+    if (m_buffer.empty()) {
+        m_buffer.resize(BUFFER_SIZE + 1);
+    }
+
+    if (m_read_pos == m_write_pos) {
+        m_read_pos = 0;
+        m_write_pos = 0;
+    } else if (BUFFER_SIZE - m_write_pos < sizeof(RoRnet::Header) + RORNET_MAX_MESSAGE_LENGTH) {
+        // Move the incomplete frame to the front (owners parse all complete frames before receiving)
+        const size_t pending = m_write_pos - m_read_pos;
+        std::memmove(m_buffer.data(), m_buffer.data() + m_read_pos, pending);
+        m_read_pos = 0;
+        m_write_pos = pending;
+    }
+    return m_buffer.data() + m_write_pos;
+}
+
+void FrameReader::CommitWrite(size_t len) {
+    assert(m_write_pos + len <= BUFFER_SIZE);
+    m_write_pos += len;
+}
+
+void FrameReader::Reset() {
+    m_read_pos = 0;
+    m_write_pos = 0;
+    m_is_terminated = false;
+}
+
+void FrameReader::RestoreTerminatedByte() {
+    if (m_is_terminated) {
+        m_buffer[m_terminated_pos] = m_terminated_byte;
+        m_is_terminated = false;
+    }
+}
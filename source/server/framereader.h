@@ -0,0 +1,60 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "rornet.h"
+
+#include <cstddef>
+#include <vector>
+
+/// Read-ahead buffer for inbound RoRnet frames of one connection.
+/// The owner receives as many bytes as the socket has into GetWritePtr(), then takes
+/// complete frames out with NextFrame(); payloads are handed out in place, not copied.
+class FrameReader {
+public:
+    static const size_t BUFFER_SIZE = 4 * RORNET_MAX_MESSAGE_LENGTH;
+
+    enum class Result {
+        FRAME,       //!< A complete frame was returned
+        NEED_DATA,   //!< Receive more bytes first
+        OVERSIZED,   //!< Header announces a payload over RORNET_MAX_MESSAGE_LENGTH; drop the connection
+    };
+
+    /// The payload is NUL-terminated (chat messages are processed as C strings) and
+    /// remains valid until the next call to any method of the reader.
+    Result  NextFrame(RoRnet::Header &out_header, char *&out_payload);
+
+    char*   GetWritePtr();      //!< Makes room for at least one complete frame
+    size_t  GetWriteSpace() const { return BUFFER_SIZE - m_write_pos; }
+    void    CommitWrite(size_t len);
+
+    void    Reset();
+
+private:
+    void    RestoreTerminatedByte();
+
+    std::vector<char>  m_buffer;             //!< Allocated on first use; +1 byte for the terminator of a payload at the very end
+    size_t             m_read_pos = 0;
+    size_t             m_write_pos = 0;
+    size_t             m_terminated_pos = 0; //!< Where NextFrame() wrote the terminator...
+    char               m_terminated_byte = 0;//!< ...and what was there (first byte of the next frame)
+    bool               m_is_terminated = false;
+};
@@ -0,0 +1,143 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "hub.h"
+
+#include "logger.h"
+#include "sequencer.h"
+
+#include <algorithm>
+
+Hub::Hub(Sequencer *sequencer) :
+        m_sequencer(sequencer),
+        m_running(false),
+        m_inbox(INBOX_CAPACITY),
+        m_parked(false),
+        m_busy_us(0),
+        m_utilization_since(std::chrono::steady_clock::now()) {
+    m_batch.reserve(BATCH_MAX_EVENTS);
+}
+
+Hub::~Hub() {
+    this->Stop();
+}
+
+void Hub::Start() {
+    if (m_running) {
+        return;
+    }
+    m_running = true;
+    m_thread = std::thread(&Hub::ThreadMain, this);
+}
+
+void Hub::Stop() {
+    if (!m_running.exchange(false)) {
+        return;
+    }
+    this->Wake();
+    m_thread.join();
+}
+
+void Hub::PostInbound(int uid, MessagePtr const& msg) {
+    Event event;
+    event.uid = uid;
+    event.message = msg;
+    this->Post(event);
+}
+
+void Hub::PostDisconnect(int uid, const char *reason, bool is_error, bool do_script_callback) {
+    Event event;
+    event.uid = uid;
+    event.disconnect_reason = reason;
+    event.is_error = is_error;
+    event.do_script_callback = do_script_callback;
+    this->Post(event);
+}
+
+void Hub::Post(Event const& event) {
+    // Backpressure: a full inbox stalls the receivers, and TCP flow control the clients
+    while (!m_inbox.TryPush(event)) {
+        if (!m_running) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+
+    // Pairs with the fence in TryPark(): either we see the hub parked, or it sees our event.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_parked.load(std::memory_order_relaxed) && m_parked.exchange(false)) {
+        this->Wake();
+    }
+}
+
+float Hub::TakeUtilization() {
+    const auto now = std::chrono::steady_clock::now();
+    const auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(now - m_utilization_since).count();
+    m_utilization_since = now;
+    const uint64_t busy_us = m_busy_us.exchange(0);
+    return (elapsed_us > 0) ? std::min(1.f, static_cast<float>(busy_us) / elapsed_us) : 0.f;
+}
+
+void Hub::ThreadMain() {
+    Logger::Log(LOG_DEBUG, "Started hub thread");
+
+    while (m_running) {
+        m_batch.clear();
+        Event event;
+        while (m_batch.size() < BATCH_MAX_EVENTS && m_inbox.TryPop(event)) {
+            m_batch.push_back(std::move(event));
+        }
+
+        if (m_batch.empty()) {
+            if (this->TryPark()) {
+                std::unique_lock<std::mutex> uni_lock(m_wake_mutex);
+                m_wake_cond.wait(uni_lock, [this] { return m_wake_pending; });
+                m_wake_pending = false;
+            }
+            continue;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        m_sequencer->ProcessHubEvents(m_batch);
+        m_busy_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+    m_batch.clear();
+    Logger::Log(LOG_DEBUG, "Hub thread exits");
+}
+
+bool Hub::TryPark() {
+    m_parked.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_inbox.IsEmpty() && m_running) {
+        return true;
+    }
+    m_parked.store(false); // A producer may have already cleared it and signalled; that's harmless.
+    return false;
+}
+
+void Hub::Wake() {
+    {
+        std::lock_guard<std::mutex> scoped_lock(m_wake_mutex);
+        m_wake_pending = true;
+    }
+    m_wake_cond.notify_one();
+}
@@ -0,0 +1,87 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "message.h"
+#include "mpsc_ring.h"
+#include "prerequisites.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Single thread which does all message routing of the Sequencer (`hub-thread` config option).
+/// Receivers post parsed messages and disconnects into a lock-free inbox; the hub takes them
+/// out in batches, in arrival order, and processes each batch under one acquisition of the
+/// clients-mutex - so the receivers never contend on it. Fan-out to the Broadcasters is lock-free.
+class Hub {
+public:
+    static const size_t INBOX_CAPACITY = 8192;
+    static const size_t BATCH_MAX_EVENTS = 256;
+
+    struct Event {
+        int          uid = 0;
+        MessagePtr   message;            //!< Null for a disconnect
+        std::string  disconnect_reason;
+        bool         is_error = false;
+        bool         do_script_callback = true;
+    };
+
+    Hub(Sequencer *sequencer);
+    ~Hub();
+
+    void Start();
+    void Stop(); //!< Events still in the inbox are discarded.
+
+    // Any thread; blocks while the inbox is full.
+    void PostInbound(int uid, MessagePtr const& msg);
+    void PostDisconnect(int uid, const char *reason, bool is_error, bool do_script_callback);
+
+    float TakeUtilization(); //!< Share of time spent processing (0-1) since the previous call
+
+private:
+    void  Post(Event const& event);
+    void  ThreadMain();
+    bool  TryPark();         //!< False if events arrived meanwhile
+    void  Wake();
+
+    Sequencer*                m_sequencer;
+    std::thread               m_thread;
+    std::atomic<bool>         m_running;
+
+    MpscRing<Event>           m_inbox;
+    std::vector<Event>        m_batch;    //!< Hub thread only
+
+    // Wakeup of a parked hub
+    std::atomic<bool>         m_parked;
+    std::mutex                m_wake_mutex;
+    std::condition_variable   m_wake_cond;
+    bool                      m_wake_pending = false;
+
+    // Utilization
+    std::atomic<uint64_t>     m_busy_us;
+    std::chrono::steady_clock::time_point m_utilization_since; //!< Only used by TakeUtilization()
+};
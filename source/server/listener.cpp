@@ -21,17 +21,33 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 #include "listener.h"
 
 #include "rornet.h"
+#include "message.h"
 #include "messaging.h"
 #include "sequencer.h"
 #include "SocketW.h"
 #include "logger.h"
 #include "config.h"
+#include "taskexecutor.h"
 #include "UnicodeStrings.h"
 #include "utils.h"
 
 #include <stdexcept>
 #include <sstream>
 #include <stdio.h>
+#include <cstring>
+
+#ifdef _WIN32
+#   define poll WSAPoll
+#else
+#   include <errno.h>
+#   include <fcntl.h>
+#   include <poll.h>
+#   include <sys/socket.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#   define MSG_NOSIGNAL 0
+#endif
 
 #ifdef __GNUC__
 
@@ -39,6 +55,32 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 
 #endif
 
+static const size_t               LISTENER_MAX_HANDSHAKES = 256;
+static const int                  LISTENER_POLL_INTERVAL_MS = 250; //!< Upper bound for noticing shutdown and timeouts
+static const std::chrono::seconds LISTENER_RECV_TIMEOUT(5);        //!< Per stage: hello, user info
+static const std::chrono::seconds LISTENER_SEND_TIMEOUT(5);        //!< Per stage: server info, final reply
+
+static bool SetSocketBlocking(int fd, bool blocking) {
+#ifdef _WIN32
+    u_long mode = blocking ? 0 : 1;
+    return ioctlsocket(fd, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return false;
+    }
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags) == 0;
+#endif
+}
+
+static bool IsWouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
 
 Listener::Listener(Sequencer *sequencer) :
         m_sequencer(sequencer) {
@@ -54,13 +96,18 @@ bool Listener::Initialize() {
 
     // Start listening on the socket
     SWBaseSocket::SWBaseError error;
-    m_listen_socket.bind(Config::getListenPort(), &error);
+    m_listen_socket.bind(m_sequencer->GetRoom().port, &error);
     if (error != SWBaseSocket::ok) {
         Logger::Log(LOG_ERROR, "FATAL Listerer: %s", error.get_error().c_str());
         return false;
     }
     m_listen_socket.listen();
 
+    {
+        std::lock_guard<std::mutex> lock(m_auth_mutex);
+        m_auth_stop = false;
+    }
+
     // Start the thread
     m_thread = std::thread(&Listener::ThreadMain, this);
     m_thread_state = ThreadState::RUNNING;
@@ -70,164 +117,367 @@ bool Listener::Initialize() {
 
 void Listener::Shutdown() {
     // Make sure it's not shut down twice
-    std::lock_guard<std::mutex> lock(m_mutex);
-    if (m_thread_state != ThreadState::RUNNING)
     {
-        return;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_thread_state != ThreadState::RUNNING)
+        {
+            return;
+        }
+        m_thread_state = ThreadState::STOP_REQUESTED;
     }
 
     Logger::Log(LOG_VERBOSE, "Stopping listener thread...");
-    m_thread_state = ThreadState::STOP_REQUESTED;
     m_thread.join();
     Logger::Log(LOG_VERBOSE, "Listener thread stopped");
+
+    // Clients still waiting for authentication are rejected
+    {
+        std::unique_lock<std::mutex> lock(m_auth_mutex);
+        m_auth_stop = true;
+        m_auth_cond.wait(lock, [this] { return m_auth_pending == 0; });
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_thread_state = ThreadState::NOT_RUNNING;
 }
 
 void Listener::ThreadMain() {
     Logger::Log(LOG_DEBUG, "Listerer thread starting");
 
     SWBaseSocket::SWBaseError error;
+    int listen_fd = m_listen_socket.get_fd(&error);
+    SetSocketBlocking(listen_fd, false); // Never block in accept(), a client may be gone by then.
 
-    //await connections
+    std::vector<pollfd> poll_fds;
     while (GetThreadState() == ThreadState::RUNNING) {
-        Logger::Log(LOG_VERBOSE, "Listener awaiting connections");
-        SWInetSocket *ts = (SWInetSocket *) m_listen_socket.accept(&error);
-        if (error != SWBaseSocket::ok) {
-            if (GetThreadState() == ThreadState::STOP_REQUESTED) {
-                Logger::Log(LOG_ERROR, "INFO Listener shutting down");
+        poll_fds.clear();
+        pollfd listen_pfd;
+        listen_pfd.fd = listen_fd;
+        listen_pfd.events = POLLIN;
+        listen_pfd.revents = 0;
+        poll_fds.push_back(listen_pfd);
+        for (auto& hs : m_handshakes) {
+            pollfd pfd;
+            pfd.fd = hs->fd;
+            pfd.events = (hs->stage == HandshakeStage::SEND_SERVER_INFO || hs->stage == HandshakeStage::SEND_AND_CLOSE)
+                         ? POLLOUT : POLLIN;
+            pfd.revents = 0;
+            poll_fds.push_back(pfd);
+        }
+
+        int res = poll(poll_fds.data(), (unsigned long) poll_fds.size(), LISTENER_POLL_INTERVAL_MS);
+        if (res < 0 && !IsWouldBlock()) {
+            Logger::Log(LOG_ERROR, "ERROR Listener: poll() failed");
+            std::this_thread::sleep_for(std::chrono::milliseconds(LISTENER_POLL_INTERVAL_MS));
+            continue;
+        }
+
+        // Progress the pending handshakes (also checks the deadlines)
+        size_t num_polled = poll_fds.size() - 1;
+        size_t i = 0;
+        for (size_t p = 0; p < num_polled; ++p) {
+            short revents = (res > 0) ? poll_fds[p + 1].revents : 0;
+            if (this->ProcessHandshake(m_handshakes[i].get(), revents)) {
+                ++i;
             } else {
-                Logger::Log(LOG_ERROR, "ERROR Listener: %s", error.get_error().c_str());
+                m_handshakes.erase(m_handshakes.begin() + i);
             }
         }
 
-        Logger::Log(LOG_VERBOSE, "Listener got a new connection");
+        if (res > 0 && (poll_fds[0].revents & POLLIN)) {
+            this->AcceptConnection();
+        }
+    }
 
-        ts->set_timeout(5, 0);
+    // Drop the unfinished handshakes
+    for (auto& hs : m_handshakes) {
+        this->CloseHandshake(hs.get(), nullptr);
+    }
+    m_handshakes.clear();
+    Logger::Log(LOG_ERROR, "INFO Listener shutting down");
+}
 
-        //receive a magic
-        int type;
-        int source;
-        unsigned int len;
-        unsigned int streamid;
-        char buffer[RORNET_MAX_MESSAGE_LENGTH];
+void Listener::AcceptConnection() {
+    SWBaseSocket::SWBaseError error;
+    SWInetSocket *ts = (SWInetSocket *) m_listen_socket.accept(&error);
+    if (ts == nullptr || error != SWBaseSocket::ok) {
+        if (error != SWBaseSocket::notReady) {
+            Logger::Log(LOG_ERROR, "ERROR Listener: %s", error.get_error().c_str());
+        }
+        delete ts;
+        return;
+    }
 
-        try {
-            // this is the start of it all, it all starts with a simple hello
-            if (Messaging::SWReceiveMessage(ts, &type, &source, &streamid, &len,
-                                            buffer, RORNET_MAX_MESSAGE_LENGTH))
-                throw std::runtime_error("ERROR Listener: receiving first message");
+    Logger::Log(LOG_VERBOSE, "Listener got a new connection");
 
-            // make sure our first message is a hello message
-            if (type != RoRnet::MSG2_HELLO) {
-                Messaging::SWSendMessage(ts, RoRnet::MSG2_WRONG_VER, 0, 0, 0, 0);
-                throw std::runtime_error("ERROR Listener: protocol error");
-            }
+    if (m_handshakes.size() >= LISTENER_MAX_HANDSHAKES) {
+        Logger::Log(LOG_WARN, "Listener: too many pending handshakes (%d), rejecting connection", (int) m_handshakes.size());
+        ts->disconnect(&error);
+        delete ts;
+        return;
+    }
+
+    std::unique_ptr<Handshake> hs(new Handshake());
+    hs->socket = ts;
+    hs->fd = ts->get_fd(&error);
+    hs->ip = ts->get_peerAddr(&error);
+    hs->deadline = std::chrono::steady_clock::now() + LISTENER_RECV_TIMEOUT;
+    if (hs->fd < 0 || !SetSocketBlocking(hs->fd, false)) {
+        Logger::Log(LOG_ERROR, "ERROR Listener: cannot set up connection from %s", hs->ip.c_str());
+        this->CloseHandshake(hs.get(), nullptr);
+        return;
+    }
+    m_handshakes.push_back(std::move(hs));
+}
 
-            // check client version
-            if (source == 5000 && (std::string(buffer) == "MasterServer")) {
-                Logger::Log(LOG_VERBOSE, "Master Server knocked ...");
-                // send back some information, then close socket
-                char tmp[2048] = "";
-                sprintf(tmp, "protocol:%s\nrev:%s\nbuild_on:%s_%s\n", RORNET_VERSION, VERSION, __DATE__, __TIME__);
-                if (Messaging::SWSendMessage(ts, RoRnet::MSG2_MASTERINFO, 0, 0, (unsigned int) strlen(tmp), tmp)) {
-                    throw std::runtime_error("ERROR Listener: sending master info");
+bool Listener::ProcessHandshake(Handshake* hs, short revents) {
+    if (hs->stage == HandshakeStage::SEND_SERVER_INFO || hs->stage == HandshakeStage::SEND_AND_CLOSE) {
+        if (revents != 0) {
+            if (!this->FlushHandshake(hs)) {
+                this->CloseHandshake(hs, "ERROR Listener: sending data");
+                return false;
+            }
+            if (hs->send_pos == hs->send_buf.size()) {
+                if (hs->stage == HandshakeStage::SEND_AND_CLOSE) {
+                    this->CloseHandshake(hs, nullptr);
+                    return false;
                 }
-                // close socket
-                ts->disconnect(&error);
-                delete ts;
-                continue;
+                hs->send_buf.clear();
+                hs->send_pos = 0;
+                hs->stage = HandshakeStage::RECV_USER_INFO;
+                hs->deadline = std::chrono::steady_clock::now() + LISTENER_RECV_TIMEOUT;
             }
+        }
+    } else if (revents != 0) {
+        char *dst = hs->reader.GetWritePtr();
+        int received = (int) recv(hs->fd, dst, (int) hs->reader.GetWriteSpace(), 0);
+        if (received == 0 || (received < 0 && !IsWouldBlock())) {
+            this->CloseHandshake(hs, "ERROR Listener: connection closed during handshake");
+            return false;
+        }
+        if (received > 0) {
+            hs->reader.CommitWrite((size_t) received);
+        }
 
-            // compare the versions if they are compatible
-            if (strncmp(buffer, RORNET_VERSION, strlen(RORNET_VERSION))) {
-                // not compatible
-                Messaging::SWSendMessage(ts, RoRnet::MSG2_WRONG_VER, 0, 0, 0, 0);
-                throw std::runtime_error("ERROR Listener: bad version: " + std::string(buffer) + ". rejecting ...");
+        RoRnet::Header head;
+        char *payload = nullptr;
+        FrameReader::Result result;
+        while ((hs->stage == HandshakeStage::RECV_HELLO || hs->stage == HandshakeStage::RECV_USER_INFO) &&
+               (result = hs->reader.NextFrame(head, payload)) != FrameReader::Result::NEED_DATA) {
+            if (result == FrameReader::Result::OVERSIZED) {
+                this->CloseHandshake(hs, "ERROR Listener: receiving message: payload too long");
+                return false;
             }
+            Messaging::StatsAddIncoming((int) sizeof(RoRnet::Header) + (int) head.size);
+            if (!this->HandleFrame(hs, head, payload)) {
+                this->CloseHandshake(hs, nullptr); // Already logged
+                return false;
+            }
+            if (hs->socket == nullptr) {
+                return false; // Handed over to the auth workers
+            }
+        }
+    }
+
+    if (std::chrono::steady_clock::now() > hs->deadline) {
+        this->CloseHandshake(hs, "ERROR Listener: handshake timed out");
+        return false;
+    }
+    return true;
+}
 
-            // compatible version, continue to send server settings
-            std::string motd_str;
+bool Listener::HandleFrame(Handshake* hs, RoRnet::Header const& head, const char* payload) {
+    if (hs->stage == HandshakeStage::RECV_HELLO) {
+        // make sure our first message is a hello message
+        if (head.command != RoRnet::MSG2_HELLO) {
+            Logger::Log(LOG_ERROR, "ERROR Listener: protocol error");
+            this->QueueReply(hs, RoRnet::MSG2_WRONG_VER, 0, nullptr);
+            return true;
+        }
+
+        // check client version
+        if (head.source == 5000 && (std::string(payload) == "MasterServer")) {
+            Logger::Log(LOG_VERBOSE, "Master Server knocked ...");
+            // send back some information, then close socket
+            char tmp[2048] = "";
+            sprintf(tmp, "protocol:%s\nrev:%s\nbuild_on:%s_%s\n", RORNET_VERSION, VERSION, __DATE__, __TIME__);
+            this->QueueReply(hs, RoRnet::MSG2_MASTERINFO, (unsigned int) strlen(tmp), tmp);
+            return true;
+        }
+
+        // compare the versions if they are compatible
+        if (strncmp(payload, RORNET_VERSION, strlen(RORNET_VERSION))) {
+            // not compatible
+            Logger::Log(LOG_ERROR, "ERROR Listener: bad version: %s. rejecting ...", payload);
+            this->QueueReply(hs, RoRnet::MSG2_WRONG_VER, 0, nullptr);
+            return true;
+        }
+
+        // compatible version, continue to send server settings
+        RoomConfig const& room = m_sequencer->GetRoom();
+        std::string motd_str;
+        {
+            std::vector<std::string> lines;
+            if (!Utils::ReadLinesFromFile(room.motd_file, lines))
             {
-                std::vector<std::string> lines;
-                if (!Utils::ReadLinesFromFile(Config::getMOTDFile(), lines))
-                {
-                    for (const auto& line : lines)
-                        motd_str += line + "\n";
-                }
+                for (const auto& line : lines)
+                    motd_str += line + "\n";
             }
+        }
 
-            Logger::Log(LOG_DEBUG, "Listener sending server settings");
-            RoRnet::ServerInfo settings;
-            memset(&settings, 0, sizeof(RoRnet::ServerInfo));
-            settings.has_password = !Config::getPublicPassword().empty();
-            strncpy(settings.info, motd_str.c_str(), motd_str.size());
-            strncpy(settings.protocolversion, RORNET_VERSION, strlen(RORNET_VERSION));
-            strncpy(settings.servername, Config::getServerName().c_str(), Config::getServerName().size());
-            strncpy(settings.terrain, Config::getTerrainName().c_str(), Config::getTerrainName().size());
-
-            if (Messaging::SWSendMessage(ts, RoRnet::MSG2_HELLO, 0, 0, (unsigned int) sizeof(RoRnet::ServerInfo),
-                                       (char *) &settings))
-                throw std::runtime_error("ERROR Listener: sending version");
-
-            //receive user infos
-            if (Messaging::SWReceiveMessage(ts, &type, &source, &streamid, &len,
-                                            buffer,
-                                            RORNET_MAX_MESSAGE_LENGTH)) {
-                std::stringstream error_msg;
-                error_msg << "ERROR Listener: receiving user infos\n"
-                          << "ERROR Listener: got that: "
-                          << type;
-                throw std::runtime_error(error_msg.str());
-            }
+        Logger::Log(LOG_DEBUG, "Listener sending server settings");
+        RoRnet::ServerInfo settings;
+        memset(&settings, 0, sizeof(RoRnet::ServerInfo));
+        settings.has_password = room.HasPassword();
+        strncpy(settings.info, motd_str.c_str(), motd_str.size());
+        strncpy(settings.protocolversion, RORNET_VERSION, strlen(RORNET_VERSION));
+        strncpy(settings.servername, room.name.c_str(), room.name.size());
+        strncpy(settings.terrain, room.terrain.c_str(), room.terrain.size());
+
+        this->QueueReply(hs, RoRnet::MSG2_HELLO, (unsigned int) sizeof(RoRnet::ServerInfo), (char *) &settings);
+        hs->stage = HandshakeStage::SEND_SERVER_INFO;
+        return true;
+    }
 
-            if (type != RoRnet::MSG2_USER_INFO)
-                throw std::runtime_error("Warning Listener: no user name");
-
-            if (len > sizeof(RoRnet::UserInfo))
-                throw std::runtime_error("Error: did not receive proper user credentials");
-            Logger::Log(LOG_INFO, "Listener creating a new client...");
-
-            RoRnet::UserInfo *user = (RoRnet::UserInfo *) buffer;
-            user->authstatus = RoRnet::AUTH_NONE;
-
-            // authenticate
-            user->username[RORNET_MAX_USERNAME_LEN - 1] = 0;
-            std::string nickname = Str::SanitizeUtf8(user->username);
-            user->authstatus = m_sequencer->AuthorizeNick(std::string(user->usertoken, 40), nickname);
-            strncpy(user->username, nickname.c_str(), RORNET_MAX_USERNAME_LEN - 1);
-
-            if (Config::isPublic()) {
-                Logger::Log(LOG_DEBUG, "password login: %s == %s?",
-                            Config::getPublicPassword().c_str(),
-                            std::string(user->serverpassword, 40).c_str());
-                if (strncmp(Config::getPublicPassword().c_str(), user->serverpassword, 40)) {
-                    Messaging::SWSendMessage(ts, RoRnet::MSG2_WRONG_PW, 0, 0, 0, 0);
-                    throw std::runtime_error("ERROR Listener: wrong password");
-                }
+    // HandshakeStage::RECV_USER_INFO
+    if (head.command != RoRnet::MSG2_USER_INFO) {
+        Logger::Log(LOG_ERROR, "Warning Listener: no user name (got message type %d)", (int) head.command);
+        return false;
+    }
+    if (head.size > sizeof(RoRnet::UserInfo)) {
+        Logger::Log(LOG_ERROR, "Error: did not receive proper user credentials");
+        return false;
+    }
+    Logger::Log(LOG_INFO, "Listener creating a new client...");
 
-                Logger::Log(LOG_DEBUG, "user used the correct password, "
-                        "creating client!");
-            } else {
-                Logger::Log(LOG_DEBUG, "no password protection, creating client");
-            }
+    AuthJob job;
+    memset(&job.user, 0, sizeof(RoRnet::UserInfo));
+    memcpy(&job.user, payload, head.size);
+    job.socket = hs->socket;
 
-            if (Config::getRankedOnly()) {
-                Logger::Log(LOG_DEBUG, "ranked-only server: checking user status");
-                if (user->authstatus == RoRnet::AUTH_NONE) {
-                    Logger::Log(LOG_DEBUG, "ranked-only server: rejecting non-ranked user");
-                    Messaging::SWSendMessage(ts, RoRnet::MSG2_NO_RANK, 0, 0, 0, 0);
-                    throw std::runtime_error("ERROR Listener: no auth status");
-                }
+    // The rest of the way the socket is used by SocketW in blocking mode again
+    SetSocketBlocking(hs->fd, true);
+    job.socket->set_timeout(5, 0);
+    hs->socket = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_auth_mutex);
+        ++m_auth_pending;
+    }
+    if (!TaskExecutor::Submit(TaskExecutor::TASK_AUTH, [this, job]() mutable { this->RunAuthTask(job); })) {
+        Logger::Log(LOG_WARN, "Listener: too much background work, rejecting the client");
+        RejectClient(job);
+        std::lock_guard<std::mutex> lock(m_auth_mutex);
+        --m_auth_pending;
+    }
+    return true;
+}
+
+void Listener::QueueReply(Handshake* hs, int type, unsigned int len, const char* data) {
+    MessagePtr msg = Message::Create(type, 0, 0, len, data);
+    hs->send_buf.insert(hs->send_buf.end(), msg->GetWireData(), msg->GetWireData() + msg->GetWireLength());
+    if (type != RoRnet::MSG2_HELLO) {
+        hs->stage = HandshakeStage::SEND_AND_CLOSE; // All other replies are final
+    }
+    hs->deadline = std::chrono::steady_clock::now() + LISTENER_SEND_TIMEOUT;
+}
+
+bool Listener::FlushHandshake(Handshake* hs) {
+    while (hs->send_pos < hs->send_buf.size()) {
+        int sent = (int) send(hs->fd, hs->send_buf.data() + hs->send_pos,
+                              (int) (hs->send_buf.size() - hs->send_pos), MSG_NOSIGNAL);
+        if (sent < 0) {
+            return IsWouldBlock();
+        }
+        hs->send_pos += (size_t) sent;
+        Messaging::StatsAddOutgoing(sent);
+    }
+    return true;
+}
+
+void Listener::CloseHandshake(Handshake* hs, const char* reason) {
+    if (reason != nullptr) {
+        Logger::Log(LOG_ERROR, "%s (%s)", reason, hs->ip.c_str());
+    }
+    if (hs->socket != nullptr) {
+        SWBaseSocket::SWBaseError error;
+        hs->socket->disconnect(&error);
+        delete hs->socket;
+        hs->socket = nullptr;
+    }
+}
+
+void Listener::RunAuthTask(AuthJob& job) {
+    bool stop;
+    {
+        std::lock_guard<std::mutex> lock(m_auth_mutex);
+        stop = m_auth_stop;
+    }
+    if (stop) {
+        RejectClient(job);
+    } else {
+        this->AuthenticateClient(job);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_auth_mutex);
+        --m_auth_pending;
+    }
+    m_auth_cond.notify_all();
+}
+
+void Listener::RejectClient(AuthJob& job) {
+    SWBaseSocket::SWBaseError error;
+    job.socket->disconnect(&error);
+    delete job.socket;
+}
+
+void Listener::AuthenticateClient(AuthJob& job) {
+    SWInetSocket *ts = job.socket;
+    RoRnet::UserInfo *user = &job.user;
+
+    try {
+        user->authstatus = RoRnet::AUTH_NONE;
+
+        // authenticate
+        user->username[RORNET_MAX_USERNAME_LEN - 1] = 0;
+        std::string nickname = Str::SanitizeUtf8(user->username);
+        user->authstatus = m_sequencer->AuthorizeNick(std::string(user->usertoken, 40), nickname);
+        strncpy(user->username, nickname.c_str(), RORNET_MAX_USERNAME_LEN - 1);
+
+        RoomConfig const& room = m_sequencer->GetRoom();
+        if (room.HasPassword()) {
+            Logger::Log(LOG_DEBUG, "password login: %s == %s?",
+                        room.password.c_str(),
+                        std::string(user->serverpassword, 40).c_str());
+            if (strncmp(room.password.c_str(), user->serverpassword, 40)) {
+                Messaging::SWSendMessage(ts, RoRnet::MSG2_WRONG_PW, 0, 0, 0, 0);
+                throw std::runtime_error("ERROR Listener: wrong password");
             }
 
-            //create a new client
-            m_sequencer->createClient(ts, *user); // copy the user info, since the buffer will be cleared soon
-            Logger::Log(LOG_DEBUG, "listener returned!");
+            Logger::Log(LOG_DEBUG, "user used the correct password, "
+                    "creating client!");
+        } else {
+            Logger::Log(LOG_DEBUG, "no password protection, creating client");
         }
-        catch (std::runtime_error &e) {
-            Logger::Log(LOG_ERROR, e.what());
-            ts->disconnect(&error);
-            delete ts;
+
+        if (Config::getRankedOnly()) {
+            Logger::Log(LOG_DEBUG, "ranked-only server: checking user status");
+            if (user->authstatus == RoRnet::AUTH_NONE) {
+                Logger::Log(LOG_DEBUG, "ranked-only server: rejecting non-ranked user");
+                Messaging::SWSendMessage(ts, RoRnet::MSG2_NO_RANK, 0, 0, 0, 0);
+                throw std::runtime_error("ERROR Listener: no auth status");
+            }
         }
+
+        //create a new client
+        m_sequencer->createClient(ts, *user); // copy the user info, since the buffer will be cleared soon
+        Logger::Log(LOG_DEBUG, "listener returned!");
+    }
+    catch (std::runtime_error &e) {
+        Logger::Log(LOG_ERROR, e.what());
+        SWBaseSocket::SWBaseError error;
+        ts->disconnect(&error);
+        delete ts;
     }
 }
 
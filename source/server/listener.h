@@ -21,11 +21,21 @@
 #pragma once
 
 #include "SocketW.h"
+#include "framereader.h"
+#include "rornet.h"
 #include "prerequisites.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 
+/// Accepts connections and runs the join handshakes.
+/// The listener thread drives all pending handshakes at once with non-blocking sockets and poll(),
+/// each stage with its own deadline. Authentication and client creation (which may query
+/// the master server) are handed over to the TaskExecutor.
 class Listener {
 private:
     enum class ThreadState
@@ -35,15 +45,59 @@ private:
         STOP_REQUESTED
     };
 
+    enum class HandshakeStage
+    {
+        RECV_HELLO,         //!< Waiting for MSG2_HELLO
+        SEND_SERVER_INFO,   //!< Sending our MSG2_HELLO with the server settings
+        RECV_USER_INFO,     //!< Waiting for MSG2_USER_INFO
+        SEND_AND_CLOSE,     //!< Sending a final reply (master server info, rejection), then disconnecting
+    };
+
+    struct Handshake {
+        SWInetSocket*        socket = nullptr;
+        int                  fd = -1;
+        std::string          ip;
+        HandshakeStage       stage = HandshakeStage::RECV_HELLO;
+        std::chrono::steady_clock::time_point deadline;
+        FrameReader          reader;
+        std::vector<char>    send_buf;
+        size_t               send_pos = 0;
+    };
+
+    struct AuthJob {
+        SWInetSocket*        socket;
+        RoRnet::UserInfo     user;
+    };
+
     SWInetSocket m_listen_socket;
     ThreadState  m_thread_state = ThreadState::NOT_RUNNING;
     std::mutex   m_mutex;
     std::thread  m_thread;
     Sequencer*   m_sequencer = nullptr;
 
+    // Listener thread only
+    std::vector<std::unique_ptr<Handshake>> m_handshakes;
+
+    // Auth tasks
+    std::mutex               m_auth_mutex;   //!< Protects the below
+    std::condition_variable  m_auth_cond;
+    size_t                   m_auth_pending = 0; //!< Submitted, not finished
+    bool                     m_auth_stop = false;
+
     void ThreadMain();
     ThreadState GetThreadState();
 
+    void AcceptConnection();
+    bool ProcessHandshake(Handshake* hs, short revents); //!< @return false when the handshake is over (socket released).
+    bool HandleFrame(Handshake* hs, RoRnet::Header const& head, const char* payload); //!< @return false on protocol error.
+    bool FlushHandshake(Handshake* hs); //!< @return false on socket error.
+    void QueueReply(Handshake* hs, int type, unsigned int len, const char* data);
+    void CloseHandshake(Handshake* hs, const char* reason);
+
+    void RunAuthTask(AuthJob& job);
+    void AuthenticateClient(AuthJob& job);
+    static void RejectClient(AuthJob& job);
+
 public:
     Listener(Sequencer *sequencer);
 
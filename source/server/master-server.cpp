@@ -34,15 +34,15 @@ namespace MasterServer {
             m_trust_level(-1),
             m_is_registered(false) {}
 
-    bool Client::Register() {
+    bool Client::Register(RoomConfig const &room) {
         Json::Value data(Json::objectValue);
         data["ip"] = Config::getIPAddr();
-        data["port"] = Config::getListenPort();
-        data["name"] = Config::getServerName();
-        data["terrain-name"] = Config::getTerrainName();
-        data["max-clients"] = Config::getMaxClients();
+        data["port"] = room.port;
+        data["name"] = room.name;
+        data["terrain-name"] = room.terrain;
+        data["max-clients"] = room.max_clients;
         data["version"] = RORNET_VERSION;
-        data["use-password"] = Config::isPublic();
+        data["use-password"] = room.HasPassword();
 
         m_server_path = "/" + Config::GetServerlistPath() + "/server-list";
 
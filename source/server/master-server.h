@@ -31,7 +31,7 @@ namespace MasterServer {
     public:
         Client();
 
-        bool Register();
+        bool Register(RoomConfig const &room);
 
         bool SendHeatbeat(Json::Value &user_list);
 
@@ -0,0 +1,214 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "message.h"
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace MessagePool {
+
+static const unsigned int MIN_CLASS_SHIFT = 6;                      // 64 bytes
+static const unsigned int NUM_SIZE_CLASSES = 9;                     // ... 16 KiB
+static const unsigned int UNPOOLED = NUM_SIZE_CLASSES;
+static const size_t       THREAD_CACHE_BUFFERS = 8;                 // Per size class, ...
+static const size_t       THREAD_CACHE_CLASS_BYTES = 16 * 1024;     // ... and at most this much (one buffer of the largest)
+static const size_t       SHARED_POOL_BYTES = 4 * 1024 * 1024;      // Per size class
+
+static std::atomic<size_t> s_live_bytes(0);
+static std::atomic<size_t> s_live_buffers(0);
+static std::atomic<size_t> s_pooled_bytes(0);
+
+static size_t ClassSize(unsigned int size_class) {
+    return size_t(1) << (size_class + MIN_CLASS_SHIFT);
+}
+
+static size_t ClassCacheLimit(unsigned int size_class, size_t budget) {
+    size_t count = budget / ClassSize(size_class);
+    return (count < 4) ? 4 : count;
+}
+
+// Small, so the many threads of the thread-per-client backend don't each hoard buffers;
+// the shared pool is the reservoir.
+static size_t ThreadCacheLimit(unsigned int size_class) {
+    size_t count = THREAD_CACHE_CLASS_BYTES / ClassSize(size_class);
+    if (count > THREAD_CACHE_BUFFERS) {
+        count = THREAD_CACHE_BUFFERS;
+    }
+    return (count < 1) ? 1 : count;
+}
+
+struct SharedPool {
+    std::mutex          mutex;
+    std::vector<char*>  free[NUM_SIZE_CLASSES];
+
+    ~SharedPool() {
+        for (auto &list : free) {
+            for (char *buf : list) {
+                delete[] buf;
+            }
+        }
+    }
+};
+
+static SharedPool s_shared_pool;
+
+struct ThreadCache {
+    std::vector<char*>  free[NUM_SIZE_CLASSES];
+
+    ~ThreadCache() {
+        // Hand everything over to the threads which are still running
+        for (unsigned int c = 0; c < NUM_SIZE_CLASSES; ++c) {
+            while (!free[c].empty()) {
+                this->Spill(c, free[c].size());
+            }
+        }
+    }
+
+    void Spill(unsigned int c, size_t count) {
+        const size_t limit = ClassCacheLimit(c, SHARED_POOL_BYTES);
+        std::lock_guard<std::mutex> lock(s_shared_pool.mutex);
+        for (size_t i = 0; i < count; ++i) {
+            char *buf = free[c].back();
+            free[c].pop_back();
+            if (s_shared_pool.free[c].size() < limit) {
+                s_shared_pool.free[c].push_back(buf);
+            } else {
+                delete[] buf;
+                s_pooled_bytes -= ClassSize(c);
+            }
+        }
+    }
+
+    void Refill(unsigned int c, size_t count) {
+        std::lock_guard<std::mutex> lock(s_shared_pool.mutex);
+        std::vector<char*> &shared = s_shared_pool.free[c];
+        for (size_t i = 0; i < count && !shared.empty(); ++i) {
+            free[c].push_back(shared.back());
+            shared.pop_back();
+        }
+    }
+};
+
+static thread_local ThreadCache t_cache;
+
+char* Allocate(size_t len, unsigned int &out_size_class) {
+    unsigned int c = 0;
+    while (c < NUM_SIZE_CLASSES && ClassSize(c) < len) {
+        ++c;
+    }
+
+    if (c == UNPOOLED) {
+        out_size_class = UNPOOLED;
+        s_live_bytes += len;
+        ++s_live_buffers;
+        return new char[len];
+    }
+
+    out_size_class = c;
+    s_live_bytes += ClassSize(c);
+    ++s_live_buffers;
+
+    std::vector<char*> &cache = t_cache.free[c];
+    if (cache.empty()) {
+        t_cache.Refill(c, (ThreadCacheLimit(c) + 1) / 2);
+    }
+    if (!cache.empty()) {
+        char *buf = cache.back();
+        cache.pop_back();
+        s_pooled_bytes -= ClassSize(c);
+        return buf;
+    }
+    return new char[ClassSize(c)];
+}
+
+void Release(char *buf, size_t len, unsigned int size_class) {
+    --s_live_buffers;
+    if (size_class == UNPOOLED) {
+        s_live_bytes -= len;
+        delete[] buf;
+        return;
+    }
+
+    s_live_bytes -= ClassSize(size_class);
+    s_pooled_bytes += ClassSize(size_class);
+
+    std::vector<char*> &cache = t_cache.free[size_class];
+    cache.push_back(buf);
+    const size_t limit = ThreadCacheLimit(size_class);
+    if (cache.size() > limit) {
+        t_cache.Spill(size_class, cache.size() - limit / 2);
+    }
+}
+
+Stats GetStats() {
+    Stats stats;
+    stats.live_bytes = s_live_bytes;
+    stats.live_buffers = s_live_buffers;
+    stats.pooled_bytes = s_pooled_bytes;
+    return stats;
+}
+
+} // namespace MessagePool
+
+Message::Message(RoRnet::MessageType type, size_t wire_len) :
+    m_type(type),
+    m_wire(nullptr),
+    m_wire_len(wire_len),
+    m_size_class(0) {
+    m_wire = MessagePool::Allocate(wire_len, m_size_class);
+}
+
+Message::~Message() {
+    MessagePool::Release(m_wire, m_wire_len, m_size_class);
+}
+
+MessagePtr Message::Create(int type, int source, unsigned int streamid, unsigned int payload_len, const char *payload) {
+    // Discardable stream data is only a hint for our queues, clients receive it as regular stream data.
+    const int wire_type = (type == RoRnet::MSG2_STREAM_DATA_DISCARDABLE) ? RoRnet::MSG2_STREAM_DATA : type;
+    return Message::Build(type, wire_type, source, streamid, payload_len, payload);
+}
+
+MessagePtr Message::CreateVerbatim(int type, int source, unsigned int streamid, unsigned int payload_len,
+                                   const char *payload) {
+    return Message::Build(type, type, source, streamid, payload_len, payload);
+}
+
+MessagePtr Message::Build(int type, int wire_type, int source, unsigned int streamid, unsigned int payload_len,
+                          const char *payload) {
+    std::shared_ptr<Message> msg = std::make_shared<Message>(
+        static_cast<RoRnet::MessageType>(type), sizeof(RoRnet::Header) + payload_len);
+
+    RoRnet::Header head;
+    std::memset(&head, 0, sizeof(RoRnet::Header));
+    head.command = wire_type;
+    head.source = source;
+    head.streamid = streamid;
+    head.size = payload_len;
+
+    char *wire = msg->m_wire;
+    std::memcpy(wire, &head, sizeof(RoRnet::Header));
+    if (payload_len > 0) {
+        std::memcpy(wire + sizeof(RoRnet::Header), payload, payload_len);
+    }
+    return msg;
+}
@@ -0,0 +1,82 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "rornet.h"
+
+#include <cstddef>
+#include <memory>
+
+class Message;
+
+typedef std::shared_ptr<const Message> MessagePtr;
+
+/// Size-class slab allocator for message buffers (64 bytes to 16 KiB, powers of two).
+/// Released buffers are kept in a small per-thread cache (a few buffers per size class); surplus
+/// is moved in batches to a shared free list, where the threads creating messages (receivers) pick up what the threads
+/// sending them (broadcasters) have released.
+namespace MessagePool {
+
+    struct Stats {
+        size_t live_bytes;      //!< Capacity of buffers held by messages
+        size_t live_buffers;
+        size_t pooled_bytes;    //!< Capacity of free buffers kept for reuse
+    };
+
+    char*  Allocate(size_t len, unsigned int &out_size_class);
+    void   Release(char *buf, size_t len, unsigned int size_class);
+    Stats  GetStats();
+
+} // namespace MessagePool
+
+/// Immutable outbound message: the wire header followed by the payload, in a pooled buffer of the nearest size class.
+/// Built once per relayed message; every recipient's queue only holds a reference to it.
+class Message {
+public:
+    static MessagePtr Create(int type, int source, unsigned int streamid, unsigned int payload_len, const char *payload);
+    static MessagePtr CreateVerbatim(int type, int source, unsigned int streamid, unsigned int payload_len,
+                                     const char *payload); //!< Keeps MSG2_STREAM_DATA_DISCARDABLE on the wire; for Bridge links, not clients
+
+    RoRnet::MessageType GetType() const { return m_type; } //!< As queued, i.e. may be MSG2_STREAM_DATA_DISCARDABLE
+    int                 GetSource() const { return GetHeader().source; }
+    unsigned int        GetStreamId() const { return GetHeader().streamid; }
+    unsigned int        GetPayloadLength() const { return GetHeader().size; }
+    const char*         GetPayload() const { return m_wire + sizeof(RoRnet::Header); }
+
+    const RoRnet::Header& GetHeader() const { return *reinterpret_cast<const RoRnet::Header*>(m_wire); }
+    const char*         GetWireData() const { return m_wire; } //!< Header + payload, ready to send
+    size_t              GetWireLength() const { return m_wire_len; }
+
+    Message(RoRnet::MessageType type, size_t wire_len); //!< Use Create()
+    ~Message();
+
+    Message(const Message&) = delete;
+    Message& operator=(const Message&) = delete;
+
+private:
+    static MessagePtr Build(int type, int wire_type, int source, unsigned int streamid, unsigned int payload_len,
+                            const char *payload);
+
+    RoRnet::MessageType   m_type;
+    char*                 m_wire;        //!< From MessagePool
+    size_t                m_wire_len;
+    unsigned int          m_size_class;
+};
@@ -20,6 +20,7 @@ If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "messaging.h"
+#include "message.h"
 
 #include "sequencer.h"
 #include "rornet.h"
@@ -29,6 +30,7 @@ If not, see <http://www.gnu.org/licenses/>.
 #include "http.h"
 #include "UnicodeStrings.h"
 
+#include <algorithm>
 #include <cstring>
 #include <stdarg.h>
 #include <time.h>
@@ -37,7 +39,14 @@ If not, see <http://www.gnu.org/licenses/>.
 
 #include <mutex>
 
-static stream_traffic_t s_traffic = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+#ifndef _WIN32
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif // _WIN32
+
+static stream_traffic_t s_traffic = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 static std::mutex s_traffic_mutex;
 
 namespace Messaging {
@@ -129,6 +138,27 @@ namespace Messaging {
         return 0;
     }
 
+    int SWSendMessage(SWInetSocket *socket, const Message &msg) {
+        assert(socket != nullptr);
+
+        SWBaseSocket::SWBaseError error;
+        const int msgsize = (int) msg.GetWireLength();
+
+        if (msgsize >= RORNET_MAX_MESSAGE_LENGTH) {
+            Logger::Log(LOG_ERROR, "UID: %d - attempt to send too long message", msg.GetSource());
+            return -4;
+        }
+
+        // The wire image is shared with other recipients, send it as-is
+        if (socket->fsend(msg.GetWireData(), msgsize, &error) < msgsize)
+        {
+            Logger::Log(LOG_ERROR, "send error -1: %s", error.get_error().c_str());
+            return -1;
+        }
+        StatsAddOutgoing(msgsize);
+        return 0;
+    }
+
 /**
  * @param out_type        Message type, see RoRnet::RoRnet::MSG2_* macros in rornet.h
  * @param out_source      Magic. Value 5000 used by serverlist to check this server.
@@ -180,9 +210,97 @@ namespace Messaging {
         return 0;
     }
 
+/**
+ * Sends the messages' wire images back to back without copying them; one sendmsg() call per
+ * batch unless the socket buffer fills up. Partial writes are resumed, bounded by SEND_TIMEOUT_SEC.
+ * @return 0 on success, negative number on error.
+ */
+    int SWSendMessages(SWInetSocket *socket, const std::vector<MessagePtr> &batch) {
+        assert(socket != nullptr);
+
+        for (const MessagePtr &msg : batch) {
+            if ((int) msg->GetWireLength() >= RORNET_MAX_MESSAGE_LENGTH) {
+                Logger::Log(LOG_ERROR, "UID: %d - attempt to send too long message", msg->GetSource());
+                return -4;
+            }
+        }
+
+#ifdef _WIN32
+        for (const MessagePtr &msg : batch) {
+            int res = SWSendMessage(socket, *msg);
+            if (res != 0) {
+                return res;
+            }
+        }
+        return 0;
+#else
+        SWBaseSocket::SWBaseError error;
+        int fd = socket->get_fd(&error);
+        if (fd < 0) {
+            Logger::Log(LOG_ERROR, "send error -2: %s", error.get_error().c_str());
+            return -2;
+        }
+
+        std::vector<iovec> iov(batch.size());
+        size_t total = 0;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            iov[i].iov_base = const_cast<char *>(batch[i]->GetWireData());
+            iov[i].iov_len = batch[i]->GetWireLength();
+            total += iov[i].iov_len;
+        }
+
+        size_t first = 0;
+        size_t remaining = total;
+        while (remaining > 0) {
+            msghdr mh;
+            memset(&mh, 0, sizeof(msghdr));
+            mh.msg_iov = &iov[first];
+            mh.msg_iovlen = std::min<size_t>(iov.size() - first, IOV_MAX); // Larger batches take several calls
+
+            ssize_t sent = sendmsg(fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    pollfd pfd;
+                    pfd.fd = fd;
+                    pfd.events = POLLOUT;
+                    pfd.revents = 0;
+                    int res = poll(&pfd, 1, SEND_TIMEOUT_SEC * 1000);
+                    if (res == 0) {
+                        Logger::Log(LOG_ERROR, "send error -3: timeout");
+                        return -3;
+                    }
+                    if (res < 0 && errno != EINTR) {
+                        Logger::Log(LOG_ERROR, "send error -1: %s", strerror(errno));
+                        return -1;
+                    }
+                    continue;
+                }
+                Logger::Log(LOG_ERROR, "send error -1: %s", strerror(errno));
+                return -1;
+            }
+
+            // Skip what went out, resume within a partially sent message
+            remaining -= (size_t) sent;
+            while (first < iov.size() && (size_t) sent >= iov[first].iov_len) {
+                sent -= iov[first].iov_len;
+                ++first;
+            }
+            if (sent > 0) {
+                iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + sent;
+                iov[first].iov_len -= sent;
+            }
+        }
+        StatsAddOutgoing((int) total);
+        return 0;
+#endif // _WIN32
+    }
+
     int getTime() { return (int) time(NULL); }
 
-    int broadcastLAN() {
+    int broadcastLAN(RoomConfig const& room) {
 #ifdef _WIN32
         // since socketw only abstracts TCP, we are on our own with UDP here :-/
         // the following code was only tested under windows
@@ -236,9 +354,9 @@ namespace Messaging {
         sprintf(tmp, "RoRServer|%s|%s:%d|%s|%d",
             RORNET_VERSION,
             Config::getIPAddr().c_str(),
-            Config::getListenPort(),
-            Config::getTerrainName().c_str(),
-            Config::getPublicPassword() == "" ? 0 : 1
+            room.port,
+            room.terrain.c_str(),
+            room.HasPassword() ? 1 : 0
             );
 
         // send the message
@@ -22,8 +22,11 @@ If not, see <http://www.gnu.org/licenses/>.
 #pragma once
 
 #include "sequencer.h"
+#include "message.h"
 #include "prerequisites.h"
 
+#include <vector>
+
 namespace Messaging {
 
     int SWSendMessage(
@@ -34,6 +37,12 @@ namespace Messaging {
             unsigned int payload_len,
             const char *payload);
 
+    int SWSendMessage(SWInetSocket *socket, const Message &msg);
+
+    static const int SEND_TIMEOUT_SEC = 60;
+
+    int SWSendMessages(SWInetSocket *socket, const std::vector<MessagePtr> &batch);
+
     int SWReceiveMessage(
             SWInetSocket *socket,
             int *out_msg_type,
@@ -43,10 +52,12 @@ namespace Messaging {
             char *out_payload,
             unsigned int payload_buf_len);
 
-    int broadcastLAN();
+    int broadcastLAN(RoomConfig const& room);
 
     void StatsAddIncoming(int bytes);
 
+    void StatsAddOutgoing(int bytes);
+
     void StatsAddIncomingDrop(int bytes);
 
     void StatsAddOutgoingDrop(int bytes);
@@ -0,0 +1,112 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/// Bounded lock-free multi-producer/single-consumer queue (after D. Vyukov's bounded MPMC queue).
+/// Each cell carries a sequence number which tells producers and the consumer whose turn it is,
+/// so producers only contend on one atomic increment and the consumer never writes shared state
+/// other than the cell it releases.
+template <typename T>
+class MpscRing {
+public:
+    explicit MpscRing(size_t capacity) :
+        m_cells(new Cell[capacity]),
+        m_mask(capacity - 1),
+        m_enqueue_pos(0),
+        m_dequeue_pos(0) {
+        assert(capacity >= 2 && (capacity & (capacity - 1)) == 0); // Power of two
+        for (size_t i = 0; i < capacity; ++i) {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    /// Any thread. @return false if the ring is full.
+    bool TryPush(T const& value) {
+        Cell* cell;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false; // Full
+            } else {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Consumer thread only. @return false if the ring is empty.
+    bool TryPop(T& out_value) {
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        Cell* cell = &m_cells[pos & m_mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        if ((intptr_t) seq - (intptr_t) (pos + 1) < 0) {
+            return false; // Empty, or the producer of this cell has not finished yet
+        }
+        out_value = std::move(cell->value);
+        cell->value = T();
+        m_dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+        cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Consumer thread only; exact from the consumer's point of view.
+    bool IsEmpty() const {
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        size_t seq = m_cells[pos & m_mask].sequence.load(std::memory_order_acquire);
+        return (intptr_t) seq - (intptr_t) (pos + 1) < 0;
+    }
+
+    size_t GetCapacity() const { return m_mask + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t>  sequence;
+        T                    value;
+    };
+
+    // Producers and the consumer work on separate cache lines. Padding rather than alignas(),
+    // since C++11 operator new doesn't honour extended alignment of the owning objects.
+    std::unique_ptr<Cell[]>  m_cells;
+    const size_t             m_mask;
+    char                     m_pad0[64];
+    std::atomic<size_t>      m_enqueue_pos;
+    char                     m_pad1[64];
+    std::atomic<size_t>      m_dequeue_pos;
+};
@@ -0,0 +1,487 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "poller.h"
+
+#include "broadcaster.h"
+#include "logger.h"
+#include "messaging.h"
+#include "sequencer.h"
+#include "SocketW.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif // __linux__
+
+static const int    POLLER_MAX_EVENTS = 64;
+static const int    POLLER_WAIT_MS = 1000;
+static const int    POLLER_ERROR_BACKOFF_MS = 100;      //!< After a failed epoll_wait()
+static const int    POLLER_MAX_READS_PER_EVENT = 4;    //!< Fairness - level triggered epoll will report the rest
+static const size_t POLLER_SEND_BUF_TARGET = 64 * 1024; //!< Stop pulling from the queue above this many unsent bytes
+static const size_t POLLER_MAX_IOVECS = 64;             //!< Messages per sendmsg() call
+static const std::chrono::seconds POLLER_RECV_TIMEOUT(60); //!< Same as the Receiver's socket timeout
+static const uint64_t POLLER_WAKE_TOKEN = 0;            //!< User IDs start at 1
+
+Poller::Poller() :
+    m_running(false) {
+}
+
+Poller::~Poller() {
+    this->Stop();
+}
+
+Poller::Worker* Poller::GetWorker(Client* client) {
+    return m_workers[static_cast<size_t>(client->GetUserId()) % m_workers.size()].get();
+}
+
+#ifdef __linux__
+
+bool Poller::Start(unsigned int num_workers) {
+    for (unsigned int i = 0; i < num_workers; ++i) {
+        std::unique_ptr<Worker> worker(new Worker());
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        epoll_event ev;
+        std::memset(&ev, 0, sizeof(epoll_event));
+        ev.events = EPOLLIN;
+        ev.data.u64 = POLLER_WAKE_TOKEN;
+        if (worker->epoll_fd < 0 || worker->event_fd < 0 ||
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd, &ev) < 0) {
+            Logger::Log(LOG_ERROR, "Poller: failed to set up epoll: %s", strerror(errno));
+            m_workers.push_back(std::move(worker)); // Let Stop() close the descriptors
+            this->Stop();
+            return false;
+        }
+        m_workers.push_back(std::move(worker));
+    }
+
+    m_running = true;
+    for (auto& worker : m_workers) {
+        worker->thread = std::thread(&Poller::WorkerMain, this, worker.get());
+    }
+    Logger::Log(LOG_INFO, "Poller: started %u worker threads", num_workers);
+    return true;
+}
+
+void Poller::Stop() {
+    m_running = false;
+    for (auto& worker : m_workers) {
+        if (worker->thread.joinable()) {
+            this->WakeWorker(worker.get());
+            worker->thread.join();
+        }
+        if (worker->event_fd >= 0) {
+            close(worker->event_fd);
+        }
+        if (worker->epoll_fd >= 0) {
+            close(worker->epoll_fd);
+        }
+    }
+    m_workers.clear();
+}
+
+void Poller::AddClient(Client* client) {
+    Worker* worker = this->GetWorker(client);
+    {
+        std::lock_guard<std::mutex> lock(worker->inbox_mutex);
+        worker->pending_add.push_back(client);
+    }
+    this->WakeWorker(worker);
+}
+
+void Poller::RemoveClient(Client* client) {
+    Worker* worker = this->GetWorker(client);
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    {
+        std::lock_guard<std::mutex> inbox_lock(worker->inbox_mutex);
+        worker->pending_send.erase(client->GetUserId());
+        auto pending = std::find(worker->pending_add.begin(), worker->pending_add.end(), client);
+        if (pending != worker->pending_add.end()) {
+            worker->pending_add.erase(pending); // Never registered
+        }
+    }
+
+    auto found = worker->connections.find(client->GetUserId());
+    if (found == worker->connections.end()) {
+        return;
+    }
+    Connection* conn = found->second.get();
+    if (!conn->closed) {
+        // Best effort: push out what's left (i.e. the kick message) like Broadcaster::Stop() does.
+        this->FlushConnection(worker, conn);
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    }
+    worker->connections.erase(found);
+}
+
+void Poller::NotifyOutbound(Client* client) {
+    Worker* worker = this->GetWorker(client);
+    bool wake = false;
+    {
+        std::lock_guard<std::mutex> lock(worker->inbox_mutex);
+        wake = worker->pending_send.empty(); // Otherwise a wakeup is already pending
+        worker->pending_send.insert(client->GetUserId());
+    }
+    if (wake) {
+        this->WakeWorker(worker);
+    }
+}
+
+void Poller::WakeWorker(Worker* worker) {
+    uint64_t one = 1;
+    if (write(worker->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        Logger::Log(LOG_ERROR, "Poller: failed to wake worker: %s", strerror(errno));
+    }
+}
+
+void Poller::WorkerMain(Worker* worker) {
+    Logger::Log(LOG_DEBUG, "Poller worker thread started");
+
+    epoll_event events[POLLER_MAX_EVENTS];
+    auto last_timeout_check = std::chrono::steady_clock::now();
+    while (m_running) {
+        int num_events = epoll_wait(worker->epoll_fd, events, POLLER_MAX_EVENTS, POLLER_WAIT_MS);
+        if (num_events < 0) {
+            // Keep serving the connections - the inbox and the timeouts still need processing
+            if (errno != EINTR) {
+                Logger::Log(LOG_ERROR, "Poller: epoll_wait() failed: %s", strerror(errno));
+                std::this_thread::sleep_for(std::chrono::milliseconds(POLLER_ERROR_BACKOFF_MS));
+            }
+            num_events = 0;
+        }
+
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        for (int i = 0; i < num_events; ++i) {
+            if (events[i].data.u64 == POLLER_WAKE_TOKEN) {
+                uint64_t counter;
+                if (read(worker->event_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+                    Logger::Log(LOG_ERROR, "Poller: failed to reset wakeup event: %s", strerror(errno));
+                }
+                continue;
+            }
+
+            // Look up by ID - the connection may have been removed since epoll_wait() returned.
+            auto found = worker->connections.find(static_cast<int>(events[i].data.u64));
+            if (found == worker->connections.end() || found->second->closed) {
+                continue;
+            }
+            Connection* conn = found->second.get();
+            if (conn->read_closed) {
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    this->CloseConnection(worker, conn, "Game connection closed"); // Nobody to send the rest to
+                }
+            } else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                this->ReadConnection(worker, conn);
+            }
+            if (!conn->closed && (events[i].events & EPOLLOUT)) {
+                this->FlushConnection(worker, conn);
+            }
+        }
+
+        this->WorkerProcessInbox(worker);
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_timeout_check >= std::chrono::seconds(1)) {
+            this->WorkerCheckTimeouts(worker);
+            last_timeout_check = now;
+        }
+    }
+
+    // Last round for what's still queued, e.g. the shutdown notice; best effort, the sockets don't block
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        for (auto& entry : worker->connections) {
+            if (!entry.second->closed) {
+                this->FlushConnection(worker, entry.second.get());
+            }
+        }
+    }
+
+    Logger::Log(LOG_DEBUG, "Poller worker thread exits");
+}
+
+void Poller::WorkerProcessInbox(Worker* worker) {
+    std::vector<Client*> to_add;
+    std::set<int> to_send;
+    {
+        std::lock_guard<std::mutex> lock(worker->inbox_mutex);
+        to_add.swap(worker->pending_add);
+        to_send.swap(worker->pending_send);
+    }
+
+    for (Client* client : to_add) {
+        this->RegisterConnection(worker, client);
+    }
+
+    for (int uid : to_send) {
+        auto found = worker->connections.find(uid);
+        if (found != worker->connections.end() && !found->second->closed) {
+            this->FlushConnection(worker, found->second.get());
+        }
+    }
+}
+
+void Poller::WorkerCheckTimeouts(Worker* worker) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto& entry : worker->connections) {
+        Connection* conn = entry.second.get();
+        if (!conn->read_closed && (now - conn->last_recv) > POLLER_RECV_TIMEOUT) {
+            Logger::Log(LOG_WARN, "Poller: user ID %d timed out", conn->uid);
+            this->CloseRead(worker, conn, "Game connection closed");
+        }
+    }
+}
+
+void Poller::RegisterConnection(Worker* worker, Client* client) {
+    const int uid = client->GetUserId();
+    Sequencer* sequencer = client->GetSequencer();
+    Logger::Log(LOG_DEBUG, "Poller: registering user ID %d", uid);
+
+    // Same as Receiver::ThreadMain(). This also waits for Sequencer::createClient() to return,
+    // because it holds the clients-mutex while sending the welcome message over the blocking socket.
+    sequencer->StartReceiving(client);
+    sequencer->sendMOTDSynchronized(uid);
+
+    SWBaseSocket::SWBaseError error;
+    int fd = client->GetSocket()->get_fd(&error);
+    if (fd < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        Logger::Log(LOG_ERROR, "Poller: cannot switch socket of user ID %d to non-blocking mode", uid);
+        sequencer->disconnectClient(uid, "Game connection closed");
+        return;
+    }
+
+    std::unique_ptr<Connection> conn(new Connection());
+    conn->client = client;
+    conn->sequencer = sequencer;
+    conn->fd = fd;
+    conn->uid = uid;
+    conn->last_recv = std::chrono::steady_clock::now();
+
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof(epoll_event));
+    ev.events = EPOLLIN;
+    ev.data.u64 = static_cast<uint64_t>(uid);
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        Logger::Log(LOG_ERROR, "Poller: cannot watch socket of user ID %d: %s", uid, strerror(errno));
+        sequencer->disconnectClient(uid, "Game connection closed");
+        return;
+    }
+
+    Connection* conn_ptr = conn.get();
+    worker->connections[uid] = std::move(conn);
+    Logger::Log(LOG_VERBOSE, "UID %d is switching to FLOW", uid);
+
+    this->FlushConnection(worker, conn_ptr); // The MOTD
+}
+
+void Poller::ReadConnection(Worker* worker, Connection* conn) {
+    int num_reads = 0;
+    while (!conn->read_closed && num_reads < POLLER_MAX_READS_PER_EVENT) {
+        char* dst = conn->reader.GetWritePtr();
+        ssize_t res = recv(conn->fd, dst, conn->reader.GetWriteSpace(), 0);
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            Logger::Log(LOG_WARN, "Poller: error receiving from user ID %d: %s", conn->uid, strerror(errno));
+            this->CloseRead(worker, conn, "Game connection closed");
+            return;
+        } else if (res == 0) {
+            this->CloseRead(worker, conn, "Game connection closed");
+            return;
+        }
+        conn->reader.CommitWrite(static_cast<size_t>(res));
+        conn->last_recv = std::chrono::steady_clock::now();
+        ++num_reads;
+
+        // Dispatch every complete frame - epoll won't report data which is already buffered
+        RoRnet::Header head;
+        char* payload = nullptr;
+        FrameReader::Result result;
+        while (!conn->read_closed && (result = conn->reader.NextFrame(head, payload)) != FrameReader::Result::NEED_DATA) {
+            if (result == FrameReader::Result::OVERSIZED) {
+                Logger::Log(LOG_WARN, "Poller: payload too long: %d/ max. %d bytes",
+                            (int)head.size, RORNET_MAX_MESSAGE_LENGTH);
+                this->CloseRead(worker, conn, "Game connection closed");
+                return;
+            }
+
+            Messaging::StatsAddIncoming((int)sizeof(RoRnet::Header) + (int)head.size);
+
+            if (head.command != RoRnet::MSG2_STREAM_DATA && head.command != RoRnet::MSG2_STREAM_DATA_DISCARDABLE) {
+                Logger::Log(LOG_VERBOSE, "got message: type: %d, source: %d:%d, len: %d",
+                            (int)head.command, (int)head.source, (int)head.streamid, (int)head.size);
+            }
+
+            if (head.command < 1000u || head.command > 1050u) {
+                this->CloseRead(worker, conn, "Protocol error 3");
+                return;
+            }
+
+            conn->sequencer->queueMessage(conn->uid, (int)head.command, head.streamid, payload, head.size);
+        }
+    }
+}
+
+void Poller::FlushConnection(Worker* worker, Connection* conn) {
+    MessagePtr msg;
+    while (!conn->closed) {
+        // Top up the send queue from the broadcaster queue
+        while (conn->send_bytes < POLLER_SEND_BUF_TARGET && conn->client->PopOutboundMessage(msg)) {
+            if (msg->GetType() == RoRnet::MSG2_INVALID) {
+                continue;
+            }
+            const size_t msgsize = msg->GetWireLength();
+            if (msgsize >= RORNET_MAX_MESSAGE_LENGTH) {
+                Logger::Log(LOG_ERROR, "UID: %d - attempt to send too long message", msg->GetSource());
+                this->CloseConnection(worker, conn, "Broadcaster: Send error");
+                return;
+            }
+
+            conn->send_bytes += msgsize;
+            conn->send_queue.push_back(std::move(msg));
+            Messaging::StatsAddOutgoing((int)msgsize);
+        }
+
+        if (conn->send_queue.empty()) {
+            conn->client->SetUnsentBytes(0);
+            this->UpdateEvents(worker, conn, /*want_write=*/false);
+            return; // All sent
+        }
+
+        // One iovec per message, resuming within a partially sent one - like Messaging::SWSendMessages()
+        iovec iov[POLLER_MAX_IOVECS];
+        size_t num_iov = 0;
+        for (auto itor = conn->send_queue.begin(); itor != conn->send_queue.end() && num_iov < POLLER_MAX_IOVECS; ++itor) {
+            const size_t offset = (num_iov == 0) ? conn->send_offset : 0;
+            iov[num_iov].iov_base = const_cast<char*>((*itor)->GetWireData()) + offset;
+            iov[num_iov].iov_len = (*itor)->GetWireLength() - offset;
+            ++num_iov;
+        }
+        msghdr mh;
+        std::memset(&mh, 0, sizeof(msghdr));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = num_iov;
+
+        ssize_t res = sendmsg(conn->fd, &mh, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->client->SetUnsentBytes(conn->send_bytes); // Keeps the teardown scheduler waiting
+                this->UpdateEvents(worker, conn, /*want_write=*/true); // Resume on EPOLLOUT
+                return;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            Logger::Log(LOG_ERROR, "send error -1: %s", strerror(errno));
+            this->CloseConnection(worker, conn, "Broadcaster: Send error");
+            return;
+        }
+
+        // Release the messages which went out
+        size_t sent = static_cast<size_t>(res);
+        conn->send_bytes -= sent;
+        while (sent > 0) {
+            const size_t rest = conn->send_queue.front()->GetWireLength() - conn->send_offset;
+            if (sent < rest) {
+                conn->send_offset += sent;
+                break;
+            }
+            sent -= rest;
+            conn->send_offset = 0;
+            conn->send_queue.pop_front();
+        }
+    }
+}
+
+void Poller::CloseRead(Worker* worker, Connection* conn, const char* reason) {
+    if (conn->read_closed) {
+        return;
+    }
+    conn->read_closed = true;
+
+    // Stop watching for input - a level triggered EOF would be reported over and over -
+    // but keep sending, so the client still gets e.g. the kick message.
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof(epoll_event));
+    ev.events = conn->want_write ? EPOLLOUT : 0;
+    ev.data.u64 = static_cast<uint64_t>(conn->uid);
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+
+    // The teardown scheduler will call RemoveClient() when the queue is drained.
+    conn->sequencer->disconnectClient(conn->uid, reason);
+}
+
+void Poller::CloseConnection(Worker* worker, Connection* conn, const char* reason) {
+    if (conn->closed) {
+        return;
+    }
+    this->CloseRead(worker, conn, reason);
+    conn->closed = true;
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+
+    // What's left can't be sent anymore; don't let the teardown scheduler wait for it
+    conn->send_queue.clear();
+    conn->send_offset = 0;
+    conn->send_bytes = 0;
+    conn->client->SetUnsentBytes(0);
+}
+
+void Poller::UpdateEvents(Worker* worker, Connection* conn, bool want_write) {
+    if (conn->closed || conn->want_write == want_write) {
+        return;
+    }
+
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof(epoll_event));
+    ev.events = (conn->read_closed ? 0 : EPOLLIN) | (want_write ? EPOLLOUT : 0);
+    ev.data.u64 = static_cast<uint64_t>(conn->uid);
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == 0) {
+        conn->want_write = want_write;
+    }
+}
+
+#else // __linux__
+
+bool Poller::Start(unsigned int num_workers) {
+    Logger::Log(LOG_ERROR, "Poller: epoll is not available on this platform");
+    return false;
+}
+
+void Poller::Stop() {}
+
+void Poller::AddClient(Client* client) {}
+
+void Poller::RemoveClient(Client* client) {}
+
+void Poller::NotifyOutbound(Client* client) {}
+
+#endif // __linux__
@@ -0,0 +1,109 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Foobar. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "rornet.h"
+#include "framereader.h"
+#include "message.h"
+#include "prerequisites.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+/// Event-driven network backend (Linux epoll): a small fixed set of worker
+/// threads owns the non-blocking client sockets, parses incoming RoRnet frames
+/// and drains the outbound queues of the clients' Broadcasters.
+/// Replaces the receiver+broadcaster thread pair of each client; this is
+/// the default `network-backend` on Linux. A session costs its Connection
+/// (frame buffer, references to the pending outbound messages), not two thread stacks.
+///
+/// One Poller serves the clients of all rooms; user IDs are unique in the process.
+///
+/// Lock order: Worker::mutex -> Sequencer::m_clients_mutex -> Worker::inbox_mutex.
+/// Worker::inbox_mutex is a leaf lock, so NotifyOutbound() and AddClient()
+/// are safe to call with the clients-mutex held.
+class Poller {
+public:
+    Poller();
+    ~Poller();
+
+    bool Start(unsigned int num_workers); //!< @return false if epoll is not available.
+    void Stop(); //!< Sends what the clients have queued as far as the sockets take it, then stops the workers.
+
+    void AddClient(Client* client);      //!< Registration completes asynchronously on the worker thread.
+    void RemoveClient(Client* client);   //!< Blocks until the worker has released the client.
+    void NotifyOutbound(Client* client); //!< Called by Broadcaster when a message was queued.
+
+private:
+    struct Connection {
+        Client*              client = nullptr;
+        Sequencer*           sequencer = nullptr;    //!< Of the client's room
+        int                  fd = -1;
+        int                  uid = 0;
+        bool                 read_closed = false;    //!< EOF/read error/timeout; still flushed until the teardown scheduler removes it
+        bool                 closed = false;         //!< Send error or hangup; no more I/O (implies `read_closed`)
+        bool                 want_write = false;     //!< EPOLLOUT is armed
+
+        // Inbound frames
+        FrameReader          reader;
+        std::chrono::steady_clock::time_point last_recv;
+
+        // Outbound messages not yet accepted by the socket; shared with the other recipients, not copied
+        std::deque<MessagePtr> send_queue;
+        size_t               send_offset = 0;        //!< Bytes of the front message already sent
+        size_t               send_bytes = 0;         //!< Unsent bytes in `send_queue`
+    };
+
+    struct Worker {
+        std::thread          thread;
+        int                  epoll_fd = -1;
+        int                  event_fd = -1;          //!< Wakes the worker from epoll_wait()
+        std::mutex           mutex;                  //!< Protects `connections`; held while dispatching events
+        std::map<int, std::unique_ptr<Connection>> connections; //!< Key: user ID
+
+        std::mutex           inbox_mutex;            //!< Leaf lock; protects `pending_add` and `pending_send`
+        std::vector<Client*> pending_add;
+        std::set<int>        pending_send;           //!< User IDs with freshly queued outbound messages
+    };
+
+    void        WorkerMain(Worker* worker);
+    void        WorkerProcessInbox(Worker* worker);
+    void        WorkerCheckTimeouts(Worker* worker);
+    void        WakeWorker(Worker* worker);
+    Worker*     GetWorker(Client* client);
+
+    void        RegisterConnection(Worker* worker, Client* client);
+    void        ReadConnection(Worker* worker, Connection* conn);
+    void        FlushConnection(Worker* worker, Connection* conn); //!< Moves queued messages to the socket
+    void        CloseRead(Worker* worker, Connection* conn, const char* reason); //!< Disconnects the client, keeps sending
+    void        CloseConnection(Worker* worker, Connection* conn, const char* reason);
+    void        UpdateEvents(Worker* worker, Connection* conn, bool want_write);
+
+    std::vector<std::unique_ptr<Worker>>  m_workers;
+    std::atomic<bool>                     m_running;
+};
@@ -14,10 +14,24 @@ class Receiver;
 
 class Listener;
 
+class Message;
+
+class Poller;
+
+class Hub;
+
+class TickRelay;
+
+class UdpChannel;
+
+class Bridge;
+
 class UserAuth;
 
 class ScriptEngine;
 
+struct RoomConfig;
+
 namespace Http {
     class Response;
 }
\ No newline at end of file
@@ -74,7 +74,7 @@ void Receiver::ThreadMain() {
     Logger::Log(LOG_DEBUG, "Started receiver thread (user ID %d)", m_client->GetUserId());
 
     m_client->GetSocket()->set_timeout((Uint32)60, 0); // 60sec
-    m_client->SetReceiveData(true);
+    m_sequencer->StartReceiving(m_client);
     Logger::Log(LOG_VERBOSE, "UID %d is switching to FLOW", m_client->GetUserId());
 
     m_sequencer->sendMOTDSynchronized(m_client->GetUserId());
@@ -105,14 +105,19 @@ void Receiver::ThreadMain() {
 
 bool Receiver::ThreadReceiveMessage()
 {
-    if (!this->ThreadReceiveHeader())
+    for (;;)
     {
-        return false; // Stop thread.
-    }
-
-    if (m_recv_header.size > 0)
-    {
-        if (!this->ThreadReceivePayload())
+        FrameReader::Result result = m_reader.NextFrame(m_recv_header, m_recv_payload);
+        if (result == FrameReader::Result::FRAME)
+        {
+            break;
+        }
+        else if (result == FrameReader::Result::OVERSIZED)
+        {
+            Logger::Log(LOG_WARN, "Receiver: payload too long: %d/ max. %d bytes", (int)m_recv_header.size, RORNET_MAX_MESSAGE_LENGTH);
+            return false; // Stop thread.
+        }
+        else if (!this->ThreadFillBuffer())
         {
             return false; // Stop thread.
         }
@@ -122,37 +127,19 @@ bool Receiver::ThreadReceiveMessage()
     return true; // Continue receiving.
 }
 
-bool Receiver::ThreadReceiveHeader() //!< @return false if thread should be stopped, true to continue.
-{
-    SWBaseSocket::SWBaseError error;
-
-    std::memset((void*)&m_recv_header, 0, sizeof(RoRnet::Header));
-    if (m_client->GetSocket()->frecv((char*)&m_recv_header, (int)sizeof(RoRnet::Header), &error) <= 0)
-    {
-        Logger::Log(LOG_WARN, "Receiver: error getting header: %s", error.get_error().c_str());
-        return false; // stop thread.
-    }
-
-    if (m_recv_header.size > RORNET_MAX_MESSAGE_LENGTH)
-    {
-        // Oversized payload
-        Logger::Log(LOG_WARN, "Receiver: payload too long: %d/ max. %d bytes", (int)m_recv_header.size, RORNET_MAX_MESSAGE_LENGTH);
-        return false; // Stop thread.
-    }
-
-    return true; // continue receiving.
-}
-
-bool Receiver::ThreadReceivePayload() //!< @return false if thread should be stopped, true to continue.
+bool Receiver::ThreadFillBuffer() //!< @return false if thread should be stopped, true to continue.
 {
     SWBaseSocket::SWBaseError error;
 
-    std::memset(m_recv_payload, 0, RORNET_MAX_MESSAGE_LENGTH);
-    if (m_client->GetSocket()->frecv(m_recv_payload, (int)m_recv_header.size, &error) <= 0)
+    // Take whatever the socket has; usually several frames at once
+    char* dst = m_reader.GetWritePtr();
+    int received = m_client->GetSocket()->recv(dst, (int)m_reader.GetWriteSpace(), &error);
+    if (received <= 0)
     {
-        Logger::Log(LOG_WARN, "Receiver: error getting payload: %s", error.get_error().c_str());
+        Logger::Log(LOG_WARN, "Receiver: error receiving data: %s", error.get_error().c_str());
         return false; // stop thread.
     }
 
+    m_reader.CommitWrite((size_t)received);
     return true; // continue receiving.
 }
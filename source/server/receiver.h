@@ -21,6 +21,7 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 #pragma once
 
 #include "rornet.h" // For RORNET_MAX_MESSAGE_LENGTH
+#include "framereader.h"
 #include "prerequisites.h"
 
 #include <mutex>
@@ -46,8 +47,7 @@ public:
 private:
     void ThreadMain();
     bool ThreadReceiveMessage(); //!< @return false if thread should be stopped, true to continue.
-    bool ThreadReceiveHeader(); //!< @return false if thread should be stopped, true to continue.
-    bool ThreadReceivePayload(); //!< @return false if thread should be stopped, true to continue.
+    bool ThreadFillBuffer(); //!< @return false if thread should be stopped, true to continue.
 
     Sequencer*  m_sequencer = nullptr; // global
     Client*     m_client = nullptr;    // data owner
@@ -55,8 +55,9 @@ private:
     ThreadState m_thread_state = ThreadState::NOT_RUNNING;
     std::thread m_thread;
 
-    // Received data buffers -- Keep here to be allocated on heap (along with Client)
+    // Received data -- the payload points into the reader's buffer
+    FrameReader    m_reader;
     RoRnet::Header m_recv_header;
-    char           m_recv_payload[RORNET_MAX_MESSAGE_LENGTH];
+    char*          m_recv_payload = nullptr;
 };
 
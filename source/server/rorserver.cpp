@@ -26,6 +26,8 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 #include "config.h"
 #include "messaging.h"
 #include "listener.h"
+#include "poller.h"
+#include "taskexecutor.h"
 #include "master-server.h"
 #include "utils.h"
 
@@ -35,7 +37,9 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 #include <iostream>
 #include <cstdlib>
 #include <csignal>
+#include <memory>
 #include <stdexcept>
+#include <vector>
 
 #include <stdio.h>
 #include <string.h>
@@ -56,9 +60,40 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 #endif // _WIN32
 
 
-static Sequencer s_sequencer;
-static MasterServer::Client s_master_server;
+/// One hosted room, see Config::getRooms(). The rooms share the task executor,
+/// the epoll poller, the logger and the process-wide statistics.
+struct Room {
+    Sequencer                 sequencer;
+    Listener                  listener;
+    MasterServer::Client      master_server;
+
+    Room() : listener(&sequencer) {}
+};
+
+static std::vector<std::unique_ptr<Room>> s_rooms;
+static Poller *s_poller = nullptr; //!< Only with the epoll network backend
 static bool s_exit_requested = false;
+
+static void UnregisterRooms() {
+    for (std::unique_ptr<Room> &room : s_rooms) {
+        if (room->master_server.IsRegistered()) {
+            room->master_server.UnRegister();
+        }
+    }
+}
+
+static void CloseRooms() {
+    for (std::unique_ptr<Room> &room : s_rooms) {
+        room->listener.Shutdown();
+        room->sequencer.Close();
+    }
+    if (s_poller != nullptr) {
+        s_poller->Stop();
+        delete s_poller;
+        s_poller = nullptr;
+    }
+    TaskExecutor::Stop();
+}
 #ifndef _WIN32
 
 void handler(int signalnum) {
@@ -87,14 +122,11 @@ void handler(int signalnum) {
     if (terminate) {
         if (Config::getServerMode() == SERVER_LAN) {
             Logger::Log(LOG_INFO, "closing server ... ");
-            s_sequencer.Close();
         } else {
             Logger::Log(LOG_INFO, "closing server ... unregistering ... ");
-            if (s_master_server.IsRegistered()) {
-                s_master_server.UnRegister();
-            }
-            s_sequencer.Close();
+            UnregisterRooms();
         }
+        CloseRooms();
         exit(0);
     }
 }
@@ -124,12 +156,9 @@ BOOL WINAPI WindowsConsoleHandlerRoutine(DWORD ctrl_type)
         return TRUE; // Means 'event handled'
     }
 
-    if (s_master_server.IsRegistered())
-    {
-        Logger::Log(LOG_INFO, "Unregistering...");
-        s_master_server.UnRegister();
-    }
-    s_sequencer.Close(); // TODO: This somehow closes (crashes?) the process on Windows, debugger doesn't intercept anything...
+    Logger::Log(LOG_INFO, "Unregistering...");
+    UnregisterRooms();
+    CloseRooms(); // TODO: This somehow closes (crashes?) the process on Windows, debugger doesn't intercept anything...
     Logger::Log(LOG_INFO, "Clean exit (Windows)");
     ExitProcess(0); // Recommended by MSDN, see above link.
 }
@@ -239,6 +268,56 @@ void daemonize() {
 
 #endif // ! _WIN32
 
+static void UpdateMinuteStats() {
+    Messaging::UpdateMinuteStats();
+    for (std::unique_ptr<Room> &room : s_rooms) {
+        room->sequencer.UpdateMinuteStats();
+    }
+
+    TaskExecutor::Stats task_stats[TaskExecutor::NUM_TASK_TYPES];
+    TaskExecutor::TakeStats(task_stats);
+    if (!Config::getPrintStats()) {
+        return;
+    }
+    for (int type = 0; type < TaskExecutor::NUM_TASK_TYPES; ++type) {
+        const TaskExecutor::Stats& tasks = task_stats[type];
+        if (tasks.completed == 0 && tasks.rejected == 0) {
+            continue;
+        }
+        Logger::Log(LOG_INFO, "- %s tasks (last minute): %zu run, %zu rejected; waited %0.1f ms on average, %0.1f ms at most; "
+                    "ran %0.1f ms on average, %0.1f ms at most",
+                    TaskExecutor::GetTaskTypeName(static_cast<TaskExecutor::TaskType>(type)), tasks.completed, tasks.rejected,
+                    (tasks.completed > 0) ? tasks.queued_us / 1000.0 / tasks.completed : 0.0, tasks.longest_queued_us / 1000.0,
+                    (tasks.completed > 0) ? tasks.run_us / 1000.0 / tasks.completed : 0.0, tasks.longest_run_us / 1000.0);
+    }
+}
+
+static bool SendHeartbeat(Room &room) {
+    Logger::Log(LOG_VERBOSE, "Sending heartbeat (port %u)...", room.sequencer.GetRoom().port);
+    Json::Value user_list(Json::arrayValue);
+    room.sequencer.GetHeartbeatUserList(user_list);
+    if (room.master_server.SendHeatbeat(user_list)) {
+        Logger::Log(LOG_VERBOSE, "Heartbeat sent OK");
+        return true;
+    }
+
+    unsigned int timeout = Config::GetHeartbeatRetrySeconds();
+    unsigned int max_retries = Config::GetHeartbeatRetryCount();
+    Logger::Log(LOG_WARN, "A heartbeat failed! Retry in %d seconds.", timeout);
+    for (unsigned int i = 0; i < max_retries; ++i) {
+        Utils::SleepSeconds(timeout);
+        bool success = room.master_server.SendHeatbeat(user_list);
+
+        LogLevel log_level = (success ? LOG_INFO : LOG_ERROR);
+        const char *log_result = (success ? "successful." : "failed.");
+        Logger::Log(log_level, "Heartbeat retry %d/%d %s", i + 1, max_retries, log_result);
+        if (success) {
+            return true;
+        }
+    }
+    return false;
+}
+
 int main(int argc, char *argv[]) {
     // set default verbose levels
     Logger::SetLogLevel(LOGTYPE_DISPLAY, LOG_INFO);
@@ -309,22 +388,42 @@ int main(int argc, char *argv[]) {
 #endif // ! _WIN32
 
 
-    Listener listener(&s_sequencer);
-    if (!listener.Initialize()) {
-        return -1;
+    TaskExecutor::Start(Config::getTaskThreads());
+
+    if (Config::getNetworkBackend() == NETWORK_BACKEND_EPOLL) {
+        s_poller = new Poller();
+        if (!s_poller->Start(Config::getNetworkThreads())) {
+            Logger::Log(LOG_WARN, "epoll network backend not available, falling back to thread per client");
+            delete s_poller;
+            s_poller = nullptr;
+        }
+    }
+
+    for (RoomConfig const &room_config : Config::getRooms()) {
+        s_rooms.emplace_back(new Room());
+        Room &room = *s_rooms.back();
+        room.sequencer.Initialize(room_config, s_poller);
+        if (!room.listener.Initialize()) {
+            CloseRooms();
+            return -1;
+        }
     }
-    s_sequencer.Initialize();
 
-    // Listener is ready, let's register ourselves on serverlist (which will contact us back to check).
+    // Listeners are ready, let's register ourselves on serverlist (which will contact us back to check).
     if (server_mode != SERVER_LAN) {
-        bool registered = s_master_server.Register();
+        bool registered = true;
+        for (std::unique_ptr<Room> &room : s_rooms) {
+            registered = registered && room->master_server.Register(room->sequencer.GetRoom());
+        }
         if (!registered && (server_mode == SERVER_INET)) {
             Logger::Log(LOG_ERROR, "Failed to register on serverlist. Exit");
-            listener.Shutdown();
+            UnregisterRooms();
+            CloseRooms();
             return -1;
         } else if (!registered) // server_mode == SERVER_AUTO
         {
             Logger::Log(LOG_WARN, "Failed to register on serverlist, continuing in LAN mode");
+            UnregisterRooms();
             server_mode = SERVER_LAN;
         } else {
             Logger::Log(LOG_INFO, "Registration successful");
@@ -336,57 +435,36 @@ int main(int argc, char *argv[]) {
     if (server_mode != SERVER_LAN) {
         //heartbeat
         while (!s_exit_requested) {
-            Messaging::UpdateMinuteStats();
-            s_sequencer.UpdateMinuteStats();
+            UpdateMinuteStats();
 
             //every minute
             Utils::SleepSeconds(Config::GetHeartbeatIntervalSec());
 
-            Logger::Log(LOG_VERBOSE, "Sending heartbeat...");
-            Json::Value user_list(Json::arrayValue);
-            s_sequencer.GetHeartbeatUserList(user_list);
-            if (!s_master_server.SendHeatbeat(user_list)) {
-                unsigned int timeout = Config::GetHeartbeatRetrySeconds();
-                unsigned int max_retries = Config::GetHeartbeatRetryCount();
-                Logger::Log(LOG_WARN, "A heartbeat failed! Retry in %d seconds.", timeout);
-                bool success = false;
-                for (unsigned int i = 0; i < max_retries; ++i) {
-                    Utils::SleepSeconds(timeout);
-                    success = s_master_server.SendHeatbeat(user_list);
-
-                    LogLevel log_level = (success ? LOG_INFO : LOG_ERROR);
-                    const char *log_result = (success ? "successful." : "failed.");
-                    Logger::Log(log_level, "Heartbeat retry %d/%d %s", i + 1, max_retries, log_result);
-                    if (success) {
-                        break;
-                    }
-                }
-                if (!success) {
+            for (std::unique_ptr<Room> &room : s_rooms) {
+                if (!SendHeartbeat(*room)) {
                     Logger::Log(LOG_ERROR, "Unable to send heartbeats, exit");
                     s_exit_requested = true;
+                    break;
                 }
-            } else {
-                Logger::Log(LOG_VERBOSE, "Heartbeat sent OK");
             }
         }
 
-        if (s_master_server.IsRegistered()) {
-            s_master_server.UnRegister();
-        }
+        UnregisterRooms();
     } else {
         while (!s_exit_requested) {
-            Messaging::UpdateMinuteStats();
-            s_sequencer.UpdateMinuteStats();
+            UpdateMinuteStats();
 
             // broadcast our "i'm here" signal
-            Messaging::broadcastLAN();
+            for (std::unique_ptr<Room> &room : s_rooms) {
+                Messaging::broadcastLAN(room->sequencer.GetRoom());
+            }
 
             // sleep a minute
             Utils::SleepSeconds(60);
         }
     }
 
-    s_sequencer.Close();
+    CloseRooms();
     return 0;
 }
 
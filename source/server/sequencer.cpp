@@ -30,11 +30,17 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 #include "config.h"
 #include "utils.h"
 #include "ScriptEngine.h"
+#include "poller.h"
+#include "hub.h"
+#include "message.h"
+#include "bundle.h"
 
 #include <stdio.h>
 #include <time.h>
 #include <chrono>
+#include <cstring>
 #include <string>
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include <sstream>
@@ -45,7 +51,12 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 
 #endif
 
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
 Client::Client(Sequencer *sequencer, SWInetSocket *socket) :
+        drop_state(0),
         m_socket(socket),
         m_receiver(sequencer),
         m_broadcaster(sequencer),
@@ -53,31 +64,104 @@ Client::Client(Sequencer *sequencer, SWInetSocket *socket) :
         m_status(Client::STATUS_USED),
         m_spamfilter(sequencer, this),
         m_is_receiving_data(false),
-        m_is_initialized(false) {
+        m_is_initialized(false),
+        m_snapshot_refs(0),
+        m_udp_route(false),
+        m_socket_shut_down(false),
+        m_unsent_bytes(0) {
 }
 
 void Client::StartThreads() {
-    m_receiver.Start(this);
-    m_broadcaster.Start(this);
+    if (this->HasSessionOption(STREAM_DELTA_SESSION_OPTION)) {
+        Logger::Log(LOG_VERBOSE, "UID %d receives delta encoded stream data", this->GetUserId());
+        m_broadcaster.EnableDeltaEncoding();
+    }
+    if (Config::getCompression() && PayloadCompressor::IsAvailable() &&
+        this->HasSessionOption(COMPRESSION_SESSION_OPTION)) {
+        Logger::Log(LOG_VERBOSE, "UID %d receives compressed data", this->GetUserId());
+        m_broadcaster.EnableCompression();
+    }
+    if (this->HasSessionOption(BUNDLE_SESSION_OPTION)) {
+        Logger::Log(LOG_VERBOSE, "UID %d receives bundled messages", this->GetUserId());
+        m_broadcaster.EnableBundling();
+    }
+
+    if (m_sequencer->m_poller != nullptr) {
+        m_broadcaster.StartPolled(this, m_sequencer->m_poller);
+        m_sequencer->m_poller->AddClient(this);
+    } else {
+        m_receiver.Start(this);
+        m_broadcaster.Start(this);
+    }
 }
 
 void Client::Disconnect() {
+    // Release the socket from the poller (epoll backend)
+    if (m_sequencer->m_poller != nullptr) {
+        m_sequencer->m_poller->RemoveClient(this);
+    }
+    if (m_sequencer->m_udp_channel != nullptr) {
+        m_udp_route = false;
+        m_sequencer->m_udp_channel->RemovePeer(this->GetUserId());
+    }
+
     // Signal threads to stop and wait for them to finish
     m_broadcaster.Stop();
     m_receiver.Stop();
 
-    // Disconnect the socket
-    SWBaseSocket::SWBaseError result;
-    bool disconnected_ok = m_socket->disconnect(&result);
-    if (!disconnected_ok || (result != SWBaseSocket::base_error::ok)) {
-        Logger::Log(
-                LOG_ERROR,
-                "Internal: Error while disconnecting client - failed to disconnect socket. Message: %s",
-                result.get_error().c_str());
+    // Disconnect the socket, unless it was shut down already - then deleting it closes it
+    if (!m_socket_shut_down) {
+        SWBaseSocket::SWBaseError result;
+        bool disconnected_ok = m_socket->disconnect(&result);
+        if (!disconnected_ok || (result != SWBaseSocket::base_error::ok)) {
+            Logger::Log(
+                    LOG_ERROR,
+                    "Internal: Error while disconnecting client - failed to disconnect socket. Message: %s",
+                    result.get_error().c_str());
+        }
     }
     delete m_socket;
 }
 
+void Client::ShutdownSocket(bool read_only) {
+    SWBaseSocket::SWBaseError error;
+    int fd = m_socket->get_fd(&error);
+    if (fd < 0) {
+        return;
+    }
+#ifdef _WIN32
+    shutdown(fd, read_only ? SD_RECEIVE : SD_BOTH);
+#else
+    shutdown(fd, read_only ? SHUT_RD : SHUT_RDWR);
+#endif
+    m_socket_shut_down = true;
+}
+
+void Client::ReleaseSnapshotRef() {
+    std::function<void()> callback;
+    {
+        // Under the lock, so WhenOutOfSnapshots() can't see 0 - and delete the client - before we're done
+        std::lock_guard<std::mutex> lock(m_snapshot_mutex);
+        if (--m_snapshot_refs == 0) {
+            callback.swap(m_out_of_snapshots);
+        }
+    }
+    if (callback) {
+        callback(); // May delete this client - don't touch it afterwards
+    }
+}
+
+void Client::WhenOutOfSnapshots(std::function<void()> callback) {
+    {
+        std::lock_guard<std::mutex> lock(m_snapshot_mutex);
+        if (m_snapshot_refs > 0) {
+            m_out_of_snapshots = std::move(callback); // The last ReleaseSnapshotRef() will find it
+            return;
+        }
+    }
+    callback();
+}
+
 bool Client::CheckSpawnRate()
 {
     // CAUTION - called by Sequencer with clients-mutex locked
@@ -116,6 +200,23 @@ bool Client::CheckSpawnRate()
     return rate <= Config::getMaxSpawnRate();
 }
 
+bool Client::HasSessionOption(std::string const& option) const {
+    // Words separated by spaces or commas; the field may not be terminated
+    const std::string options(user.sessionoptions, strnlen(user.sessionoptions, sizeof(user.sessionoptions)));
+    size_t pos = 0;
+    while (pos < options.size()) {
+        size_t end = options.find_first_of(" ,", pos);
+        if (end == std::string::npos) {
+            end = options.size();
+        }
+        if (options.compare(pos, end - pos, option) == 0) {
+            return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
 std::string Client::GetIpAddress() {
     SWBaseSocket::SWBaseError result;
     std::string ip = m_socket->get_peerAddr(&result);
@@ -130,7 +231,40 @@ std::string Client::GetIpAddress() {
 
 void Client::QueueMessage(int msg_type, int client_id, unsigned int stream_id, unsigned int payload_len,
                           const char *payload) {
-    m_broadcaster.QueueMessage(msg_type, client_id, stream_id, payload_len, payload);
+    m_broadcaster.QueueMessage(Message::Create(msg_type, client_id, stream_id, payload_len, payload));
+}
+
+void Client::QueueMessage(MessagePtr const& msg) {
+    if (msg->GetType() == RoRnet::MSG2_STREAM_DATA_DISCARDABLE && m_udp_route) {
+        m_sequencer->m_udp_channel->Send(this->GetUserId(), msg);
+        return;
+    }
+    m_broadcaster.QueueMessage(msg);
+}
+
+void Client::UpdateDropState() {
+    // Called by the threads processing this client's inbound messages - TCP and UDP may race,
+    // only the one which flips the state informs the client
+
+    bool is_dropping = this->IsBroadcasterDroppingPackets();
+    int expected = is_dropping ? 0 : 1;
+    int new_state = is_dropping ? 1 : 0;
+    if (drop_state.compare_exchange_strong(expected, new_state)) {
+        // queue full / working better again, inform client
+        this->QueueMessage(RoRnet::MSG2_NETQUALITY, -1, 0, sizeof(int), (char *) &new_state);
+    }
+}
+
+void Client::AddStreamTraffic(unsigned int stream_id, double incoming, double outgoing) {
+    std::lock_guard<std::mutex> lock(streams_traffic_mutex);
+    stream_traffic_t& traffic = streams_traffic[stream_id];
+    traffic.bandwidthIncoming += incoming;
+    traffic.bandwidthOutgoing += outgoing;
+}
+
+std::map<unsigned int, stream_traffic_t> Client::GetStreamsTraffic() {
+    std::lock_guard<std::mutex> lock(streams_traffic_mutex);
+    return streams_traffic;
 }
 
 // Yes, this is weird. To be refactored.
@@ -141,38 +275,106 @@ void Client::NotifyAllVehicles(Sequencer *sequencer) {
     if (!m_is_initialized) {
         sequencer->IntroduceNewClientToAllVehicles(this);
         m_is_initialized = true;
+        sequencer->PublishRecipients();
+    }
+}
+
+bool RecipientSnapshot::Entry::FindStream(unsigned int stream_id, int &out_type) const {
+    auto found = std::lower_bound(streams.begin(), streams.end(), stream_id,
+        [](std::pair<unsigned int, int> const& stream, unsigned int id) { return stream.first < id; });
+    if (found == streams.end() || found->first != stream_id) {
+        return false;
     }
+    out_type = found->second;
+    return true;
+}
+
+RecipientSnapshot::~RecipientSnapshot() {
+    for (Entry& entry : entries) {
+        entry.client->ReleaseSnapshotRef();
+    }
+}
+
+const RecipientSnapshot::Entry* RecipientSnapshot::Find(unsigned int uid) const {
+    auto found = std::lower_bound(entries.begin(), entries.end(), uid,
+        [](Entry const& entry, unsigned int id) { return entry.uid < id; });
+    return (found != entries.end() && found->uid == uid) ? &*found : nullptr;
 }
 
+std::atomic<unsigned int> Sequencer::s_free_user_id(1);
+
 Sequencer::Sequencer() :
         m_script_engine(nullptr),
+        m_poller(nullptr),
+        m_hub(nullptr),
+        m_hub_utilization(0.f),
+        m_tick_relay(nullptr),
+        m_tick_superseded_last_minute(0),
+        m_udp_channel(nullptr),
+        m_bridge(nullptr),
+        m_aoi_filtered(0),
+        m_aoi_filtered_last_minute(0),
+        m_decimated_last_minute(0),
         m_auth_resolver(nullptr),
         m_num_disconnects_total(0),
         m_num_disconnects_crash(0),
         m_blacklist(this),
         m_bot_count(0),
-        m_free_user_id(1) {
+        m_recipients(std::make_shared<RecipientSnapshot>()),
+        m_num_stalled_disconnects(0),
+        m_teardown(this) {
     m_start_time = static_cast<int>(time(nullptr));
 }
 
 /**
  * Initialize, needs to be called before the class is used
  */
-void Sequencer::Initialize() {
-    m_clients.reserve(Config::getMaxClients());
+void Sequencer::Initialize(RoomConfig const& room, Poller *poller) {
+    m_room = room;
+    m_poller = poller;
+    m_clients.Reserve(m_room.max_clients);
+
+    if (Config::getUdpChannel()) {
+        m_udp_channel = new UdpChannel(this);
+        if (!m_udp_channel->Start(m_room.port)) {
+            Logger::Log(LOG_WARN, "UDP channel not available, all data goes over TCP");
+            delete m_udp_channel;
+            m_udp_channel = nullptr;
+        }
+    }
 
 #ifdef WITH_ANGELSCRIPT
-    if (Config::getEnableScripting()) {
+    if (!m_room.script.empty()) {
         m_script_engine = new ScriptEngine(this);
-        m_script_engine->loadScript(Config::getScriptName());
+        m_script_engine->loadScript(m_room.script);
     }
 #endif //WITH_ANGELSCRIPT
 
-    this->StartKillerThread();
+    m_teardown.Start();
+
+    if (Config::getHubThread()) {
+        m_hub_payload.resize(RORNET_MAX_MESSAGE_LENGTH + 1);
+        m_hub = new Hub(this);
+        m_hub->Start();
+    }
+
+    if (Config::getTickRate() > 0) {
+        m_tick_relay = new TickRelay(this);
+        m_tick_relay->Start(Config::getTickRate());
+    }
 
     m_auth_resolver = new UserAuth(Config::getAuthFile());
 
     m_blacklist.LoadBlacklistFromFile();
+
+    if (m_room.bridge_port != 0 || !m_room.bridge_peers.empty()) {
+        m_bridge = new Bridge(this);
+        if (!m_bridge->Start(m_room.bridge_port, m_room.bridge_peers)) {
+            Logger::Log(LOG_WARN, "Bridge not available, room '%s' is not linked with other nodes", m_room.name.c_str());
+            delete m_bridge;
+            m_bridge = nullptr;
+        }
+    }
 }
 
 /**
@@ -180,12 +382,33 @@ void Sequencer::Initialize() {
  * this is in place of the destructor.
  */
 void Sequencer::Close() {
+    if (m_bridge != nullptr) {
+        m_bridge->Stop();
+        delete m_bridge;
+        m_bridge = nullptr;
+    }
+    if (m_hub != nullptr) {
+        m_hub->Stop();
+        delete m_hub;
+        m_hub = nullptr;
+    }
+    if (m_tick_relay != nullptr) {
+        m_tick_relay->Stop();
+        delete m_tick_relay;
+        m_tick_relay = nullptr;
+    }
+
     Logger::Log(LOG_INFO, "closing. disconnecting clients ...");
 
     const char *str = "server shutting down (try to reconnect later!)";
     for (unsigned int i = 0; i < m_clients.size(); i++) {
-        // HACK-ISH override all thread stuff and directly send it!
         Client *client = m_clients[i];
+        if (m_poller != nullptr) {
+            // The socket is non-blocking and owned by the poller, which flushes the queues before it stops
+            client->QueueMessage(RoRnet::MSG2_USER_LEAVE, client->user.uniqueid, 0, strlen(str), str);
+            continue;
+        }
+        // HACK-ISH override all thread stuff and directly send it!
         Messaging::SWSendMessage(client->GetSocket(), RoRnet::MSG2_USER_LEAVE, client->user.uniqueid, 0, strlen(str),
                                str);
     }
@@ -203,37 +426,13 @@ void Sequencer::Close() {
         m_auth_resolver = nullptr;
     }
 
-    this->StopKillerThread();
-}
+    m_teardown.Stop();
+    m_poller = nullptr; // Shared; stopped by its owner once all rooms are closed
 
-void Sequencer::StartKillerThread()
-{
-    std::lock_guard<std::mutex> lock(m_killer_mutex);
-    if (m_killer_state != KillerThreadState::NOT_RUNNING)
-    {
-        return;
-    }
-    m_killer_thread = std::thread(&Sequencer::KillerThreadMain, this);
-    m_killer_state = KillerThreadState::RUNNING;
-}
-
-void Sequencer::StopKillerThread()
-{
-    {
-        std::lock_guard<std::mutex> lock(m_killer_mutex);
-        if (m_killer_state != KillerThreadState::RUNNING)
-        {
-            return;
-        }
-        m_killer_state = KillerThreadState::STOP_REQUESTED;
-    }
-    
-    m_killer_cond.notify_one();
-    m_killer_thread.join();
-
-    {
-        std::lock_guard<std::mutex> lock(m_killer_mutex);
-        m_killer_state = KillerThreadState::NOT_RUNNING;
+    if (m_udp_channel != nullptr) {
+        m_udp_channel->Stop();
+        delete m_udp_channel;
+        m_udp_channel = nullptr;
     }
 }
 
@@ -241,33 +440,14 @@ bool Sequencer::CheckNickIsUnique(std::string &nick) {
     // WARNING: be sure that this is only called within a clients_mutex lock!
 
     // check for duplicate names
-    for (unsigned int i = 0; i < m_clients.size(); i++) {
-        if (nick == Str::SanitizeUtf8(m_clients[i]->user.username)) {
-            return true;
-        }
-    }
-    return false;
+    return m_clients.IsNickTaken(nick);
 }
 
 
 int Sequencer::GetFreePlayerColour() {
     // WARNING: be sure that this is only called within a clients_mutex lock!
 
-    int col = 0;
-    for (;;) // TODO: How many colors ARE there?
-    {
-        bool collision = false;
-        for (unsigned int i = 0; i < m_clients.size(); i++) {
-            if (m_clients[i]->user.colournum == col) {
-                collision = true;
-                break;
-            }
-        }
-        if (!collision) {
-            return col;
-        }
-        col++;
-    }
+    return m_clients.GetFreeColour();
 }
 
 void Sequencer::createClient(SWInetSocket *sock, RoRnet::UserInfo user) {
@@ -288,7 +468,7 @@ void Sequencer::createClient(SWInetSocket *sock, RoRnet::UserInfo user) {
 
     // check if server is full
     Logger::Log(LOG_DEBUG, "searching free slot for new client...");
-    if (m_clients.size() >= (Config::getMaxClients() + m_bot_count)) {
+    if (m_clients.size() >= (m_room.max_clients + m_bot_count)) {
         Logger::Log(LOG_WARN, "join request from '%s' on full server: rejecting!",
                     Str::SanitizeUtf8(user.username).c_str());
         // set a low time out because we don't want to cause a back up of
@@ -341,14 +521,15 @@ void Sequencer::createClient(SWInetSocket *sock, RoRnet::UserInfo user) {
     Logger::Log(LOG_INFO, Str::SanitizeUtf8(buf));
 
     // assign unique userid
-    unsigned int client_id = m_free_user_id;
+    unsigned int client_id = s_free_user_id++;
     to_add->user.uniqueid = client_id;
 
-    // count up unique id
-    m_free_user_id++;
-
     // add the client to the vector
-    m_clients.push_back(to_add);
+    m_clients.Add(to_add);
+    this->PublishRecipients();
+    if (m_clients.CountByIp(ip) > 1) {
+        Logger::Log(LOG_VERBOSE, "%u clients connected from IP %s", (unsigned int) m_clients.CountByIp(ip), ip.c_str());
+    }
     // create one thread for the receiver
     // and one for the broadcaster
     to_add->StartThreads();
@@ -360,6 +541,15 @@ void Sequencer::createClient(SWInetSocket *sock, RoRnet::UserInfo user) {
         return;
     }
 
+    // Not with delta encoding: its reference payloads must be the ones which arrived over TCP
+    if (m_udp_channel != nullptr && to_add->HasSessionOption(UDP_SESSION_OPTION) &&
+        !to_add->HasSessionOption(STREAM_DELTA_SESSION_OPTION)) {
+        RoRnet::UdpChannelInfo udp_info;
+        udp_info.token = m_udp_channel->AddPeer(client_id);
+        udp_info.port = m_udp_channel->GetPort();
+        to_add->QueueMessage(RoRnet::MSG2_UDP_CHANNEL, client_id, 0, sizeof(RoRnet::UdpChannelInfo), (char *) &udp_info);
+    }
+
     // Do script callback
 #ifdef WITH_ANGELSCRIPT
     if (m_script_engine != nullptr) {
@@ -372,9 +562,13 @@ void Sequencer::createClient(SWInetSocket *sock, RoRnet::UserInfo user) {
     RoRnet::UserInfo info_for_others = to_add->user;
     memset(info_for_others.usertoken, 0, 40);
     memset(info_for_others.clientGUID, 0, 40);
+    MessagePtr join_msg = Message::Create(RoRnet::MSG2_USER_JOIN, client_id, 0, sizeof(RoRnet::UserInfo),
+                                          (char *) &info_for_others);
     for (unsigned int i = 0; i < m_clients.size(); i++) {
-        m_clients[i]->QueueMessage(RoRnet::MSG2_USER_JOIN, client_id, 0, sizeof(RoRnet::UserInfo),
-                                   (char *) &info_for_others);
+        m_clients[i]->QueueMessage(join_msg);
+    }
+    if (m_bridge != nullptr) {
+        m_bridge->Forward(join_msg);
     }
 
     printStats();
@@ -385,6 +579,12 @@ void Sequencer::createClient(SWInetSocket *sock, RoRnet::UserInfo user) {
 
 void Sequencer::disconnectClient(int client_id, const char* error, bool isError /*= true*/, bool doScriptCallback /*= true*/)
 {
+    if (m_hub != nullptr) {
+        // Keep the order with the client's messages
+        m_hub->PostDisconnect(client_id, error, isError, doScriptCallback);
+        return;
+    }
+
     std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
     this->QueueClientForDisconnect(client_id, error, isError, doScriptCallback);
 }
@@ -400,11 +600,15 @@ void Sequencer::broadcastUserInfo(int client_id) {
     RoRnet::UserInfo info_for_others = client->user;
     memset(info_for_others.usertoken, 0, 40);
     memset(info_for_others.clientGUID, 0, 40);
+    MessagePtr info_msg = Message::Create(RoRnet::MSG2_USER_INFO, info_for_others.uniqueid, 0,
+                                          sizeof(RoRnet::UserInfo), (char *) &info_for_others);
     { // Lock scope
         std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
         for (unsigned int i = 0; i < m_clients.size(); i++) {
-            m_clients[i]->QueueMessage(RoRnet::MSG2_USER_INFO, info_for_others.uniqueid, 0, sizeof(RoRnet::UserInfo),
-                                       (char *) &info_for_others);
+            m_clients[i]->QueueMessage(info_msg);
+        }
+        if (m_bridge != nullptr) {
+            m_bridge->Forward(info_msg);
         }
     }
 }
@@ -435,56 +639,26 @@ int Sequencer::getNumClients() {
 }
 
 int Sequencer::AuthorizeNick(std::string token, std::string &nickname) {
-    std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
-    if (m_auth_resolver == nullptr) {
+    UserAuth *resolver = nullptr;
+    {
+        std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
+        resolver = m_auth_resolver;
+    }
+    if (resolver == nullptr) {
         return RoRnet::AUTH_NONE;
     }
-    return m_auth_resolver->resolve(token, nickname, m_free_user_id);
-}
 
-void Sequencer::KillerThreadMain()
-{
-    Logger::Log(LOG_DEBUG, "Killer thread ready");
-    while (true)
-    {
-        Client* client = nullptr;
-        KillerThreadState state = this->KillerThreadWaitForClient(/*out:*/ client);
-        if (state == KillerThreadState::STOP_REQUESTED)
-        {
-            Logger::Log(LOG_DEBUG, "Killer thread requested to stop");
-            break;
-        }
-        else if (client)
-        {
-            this->KillerThreadProcessClient(client);
-        }
-    }
-}
+    // The master server query may take a while - don't hold up the clients meanwhile.
+    int authlevel = resolver->resolveRemote(token, nickname);
 
-KillerThreadState Sequencer::KillerThreadWaitForClient(Client*& out_client)
-{
-    std::unique_lock<std::mutex> uni_lock(m_killer_mutex);
-    if (m_kill_queue.empty())
-    {
-        m_killer_cond.wait(uni_lock);
-    }
-    if (!m_kill_queue.empty())
-    {
-        out_client = m_kill_queue.front();
-        m_kill_queue.pop(); // pop front
-    }
-    return m_killer_state;
+    std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
+    return resolver->resolveLocal(token, nickname, authlevel);
 }
 
-void Sequencer::KillerThreadProcessClient(Client* client)
+void Sequencer::DisconnectStalledClient(int client_id)
 {
-    // Give the client time to disconnect itself
-    std::this_thread::sleep_for(std::chrono::seconds(5));
-
-    // Join the send/recv threads and close socket
-    client->Disconnect();
-
-    delete client;
+    m_teardown.PostDisconnect(client_id, "Outgoing queue limit exceeded (connection stalled)");
+    m_num_stalled_disconnects++;
 }
 
 void Sequencer::QueueClientForDisconnect(int uid, const char *errormsg, bool isError /*=true*/, bool doScriptCallback /*= true*/) {
@@ -517,26 +691,22 @@ void Sequencer::QueueClientForDisconnect(int uid, const char *errormsg, bool isE
     }
 
     //notify the others
-    int pos = 0;
+    MessagePtr leave_msg = Message::Create(RoRnet::MSG2_USER_LEAVE, uid, 0, (int) strlen(errormsg), errormsg);
     for (unsigned int i = 0; i < m_clients.size(); i++) {
-        m_clients[i]->QueueMessage(RoRnet::MSG2_USER_LEAVE, uid, 0, (int) strlen(errormsg), errormsg);
-        if (m_clients[i]->user.uniqueid == static_cast<unsigned int>(uid)) {
-            pos = i;
-        }
+        m_clients[i]->QueueMessage(leave_msg);
+    }
+    if (m_bridge != nullptr) {
+        m_bridge->Forward(leave_msg);
     }
-    m_clients.erase(m_clients.begin() + pos);
+    m_clients.Remove(client);
+    this->PublishRecipients();
 
     printStats();
 
     //this routine is a potential trouble maker as it can be called from many thread contexts
-    //so we use a killer thread
+    //so the client is released by the teardown scheduler
     Logger::Log(LOG_VERBOSE, "Disconnecting client ID %d: %s", uid, errormsg);
-    Logger::Log(LOG_DEBUG, "adding client to kill queue, size: %d", m_kill_queue.size());
-    {
-        std::lock_guard<std::mutex> lock(m_killer_mutex);
-        m_kill_queue.push(client);
-    }
-    m_killer_cond.notify_one();
+    m_teardown.Schedule(client);
 
     m_num_disconnects_total++;
     if (isError) {
@@ -554,7 +724,7 @@ void Sequencer::sendMOTDSynchronized(int uid)
 
 void Sequencer::sendMOTD(int uid) {
     std::vector<std::string> lines;
-    int res = Utils::ReadLinesFromFile(Config::getMOTDFile(), lines);
+    int res = Utils::ReadLinesFromFile(m_room.motd_file, lines);
     if (res)
     {
         Logger::Log(LOG_ERROR, "Could not read MOTD file, error code: %d", res);
@@ -600,6 +770,16 @@ void Sequencer::IntroduceNewClientToAllVehicles(Client *new_client) {
             }
         }
     }
+
+    // users of linked nodes to new user
+    for (auto const& remote : m_remote_users) {
+        new_client->QueueMessage(RoRnet::MSG2_USER_INFO, remote.first, 0, sizeof(RoRnet::UserInfo),
+                                 (char *) &remote.second.user);
+        for (auto const& stream : remote.second.streams) {
+            new_client->QueueMessage(RoRnet::MSG2_STREAM_REGISTER, remote.first, stream.first,
+                                     sizeof(RoRnet::StreamRegister), (char *) &stream.second);
+        }
+    }
 }
 
 int Sequencer::sendGameCommand(int uid, std::string cmd) {
@@ -607,8 +787,9 @@ int Sequencer::sendGameCommand(int uid, std::string cmd) {
     int size = cmd.size();
 
     if (uid == TO_ALL) {
+        MessagePtr msg = Message::Create(RoRnet::MSG2_GAME_CMD, -1, 0, size, data);
         for (int i = 0; i < (int) m_clients.size(); i++) {
-            m_clients[i]->QueueMessage(RoRnet::MSG2_GAME_CMD, -1, 0, size, data);
+            m_clients[i]->QueueMessage(msg);
         }
     } else {
         Client *client = this->FindClientById(static_cast<unsigned int>(uid));
@@ -645,6 +826,7 @@ void Sequencer::serverSay(std::string msg, int uid, int type) {
     }
 
     std::string msg_valid = Str::SanitizeUtf8(msg.begin(), msg.end());
+    MessagePtr chat_msg = Message::Create(RoRnet::MSG2_UTF8_CHAT, -1, -1, msg_valid.length(), msg_valid.c_str());
     auto itor = m_clients.begin();
     auto endi = m_clients.end();
     for (; itor != endi; ++itor) {
@@ -652,7 +834,7 @@ void Sequencer::serverSay(std::string msg, int uid, int type) {
         if ((client->GetStatus() == Client::STATUS_USED) &&
             client->IsReceivingData() &&
             (uid == TO_ALL || ((int) client->user.uniqueid) == uid)) {
-            client->QueueMessage(RoRnet::MSG2_UTF8_CHAT, -1, -1, msg_valid.length(), msg_valid.c_str());
+            client->QueueMessage(chat_msg);
         }
     }
 }
@@ -749,6 +931,7 @@ void Sequencer::RecordBan(std::string const& ip_addr,
 
     Logger::Log(LOG_DEBUG, "adding ban, size: %u", m_bans.size());
     m_bans.push_back(b);
+    ++m_banned_ips[b->ip];
     Logger::Log(LOG_VERBOSE, "new ban added: '%s' by '%s'", nickname.c_str(), by_nickname.c_str());
 }
 
@@ -788,6 +971,7 @@ void Sequencer::SilentBan(int buid, const char *msg, bool doScriptCallback /*= t
 bool Sequencer::UnBanIP(std::string ip_addr) {
     for (unsigned int i = 0; i < m_bans.size(); i++) {
         if (m_bans[i]->ip == ip_addr) {
+            this->ForgetBannedIp(m_bans[i]->ip);
             m_bans.erase(m_bans.begin() + i);
             m_blacklist.SaveBlacklistToFile();
             Logger::Log(LOG_VERBOSE, "ban removed: %d", ip_addr);
@@ -800,6 +984,7 @@ bool Sequencer::UnBanIP(std::string ip_addr) {
 bool Sequencer::UnBan(int bid) {
     for (unsigned int i = 0; i < m_bans.size(); i++) {
         if (m_bans[i]->bid == bid) {
+            this->ForgetBannedIp(m_bans[i]->ip);
             m_bans.erase(m_bans.begin() + i);
 			m_blacklist.SaveBlacklistToFile(); // Remove from the blacklist file
             Logger::Log(LOG_VERBOSE, "ban removed: %d", bid);
@@ -814,11 +999,14 @@ bool Sequencer::IsBanned(const char *ip) {
         return false;
     }
 
-    for (unsigned int i = 0; i < m_bans.size(); i++) {
-        if (!strcmp(m_bans[i]->ip, ip))
-            return true;
+    return m_banned_ips.find(ip) != m_banned_ips.end();
+}
+
+void Sequencer::ForgetBannedIp(std::string const& ip) {
+    auto found = m_banned_ips.find(ip);
+    if (found != m_banned_ips.end() && --found->second == 0) {
+        m_banned_ips.erase(found);
     }
-    return false;
 }
 
 void Sequencer::streamDebug() {
@@ -844,28 +1032,74 @@ void Sequencer::streamDebug() {
 
 //this is called by the receivers threads, like crazy & concurrently
 void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *data, unsigned int len) {
+    if (type == RoRnet::MSG2_BUNDLE) {
+        this->QueueBundle(uid, data, len);
+        return;
+    }
+
+    if (m_hub != nullptr) {
+        m_hub->PostInbound(uid, Message::Create(type, uid, streamid, len, data));
+        return;
+    }
+
+    // Stream data is the bulk of the traffic; relay it without the clients-mutex if possible
+    if ((type == RoRnet::MSG2_STREAM_DATA || type == RoRnet::MSG2_STREAM_DATA_DISCARDABLE) &&
+        this->RelayStreamData(uid, type, streamid, data, len)) {
+        return;
+    }
+
     std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
+    this->ProcessMessage(uid, type, streamid, data, len, nullptr);
+}
+
+void Sequencer::QueueBundle(int uid, const char *data, unsigned int len) {
+    char buffer[RORNET_MAX_MESSAGE_LENGTH + 1];
+    BundleReader reader(data, len);
+    RoRnet::BundleEntryHeader entry;
+    const char *payload = nullptr;
+    while (reader.Next(entry, payload)) {
+        if (entry.command < 1000u || entry.command > 1050u ||
+            entry.command == RoRnet::MSG2_BUNDLE || entry.command == RoRnet::MSG2_COMPRESSED) {
+            this->disconnectClient(uid, "Protocol error 3");
+            return;
+        }
+        // Processing may modify the payload (and expects it terminated)
+        std::memcpy(buffer, payload, entry.size);
+        buffer[entry.size] = '\0';
+        this->queueMessage(uid, entry.command, entry.streamid, buffer, entry.size);
+    }
+    if (reader.IsMalformed()) {
+        this->disconnectClient(uid, "Protocol error 4");
+    }
+}
+
+void Sequencer::ProcessHubEvents(std::vector<Hub::Event>& events) {
+    std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
+
+    for (Hub::Event& event : events) {
+        if (event.message == nullptr) {
+            this->QueueClientForDisconnect(event.uid, event.disconnect_reason.c_str(), event.is_error, event.do_script_callback);
+            continue;
+        }
+        // Processing may modify the payload (and expects it terminated)
+        const Message& msg = *event.message;
+        char *data = m_hub_payload.data();
+        std::memcpy(data, msg.GetPayload(), msg.GetPayloadLength());
+        data[msg.GetPayloadLength()] = '\0';
+        this->ProcessMessage(event.uid, msg.GetType(), msg.GetStreamId(), data, msg.GetPayloadLength(), event.message);
+    }
+}
 
+// clients_mutex needs to be locked wen calling this method
+// `inbound` is the received message if the caller already has one - stream data is relayed as-is
+void Sequencer::ProcessMessage(int uid, int type, unsigned int streamid, char *data, unsigned int len, MessagePtr const& inbound) {
     Client *client = this->FindClientById(static_cast<unsigned int>(uid));
     if (client == nullptr) {
         return;
     }
 
     // check for full broadcaster queue
-    {
-        bool is_dropping = client->IsBroadcasterDroppingPackets();
-        if (is_dropping && client->drop_state == 0) {
-            // queue full, inform client
-            int drop_state = 1;
-            client->drop_state = drop_state;
-            client->QueueMessage(RoRnet::MSG2_NETQUALITY, -1, 0, sizeof(int), (char *) &drop_state);
-        } else if (!is_dropping && client->drop_state == 1) {
-            // queue working better again, inform client
-            int drop_state = 0;
-            client->drop_state = drop_state;
-            client->QueueMessage(RoRnet::MSG2_NETQUALITY, -1, 0, sizeof(int), (char *) &drop_state);
-        }
-    }
+    client->UpdateDropState();
 
     int publishMode = BROADCAST_BLOCK;
 
@@ -882,7 +1116,7 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
         }
     } else if (type == RoRnet::MSG2_STREAM_REGISTER) {
         RoRnet::StreamRegister *reg = (RoRnet::StreamRegister *) data;
-        if (client->streams.size() >= Config::getMaxVehicles() + NON_VEHICLE_STREAMS) {
+        if (client->streams.size() >= m_room.max_vehicles + NON_VEHICLE_STREAMS) {
             // This user has too many vehicles, we drop the stream and then disconnect the user
             Logger::Log(LOG_INFO, "%s(%d) has too many streams. Stream dropped, user kicked.",
                         Str::SanitizeUtf8(client->user.username).c_str(), client->user.uniqueid);
@@ -894,7 +1128,7 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
             // broadcast a general message that this user was auto-kicked
             char sayMsg[128] = "";
             sprintf(sayMsg, "%s was auto-kicked for having too many vehicles (limit: %d)",
-                    Str::SanitizeUtf8(client->user.username).c_str(), Config::getMaxVehicles());
+                    Str::SanitizeUtf8(client->user.username).c_str(), m_room.max_vehicles);
             serverSay(sayMsg, TO_ALL, FROM_SERVER);
 
             QueueClientForDisconnect(client->user.uniqueid, "You have too many vehicles. Please rejoin.", false);
@@ -964,6 +1198,7 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
                 Logger::Log(LOG_VERBOSE, " * new stream registered: %d:%d, type: %d, name: '%s', status: %d",
                             client->user.uniqueid, streamid, reg->type, reg->name, reg->status);
                 client->streams[streamid] = *reg;
+                this->PublishRecipients();
 
                 // send an event if user is rankend and if we are a official server
                 if (m_auth_resolver && (client->user.authstatus & RoRnet::AUTH_RANKED))
@@ -971,7 +1206,7 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
                                                    std::string(reg->name), std::string());
 
                 // Notify the user about the vehicle limit
-                if ((client->streams.size() >= Config::getMaxVehicles() + NON_VEHICLE_STREAMS - 3) &&
+                if ((client->streams.size() >= m_room.max_vehicles + NON_VEHICLE_STREAMS - 3) &&
                     (client->streams.size() > NON_VEHICLE_STREAMS)) {
                     // we start warning the user as soon as he has only 3 vehicles left before he will get kicked (that's why we do minus three in the 'if' statement above).
                     char sayMsg[128] = "";
@@ -979,10 +1214,10 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
                     // special case if the user has exactly 1 vehicle
                     if (client->streams.size() == NON_VEHICLE_STREAMS + 1)
                         sprintf(sayMsg, "You now have 1 vehicle. The vehicle limit on this server is set to %d.",
-                                Config::getMaxVehicles());
+                                m_room.max_vehicles);
                     else
                         sprintf(sayMsg, "You now have %lu vehicles. The vehicle limit on this server is set to %d.",
-                                (client->streams.size() - NON_VEHICLE_STREAMS), Config::getMaxVehicles());
+                                (client->streams.size() - NON_VEHICLE_STREAMS), m_room.max_vehicles);
 
                     serverSay(sayMsg, client->user.uniqueid, FROM_SERVER);
                 }
@@ -991,12 +1226,16 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
 
                 // reset some stats
                 // streams_traffic limited through streams map
+                std::lock_guard<std::mutex> traffic_lock(client->streams_traffic_mutex);
                 client->streams_traffic[streamid].bandwidthIncoming = 0;
                 client->streams_traffic[streamid].bandwidthIncomingLastMinute = 0;
                 client->streams_traffic[streamid].bandwidthIncomingRate = 0;
                 client->streams_traffic[streamid].bandwidthOutgoing = 0;
                 client->streams_traffic[streamid].bandwidthOutgoingLastMinute = 0;
                 client->streams_traffic[streamid].bandwidthOutgoingRate = 0;
+                client->streams_traffic[streamid].coalescedUpdates = 0;
+                client->streams_traffic[streamid].coalescedUpdatesLastMinute = 0;
+                client->streams_traffic[streamid].coalescedUpdatesRate = 0;
             }
         }
     } else if (type == RoRnet::MSG2_STREAM_REGISTER_RESULT) {
@@ -1012,6 +1251,10 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
     } else if (type == RoRnet::MSG2_STREAM_UNREGISTER) {
         // Remove the stream
         if (client->streams.erase(streamid) > 0) {
+            this->PublishRecipients();
+            if (m_tick_relay != nullptr) {
+                m_tick_relay->Withdraw(client->user.uniqueid, streamid);
+            }
             Logger::Log(LOG_VERBOSE, " * stream deregistered: %d:%d", client->user.uniqueid, streamid);
             publishMode = BROADCAST_ALL;
         }
@@ -1243,7 +1486,7 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
             }
         } else if (str == "!vehiclelimit") {
             char sayMsg[128] = "";
-            sprintf(sayMsg, "The vehicle-limit on this server is set on %d", Config::getMaxVehicles());
+            sprintf(sayMsg, "The vehicle-limit on this server is set on %d", m_room.max_vehicles);
             serverSay(sayMsg, uid, FROM_SERVER);
         } else if (str.substr(0, 5) == "!say ") {
             if (client->user.authstatus & RoRnet::AUTH_MOD || client->user.authstatus & RoRnet::AUTH_ADMIN) {
@@ -1289,9 +1532,9 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
                 serverSay(sayMsg, uid, FROM_SERVER);
             }
         } else if (str == "!rules") {
-            if (!Config::getRulesFile().empty()) {
+            if (!m_room.rules_file.empty()) {
                 std::vector<std::string> lines;
-                int res = Utils::ReadLinesFromFile(Config::getRulesFile(), lines);
+                int res = Utils::ReadLinesFromFile(m_room.rules_file, lines);
                 if (!res) {
                     std::vector<std::string>::iterator it;
                     for (it = lines.begin(); it != lines.end(); it++) {
@@ -1357,7 +1600,29 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
     }
 #endif //0
     if (publishMode < BROADCAST_BLOCK) {
-        client->streams_traffic[streamid].bandwidthIncoming += len;
+        client->AddStreamTraffic(streamid, len, 0);
+
+        // One buffer shared by all recipients, released when the last broadcaster sends it
+        const bool is_stream_data = (type == RoRnet::MSG2_STREAM_DATA || type == RoRnet::MSG2_STREAM_DATA_DISCARDABLE);
+        MessagePtr msg = (inbound != nullptr && is_stream_data)
+            ? inbound : Message::Create(type, client->user.uniqueid, streamid, len, data);
+
+        if (m_bridge != nullptr && publishMode != BROADCAST_AUTHED && Bridge::IsForwarded(type)) {
+            m_bridge->Forward(msg);
+        }
+
+        // Distant clients get fewer updates of vehicles and characters
+        AreaOfInterest::Position aoi_pos;
+        unsigned int aoi_index = 0;
+        bool use_aoi = false;
+        if (is_stream_data) {
+            auto stream = client->streams.find(streamid);
+            use_aoi = (stream != client->streams.end()) &&
+                client->GetAreaOfInterest().TrackStreamData(type, stream->second.type, streamid, data, len, aoi_pos, aoi_index);
+            if (this->HoldForTick(client->user.uniqueid, type, msg, use_aoi, aoi_pos, aoi_index)) {
+                return;
+            }
+        }
 
         if (publishMode == BROADCAST_NORMAL || publishMode == BROADCAST_ALL) {
             bool toAll = (publishMode == BROADCAST_ALL);
@@ -1366,8 +1631,12 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
                 Client *curr_client = m_clients[i];
                 if (curr_client->GetStatus() == Client::STATUS_USED && curr_client->IsReceivingData() &&
                     (curr_client != client || toAll)) {
-                    curr_client->streams_traffic[streamid].bandwidthOutgoing += len;
-                    curr_client->QueueMessage(type, client->user.uniqueid, streamid, len, data);
+                    if (use_aoi && !AreaOfInterest::ShouldForward(curr_client->GetAreaOfInterest(), aoi_pos, aoi_index)) {
+                        ++m_aoi_filtered;
+                        continue;
+                    }
+                    curr_client->AddStreamTraffic(streamid, 0, len);
+                    curr_client->QueueMessage(msg);
                 }
             }
         } else if (publishMode == BROADCAST_AUTHED) {
@@ -1376,14 +1645,234 @@ void Sequencer::queueMessage(int uid, int type, unsigned int streamid, char *dat
                 Client *curr_client = m_clients[i];
                 if (curr_client->GetStatus() == Client::STATUS_USED && curr_client->IsReceivingData() &&
                     (curr_client != client) && (client->user.authstatus & RoRnet::AUTH_ADMIN)) {
-                    curr_client->streams_traffic[streamid].bandwidthOutgoing += len;
-                    curr_client->QueueMessage(type, client->user.uniqueid, streamid, len, data);
+                    curr_client->AddStreamTraffic(streamid, 0, len);
+                    curr_client->QueueMessage(msg);
                 }
             }
         }
     }
 }
 
+// Lock-free counterpart of the BROADCAST_NORMAL path of queueMessage() for stream data.
+// Returns false if the sender isn't fully set up yet; the caller then takes the locked path.
+bool Sequencer::RelayStreamData(int uid, int type, unsigned int streamid, const char *data, unsigned int len) {
+    RecipientSnapshotPtr snapshot = std::atomic_load(&m_recipients);
+    const RecipientSnapshot::Entry *sender = snapshot->Find(static_cast<unsigned int>(uid));
+    if (sender == nullptr || !sender->is_initialized) {
+        return false;
+    }
+    Client *client = sender->client;
+
+    // check for full broadcaster queue
+    client->UpdateDropState();
+
+    // Simple data validation (needed due to bug in RoR 0.38)
+    int stream_type = 0;
+    if (!sender->FindStream(streamid, stream_type)) {
+        return true; // Blocked
+    }
+
+    client->AddStreamTraffic(streamid, len, 0);
+
+    AreaOfInterest::Position aoi_pos;
+    unsigned int aoi_index = 0;
+    const bool use_aoi = client->GetAreaOfInterest().TrackStreamData(type, stream_type, streamid, data, len, aoi_pos, aoi_index);
+
+    // One buffer shared by all recipients, released when the last broadcaster sends it
+    MessagePtr msg = Message::Create(type, sender->uid, streamid, len, data);
+    if (m_bridge != nullptr) {
+        m_bridge->Forward(msg);
+    }
+    if (!this->HoldForTick(sender->uid, type, msg, use_aoi, aoi_pos, aoi_index)) {
+        this->FanOutStreamData(*snapshot, client, msg, use_aoi, aoi_pos, aoi_index);
+    }
+    return true;
+}
+
+void Sequencer::FanOutStreamData(RecipientSnapshot const& snapshot, Client *sender, MessagePtr const& msg,
+                                 bool use_aoi, AreaOfInterest::Position const& aoi_pos, unsigned int aoi_index) {
+    const unsigned int streamid = msg->GetStreamId();
+    const unsigned int len = msg->GetPayloadLength();
+    for (const RecipientSnapshot::Entry& recipient : snapshot.entries) {
+        if (recipient.is_receiving && recipient.client != sender) {
+            if (use_aoi && !AreaOfInterest::ShouldForward(recipient.client->GetAreaOfInterest(), aoi_pos, aoi_index)) {
+                ++m_aoi_filtered;
+                continue;
+            }
+            recipient.client->AddStreamTraffic(streamid, 0, len);
+            recipient.client->QueueMessage(msg);
+        }
+    }
+}
+
+// Tick mode: discardable updates wait for the next tick; reliable ones go out right away and supersede them.
+bool Sequencer::HoldForTick(int uid, int type, MessagePtr const& msg,
+                            bool use_aoi, AreaOfInterest::Position const& aoi_pos, unsigned int aoi_index) {
+    if (m_tick_relay == nullptr) {
+        return false;
+    }
+    if (type != RoRnet::MSG2_STREAM_DATA_DISCARDABLE) {
+        m_tick_relay->Withdraw(uid, msg->GetStreamId());
+        return false;
+    }
+    TickRelay::State state;
+    state.uid = uid;
+    state.streamid = msg->GetStreamId();
+    state.message = msg;
+    state.use_aoi = use_aoi;
+    state.aoi_pos = aoi_pos;
+    state.aoi_index = aoi_index;
+    m_tick_relay->Hold(state);
+    return true;
+}
+
+void Sequencer::SetUdpRoute(int uid, bool enabled) {
+    std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
+    Client *client = this->FindClientById(static_cast<unsigned int>(uid));
+    if (client != nullptr && client->GetStatus() == Client::STATUS_USED) {
+        client->SetUdpRoute(enabled);
+    }
+}
+
+// The peer learns about our users before the link gets their live traffic - both under the clients-mutex
+void Sequencer::ConnectBridgeLink(int link_id) {
+    std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
+    std::vector<MessagePtr> intro;
+    for (Client *client : m_clients) {
+        RoRnet::UserInfo info_for_others = client->user;
+        memset(info_for_others.usertoken, 0, 40);
+        memset(info_for_others.clientGUID, 0, 40);
+        intro.push_back(Message::Create(RoRnet::MSG2_USER_JOIN, client->user.uniqueid, 0, sizeof(RoRnet::UserInfo),
+                                        (char *) &info_for_others));
+        for (auto const& stream : client->streams) {
+            intro.push_back(Message::Create(RoRnet::MSG2_STREAM_REGISTER, client->user.uniqueid, stream.first,
+                                            sizeof(RoRnet::StreamRegister), (char *) &stream.second));
+        }
+    }
+    m_bridge->ActivateLink(link_id, intro);
+}
+
+void Sequencer::ProcessBridgeMessage(int link_id, MessagePtr const& msg) {
+    const int type = msg->GetType();
+    const unsigned int uid = static_cast<unsigned int>(msg->GetSource());
+
+    if (type == RoRnet::MSG2_STREAM_DATA || type == RoRnet::MSG2_STREAM_DATA_DISCARDABLE) {
+        // Lock-free like RelayStreamData(); the peer already applied its area of interest and tick
+        RecipientSnapshotPtr snapshot = std::atomic_load(&m_recipients);
+        AreaOfInterest::Position aoi_pos;
+        this->FanOutStreamData(*snapshot, nullptr, msg, false, aoi_pos, 0);
+        return;
+    }
+
+    std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
+    if (type == RoRnet::MSG2_USER_JOIN) {
+        RemoteUser& remote = m_remote_users[uid];
+        remote.link_id = link_id;
+        memcpy(&remote.user, msg->GetPayload(), sizeof(RoRnet::UserInfo));
+        Logger::Log(LOG_INFO, "Bridge: remote user %s joined as user ID %u",
+                    Str::SanitizeUtf8(remote.user.username).c_str(), uid);
+
+        MessagePtr info_msg = Message::Create(RoRnet::MSG2_USER_INFO, uid, 0, sizeof(RoRnet::UserInfo),
+                                              (char *) &remote.user);
+        for (Client *client : m_clients) {
+            client->QueueMessage(msg);
+            if (client->GetStatus() == Client::STATUS_USED) {
+                client->QueueMessage(info_msg);
+            }
+        }
+        return;
+    }
+
+    auto remote = m_remote_users.find(uid);
+    if (remote == m_remote_users.end()) {
+        return;
+    }
+    bool to_all = false; // Otherwise only to the clients receiving data
+    if (type == RoRnet::MSG2_USER_INFO) {
+        memcpy(&remote->second.user, msg->GetPayload(), sizeof(RoRnet::UserInfo));
+    } else if (type == RoRnet::MSG2_USER_LEAVE) {
+        Logger::Log(LOG_INFO, "Bridge: remote user %s left", Str::SanitizeUtf8(remote->second.user.username).c_str());
+        m_remote_users.erase(remote);
+        to_all = true;
+    } else if (type == RoRnet::MSG2_STREAM_REGISTER) {
+        memcpy(&remote->second.streams[msg->GetStreamId()], msg->GetPayload(), sizeof(RoRnet::StreamRegister));
+    } else if (type == RoRnet::MSG2_STREAM_UNREGISTER) {
+        remote->second.streams.erase(msg->GetStreamId());
+    } else if (type == RoRnet::MSG2_UTF8_CHAT) {
+        std::string str(msg->GetPayload(), msg->GetPayloadLength());
+        Logger::Log(LOG_INFO, "CHAT| %s (remote): %s", Str::SanitizeUtf8(remote->second.user.username).c_str(),
+                    Str::SanitizeUtf8(str.c_str()).c_str());
+    }
+
+    for (Client *client : m_clients) {
+        if (to_all || (client->GetStatus() == Client::STATUS_USED && client->IsReceivingData())) {
+            client->QueueMessage(msg);
+        }
+    }
+}
+
+void Sequencer::DropBridgeUsers(int link_id) {
+    std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
+    const char *reason = "Link to the user's server node closed";
+    for (auto itor = m_remote_users.begin(); itor != m_remote_users.end();) {
+        if (itor->second.link_id != link_id) {
+            ++itor;
+            continue;
+        }
+        MessagePtr leave_msg = Message::Create(RoRnet::MSG2_USER_LEAVE, itor->first, 0, (int) strlen(reason), reason);
+        for (Client *client : m_clients) {
+            client->QueueMessage(leave_msg);
+        }
+        itor = m_remote_users.erase(itor);
+    }
+}
+
+void Sequencer::RelayHeldStreamData(std::vector<TickRelay::State>& states) {
+    RecipientSnapshotPtr snapshot = std::atomic_load(&m_recipients);
+    for (TickRelay::State const& state : states) {
+        if (state.message == nullptr) {
+            continue;
+        }
+        // The sender may have left, or dropped the stream, since
+        const RecipientSnapshot::Entry *sender = snapshot->Find(static_cast<unsigned int>(state.uid));
+        int stream_type = 0;
+        if (sender == nullptr || !sender->FindStream(state.streamid, stream_type)) {
+            continue;
+        }
+        this->FanOutStreamData(*snapshot, sender->client, state.message, state.use_aoi, state.aoi_pos, state.aoi_index);
+    }
+}
+
+// clients_mutex needs to be locked wen calling this method
+void Sequencer::PublishRecipients() {
+    auto snapshot = std::make_shared<RecipientSnapshot>();
+    snapshot->entries.reserve(m_clients.size());
+    for (Client *client : m_clients) {
+        RecipientSnapshot::Entry entry;
+        entry.client = client;
+        entry.uid = client->user.uniqueid;
+        entry.authstatus = client->user.authstatus;
+        entry.is_receiving = (client->GetStatus() == Client::STATUS_USED) && client->IsReceivingData();
+        entry.is_initialized = client->IsInitialized();
+        entry.streams.reserve(client->streams.size());
+        for (auto& stream : client->streams) {
+            entry.streams.push_back(std::make_pair(stream.first, stream.second.type)); // std::map - already sorted
+        }
+        client->AddSnapshotRef();
+        snapshot->entries.push_back(std::move(entry));
+    }
+    std::sort(snapshot->entries.begin(), snapshot->entries.end(),
+        [](RecipientSnapshot::Entry const& a, RecipientSnapshot::Entry const& b) { return a.uid < b.uid; });
+
+    std::atomic_store(&m_recipients, RecipientSnapshotPtr(std::move(snapshot)));
+}
+
+void Sequencer::StartReceiving(Client *client) {
+    std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
+    client->SetReceiveData(true);
+    this->PublishRecipients();
+}
+
 int Sequencer::getStartTime() {
     return m_start_time;
 }
@@ -1395,8 +1884,58 @@ Client *Sequencer::getClient(int uid) {
 void Sequencer::UpdateMinuteStats() {
     std::lock_guard<std::mutex> scoped_lock(m_clients_mutex);
 
+    if (m_hub != nullptr) {
+        m_hub_utilization = m_hub->TakeUtilization();
+    }
+    m_aoi_filtered_last_minute = m_aoi_filtered.exchange(0);
+    if (m_tick_relay != nullptr) {
+        m_tick_superseded_last_minute = m_tick_relay->TakeSupersededCount();
+    }
+    if (m_udp_channel != nullptr) {
+        m_udp_stats_last_minute = m_udp_channel->TakeStats();
+    }
+    if (m_bridge != nullptr) {
+        m_bridge_stats_last_minute = m_bridge->TakeStats();
+    }
+    m_teardown_stats_last_minute = m_teardown.TakeStats();
+
+    m_decimated_last_minute = 0;
+    for (Broadcaster::QueueDepth& total : m_queue_depths_last_minute) {
+        total = Broadcaster::QueueDepth();
+    }
+    for (Client *client : m_clients) {
+        m_decimated_last_minute += client->TakeDecimatedCount();
+
+        Broadcaster::QueueDepth depths[Broadcaster::NUM_PRIORITIES];
+        client->TakeQueueDepths(depths);
+        for (int i = 0; i < Broadcaster::NUM_PRIORITIES; ++i) {
+            Broadcaster::QueueDepth& total = m_queue_depths_last_minute[i];
+            total.messages += depths[i].messages;
+            total.bytes += depths[i].bytes;
+            total.peak_messages = std::max(total.peak_messages, depths[i].peak_messages);
+        }
+    }
+
+    // Credit the coalesced updates in each recipient's queue to the source stream
+    std::unordered_map<uint64_t, unsigned int> coalesce_counts;
+    for (Client *recipient : m_clients) {
+        recipient->TakeCoalesceStats(coalesce_counts);
+        for (auto& entry : coalesce_counts) {
+            Client *source = this->FindClientById(static_cast<unsigned int>(entry.first >> 32));
+            if (source == nullptr) {
+                continue;
+            }
+            std::lock_guard<std::mutex> traffic_lock(source->streams_traffic_mutex);
+            auto stream = source->streams_traffic.find(static_cast<unsigned int>(entry.first & 0xFFFFFFFF));
+            if (stream != source->streams_traffic.end()) {
+                stream->second.coalescedUpdates += entry.second;
+            }
+        }
+    }
+
     for (unsigned int i = 0; i < m_clients.size(); i++) {
         if (m_clients[i]->GetStatus() == Client::STATUS_USED) {
+            std::lock_guard<std::mutex> traffic_lock(m_clients[i]->streams_traffic_mutex);
             for (std::map<unsigned int, stream_traffic_t>::iterator it = m_clients[i]->streams_traffic.begin();
                  it != m_clients[i]->streams_traffic.end(); it++) {
                 it->second.bandwidthIncomingRate =
@@ -1405,6 +1944,9 @@ void Sequencer::UpdateMinuteStats() {
                 it->second.bandwidthOutgoingRate =
                         (it->second.bandwidthOutgoing - it->second.bandwidthOutgoingLastMinute) / 60;
                 it->second.bandwidthOutgoingLastMinute = it->second.bandwidthOutgoing;
+                it->second.coalescedUpdatesRate =
+                        it->second.coalescedUpdates - it->second.coalescedUpdatesLastMinute;
+                it->second.coalescedUpdatesLastMinute = it->second.coalescedUpdates;
             }
         }
     }
@@ -1417,9 +1959,13 @@ void Sequencer::printStats() {
     }
 
     {
-        Logger::Log(LOG_INFO, "Server occupancy:");
+        if (Config::getRooms().size() > 1) {
+            Logger::Log(LOG_INFO, "Server occupancy, room '%s' (port %u):", m_room.name.c_str(), m_room.port);
+        } else {
+            Logger::Log(LOG_INFO, "Server occupancy:");
+        }
 
-        Logger::Log(LOG_INFO, "Slot Status   UID IP                  Colour, Nickname");
+        Logger::Log(LOG_INFO, "Slot Status   UID IP                  Queued   Colour, Nickname");
         Logger::Log(LOG_INFO, "--------------------------------------------------");
         for (unsigned int i = 0; i < m_clients.size(); i++) {
             // some auth identifiers
@@ -1434,15 +1980,16 @@ void Sequencer::printStats() {
             if (m_clients[i]->GetStatus() == Client::STATUS_FREE)
                 Logger::Log(LOG_INFO, "%4i Free", i);
             else if (m_clients[i]->GetStatus() == Client::STATUS_BUSY)
-                Logger::Log(LOG_INFO, "%4i Busy %5i %-16s % 4s %d, %s", i,
-                            m_clients[i]->user.uniqueid, "-",
+                Logger::Log(LOG_INFO, "%4i Busy %5i %-16s %8s % 4s %d, %s", i,
+                            m_clients[i]->user.uniqueid, "-", "-",
                             authst,
                             m_clients[i]->user.colournum,
                             Str::SanitizeUtf8(m_clients[i]->user.username).c_str());
             else
-                Logger::Log(LOG_INFO, "%4i Used %5i %-16s % 4s %d, %s", i,
+                Logger::Log(LOG_INFO, "%4i Used %5i %-16s %6.1fkB % 4s %d, %s", i,
                             m_clients[i]->user.uniqueid,
                             m_clients[i]->GetIpAddress().c_str(),
+                            m_clients[i]->GetQueuedBytes() / 1024.f,
                             authst,
                             m_clients[i]->user.colournum,
                             Str::SanitizeUtf8(m_clients[i]->user.username).c_str());
@@ -1462,6 +2009,67 @@ void Sequencer::printStats() {
                             "outgoing: %0.1fkB/s",
                     traffic.bandwidthIncomingRate / 1024,
                     traffic.bandwidthOutgoingRate / 1024);
+
+        size_t queued_bytes = 0;
+        size_t max_queued_bytes = 0;
+        size_t num_clients = 0;
+        size_t num_decimated_clients = 0;
+        double coalesced_rate = 0;
+        for (Client *client : m_clients) {
+            if (client->GetStatus() == Client::STATUS_USED) {
+                const size_t client_queued_bytes = client->GetQueuedBytes();
+                queued_bytes += client_queued_bytes;
+                max_queued_bytes = std::max(max_queued_bytes, client_queued_bytes);
+                ++num_clients;
+                if (client->GetStreamDecimation() > 1) {
+                    ++num_decimated_clients;
+                }
+                std::lock_guard<std::mutex> traffic_lock(client->streams_traffic_mutex);
+                for (auto& stream : client->streams_traffic) {
+                    coalesced_rate += stream.second.coalescedUpdatesRate;
+                }
+            }
+        }
+        MessagePool::Stats mem = MessagePool::GetStats();
+        Logger::Log(LOG_INFO, "- message memory: %0.1fkB in %u buffers, %0.1fkB pooled",
+                    mem.live_bytes / 1024.f, (unsigned int) mem.live_buffers, mem.pooled_bytes / 1024.f);
+        Logger::Log(LOG_INFO, "- outgoing queues: %0.1fkB total, %0.1fkB per client, %0.1fkB largest (limit %ukB)",
+                    queued_bytes / 1024.f, (num_clients > 0) ? (queued_bytes / num_clients / 1024.f) : 0.f,
+                    max_queued_bytes / 1024.f, Config::getQueueHardLimitKb());
+        Logger::Log(LOG_INFO, "- clients disconnected for exceeding the outgoing queue limit: %zu",
+                    m_num_stalled_disconnects.load());
+        const TeardownScheduler::Stats& teardown = m_teardown_stats_last_minute;
+        Logger::Log(LOG_INFO, "- disconnected clients released (last minute): %zu, after %0.0f ms on average, %u ms at most",
+                    teardown.clients, (teardown.clients > 0) ? (double) teardown.total_ms / teardown.clients : 0.0,
+                    teardown.longest_ms);
+        const Broadcaster::QueueDepth *depths = m_queue_depths_last_minute;
+        Logger::Log(LOG_INFO, "- queued messages by class (total, longest queue last minute): "
+                    "control %zu, %zu; stream events %zu, %zu; stream state %zu, %zu",
+                    depths[Broadcaster::PRIORITY_CONTROL].messages, depths[Broadcaster::PRIORITY_CONTROL].peak_messages,
+                    depths[Broadcaster::PRIORITY_STREAM_EVENTS].messages, depths[Broadcaster::PRIORITY_STREAM_EVENTS].peak_messages,
+                    depths[Broadcaster::PRIORITY_STREAM_STATE].messages, depths[Broadcaster::PRIORITY_STREAM_STATE].peak_messages);
+        Logger::Log(LOG_INFO, "- coalesced stream updates (last minute): %0.0f", coalesced_rate);
+        Logger::Log(LOG_INFO, "- rate-limited stream updates (last minute): %zu, %zu clients currently limited",
+                    m_decimated_last_minute, num_decimated_clients);
+        if (AreaOfInterest::IsActive()) {
+            Logger::Log(LOG_INFO, "- stream updates not forwarded to distant clients (last minute): %zu", m_aoi_filtered_last_minute);
+        }
+        if (m_hub != nullptr) {
+            Logger::Log(LOG_INFO, "- hub thread utilization (last minute): %0.1f%%", m_hub_utilization * 100.f);
+        }
+        if (m_tick_relay != nullptr) {
+            Logger::Log(LOG_INFO, "- stream updates superseded within a tick (last minute): %zu", m_tick_superseded_last_minute);
+        }
+        if (m_udp_channel != nullptr) {
+            const UdpChannel::Stats& udp = m_udp_stats_last_minute;
+            Logger::Log(LOG_INFO, "- UDP datagrams (last minute): %zu in, %zu out, %zu stale, %zu rejected, %zu dropped",
+                        udp.datagrams_in, udp.datagrams_out, udp.stale, udp.rejected, udp.outbox_full);
+        }
+        if (m_bridge != nullptr) {
+            const Bridge::Stats& bridge = m_bridge_stats_last_minute;
+            Logger::Log(LOG_INFO, "- bridge: %zu links, %zu remote users; messages (last minute): %zu out, %zu in, %zu dropped",
+                        bridge.links, m_remote_users.size(), bridge.messages_out, bridge.messages_in, bridge.dropped);
+        }
     }
 }
 
@@ -1477,15 +2085,19 @@ void Sequencer::frameStepScripts(float dt)
 // clients_mutex needs to be locked wen calling this method
 // Invoked either from Sequencer or ServerScript
 Client *Sequencer::FindClientById(unsigned int client_id) {
-    auto itor = m_clients.begin();
-    auto endi = m_clients.end();
-    for (; itor != endi; ++itor) {
-        Client *client = *itor;
-        if (client->user.uniqueid == client_id) {
-            return client;
-        }
-    }
-    return nullptr;
+    return m_clients.FindById(client_id);
+}
+
+// clients_mutex needs to be locked wen calling this method
+void Sequencer::SetClientNick(Client *client, std::string const& nick) {
+    strncpy(client->user.username, nick.c_str(), RORNET_MAX_USERNAME_LEN);
+    m_clients.UpdateNick(client, Str::SanitizeUtf8(client->user.username));
+}
+
+// clients_mutex needs to be locked wen calling this method
+void Sequencer::SetClientColour(Client *client, int colour) {
+    client->user.colournum = colour;
+    m_clients.UpdateColour(client, colour);
 }
 
 std::vector<WebserverClientInfo> Sequencer::GetClientListCopy() {
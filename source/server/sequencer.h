@@ -21,11 +21,19 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 #pragma once
 
 #include "blacklist.h"
+#include "aoi.h"
+#include "bridge.h"
 #include "prerequisites.h"
 #include "rornet.h"
 #include "broadcaster.h"
+#include "clientregistry.h"
+#include "config.h"
+#include "hub.h"
 #include "receiver.h"
 #include "spamfilter.h"
+#include "teardown.h"
+#include "tickrelay.h"
+#include "udpchannel.h"
 #include "json/json.h"
 
 #ifdef WITH_ANGELSCRIPT
@@ -36,13 +44,17 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 
 #include "UnicodeStrings.h"
 
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <memory>
 #include <queue>
 #include <vector>
 #include <mutex>
 #include <map>
 #include <thread>
 #include <condition_variable>
+#include <unordered_map>
 
 // How many not-vehicles streams has every user by default? (e.g.: "default" and "chat" are not-vehicles streams)
 // This is used for the vehicle-limit
@@ -50,6 +62,7 @@ along with Foobar. If not, see <http://www.gnu.org/licenses/>.
 
 // Specified by RoR; used for spawn-rate limit
 #define STREAM_REG_TYPE_VEHICLE 0
+#define STREAM_REG_TYPE_CHARACTER 1
 
 #define SEQUENCER Sequencer::Instance()
 
@@ -91,6 +104,11 @@ struct stream_traffic_t {
     double bandwidthDropOutgoingLastMinute;
     double bandwidthDropIncomingRate;
     double bandwidthDropOutgoingRate;
+
+    // discardable updates replaced by newer ones in recipients' queues
+    double coalescedUpdates;
+    double coalescedUpdatesLastMinute;
+    double coalescedUpdatesRate; //!< Per minute
 };
 
 class Client {
@@ -104,26 +122,54 @@ public:
 
     Client(Sequencer *sequencer, SWInetSocket *socket);
 
-    void StartThreads();
+    void StartThreads(); //!< With the epoll backend, hands the client over to the Poller instead.
 
     void Disconnect();
 
+    void ShutdownSocket(bool read_only); //!< Unblocks the client's threads; any thread
+
     void QueueMessage(int msg_type, int client_id, unsigned int stream_id, unsigned int payload_len, const char *payload);
 
+    void QueueMessage(MessagePtr const& msg); //!< Use when sending the same message to multiple clients
+
     void NotifyAllVehicles(Sequencer *sequencer);
 
+    void UpdateDropState(); //!< Tells the client whether its outgoing queue is dropping packets; thread safe
+
     bool CheckSpawnRate(); //!< True if OK to spawn, false if exceeded maximum
 
     std::string GetIpAddress();
 
+    bool HasSessionOption(std::string const& option) const; //!< Word in `user.sessionoptions`
+
     SWInetSocket *GetSocket() { return m_socket; }
 
+    Sequencer *GetSequencer() const { return m_sequencer; }
+
     bool IsBroadcasterDroppingPackets() const { return m_broadcaster.IsDroppingPackets(); }
 
+    size_t GetQueuedBytes() { return m_broadcaster.GetQueuedBytes() + m_unsent_bytes; }
+
+    void SetUnsentBytes(size_t bytes) { m_unsent_bytes = bytes; } //!< Taken from the queue, not yet accepted by the socket; by whoever sends
+
+    unsigned int GetStreamDecimation() const { return m_broadcaster.GetDecimation(); } //!< Only every n-th stream update is sent
+
+    size_t TakeDecimatedCount() { return m_broadcaster.TakeDecimatedCount(); }
+
+    void TakeQueueDepths(Broadcaster::QueueDepth (&out_depths)[Broadcaster::NUM_PRIORITIES]) { m_broadcaster.TakeQueueDepths(out_depths); }
+
+    void TakeCoalesceStats(std::unordered_map<uint64_t, unsigned int>& out_counts) { m_broadcaster.TakeCoalesceStats(out_counts); }
+
+    bool PopOutboundMessage(MessagePtr& out_message) { return m_broadcaster.PopMessage(out_message); } //!< For the Poller
+
     void SetReceiveData(bool val) { m_is_receiving_data = val; }
 
     bool IsReceivingData() const { return m_is_receiving_data; }
 
+    bool IsInitialized() const { return m_is_initialized; } //!< Introduced to the other clients
+
+    void SetUdpRoute(bool val) { m_udp_route = val; } //!< Send discardable stream data over the UDP channel
+
     Status GetStatus() const { return m_status; }
 
     int GetUserId() const { return static_cast<int>(user.uniqueid); }
@@ -132,23 +178,43 @@ public:
 
     SpamFilter& GetSpamFilter() { return m_spamfilter; }
 
+    AreaOfInterest& GetAreaOfInterest() { return m_aoi; }
+
     RoRnet::UserInfo user;  //!< user information
 
-    int drop_state;             // dropping outgoing packets?
+    std::atomic<int> drop_state; // dropping outgoing packets?
 
     std::map<unsigned int, RoRnet::StreamRegister> streams;
 
     std::map<unsigned int, stream_traffic_t> streams_traffic;
 
+    std::mutex streams_traffic_mutex; //!< Protects `streams_traffic`, which is updated without the clients-mutex; leaf lock
+
+    void AddStreamTraffic(unsigned int stream_id, double incoming, double outgoing);
+
+    std::map<unsigned int, stream_traffic_t> GetStreamsTraffic();
+
+    // Lifetime guard for RecipientSnapshot
+    void AddSnapshotRef() { ++m_snapshot_refs; }
+    void ReleaseSnapshotRef(); //!< The last one runs the WhenOutOfSnapshots() callback
+    void WhenOutOfSnapshots(std::function<void()> callback); //!< Runs it right away, or when the last snapshot is released; client must be out of the client list
+
 private:
     SWInetSocket *m_socket;
     Receiver m_receiver;
     Broadcaster m_broadcaster;
     Status m_status;
     SpamFilter m_spamfilter;
+    AreaOfInterest m_aoi;
     Sequencer* m_sequencer;
     bool m_is_receiving_data;
     bool m_is_initialized;
+    std::atomic<int> m_snapshot_refs;
+    std::mutex m_snapshot_mutex; //!< Protects `m_out_of_snapshots` and releasing snapshot refs; leaf lock
+    std::function<void()> m_out_of_snapshots;
+    std::atomic<bool> m_udp_route;
+    std::atomic<bool> m_socket_shut_down;
+    std::atomic<size_t> m_unsent_bytes;
     std::vector<std::chrono::system_clock::time_point> m_stream_reg_timestamps; //!< To limit spawn rate
 };
 
@@ -159,7 +225,7 @@ struct WebserverClientInfo // Needed because Client cannot be trivially copied a
         status(c->GetStatus()),
         ip_address(c->GetIpAddress()),
         streams(c->streams),
-        streams_traffic(c->streams_traffic){
+        streams_traffic(c->GetStreamsTraffic()){
     }
     Client::Status GetStatus() const { return status; }
     std::string GetIpAddress() const { return ip_address; }
@@ -188,30 +254,58 @@ struct report_t {
     char reportmsg[256];        //!< reason for report
 };
 
-enum class KillerThreadState
-{
-    NOT_RUNNING,
-    RUNNING,
-    STOP_REQUESTED
+/// Immutable copy of what the stream data fan-out needs to know about the clients.
+/// A new one is published whenever a client joins, leaves, starts receiving or changes streams;
+/// readers just take the current one without locking the clients-mutex.
+/// Clients referenced by a snapshot are not deleted until the snapshot is released.
+struct RecipientSnapshot {
+    struct Entry {
+        Client*                    client;
+        unsigned int               uid;
+        int                        authstatus;
+        bool                       is_receiving;    //!< Status USED and receiving data
+        bool                       is_initialized;  //!< Already introduced to the other clients
+        std::vector<std::pair<unsigned int, int>> streams; //!< Registered streams (ID, type), sorted by ID
+
+        bool FindStream(unsigned int stream_id, int &out_type) const;
+    };
+
+    RecipientSnapshot() {}
+    RecipientSnapshot(const RecipientSnapshot&) = delete;
+    RecipientSnapshot& operator=(const RecipientSnapshot&) = delete;
+    ~RecipientSnapshot();
+
+    const Entry* Find(unsigned int uid) const;
+
+    std::vector<Entry> entries; //!< Sorted by uid
 };
 
+typedef std::shared_ptr<const RecipientSnapshot> RecipientSnapshotPtr;
+
 class Sequencer {
     friend class SpamFilter;
     friend class Client;
     friend class ServerScript;
     friend class Blacklist;
+    friend class Poller;
+    friend class Hub;
+    friend class TickRelay;
+    friend class UdpChannel;
+    friend class Bridge;
 public:
 
     // Startup and shutdown
     Sequencer();
-    void Initialize();
+    void Initialize(RoomConfig const& room, Poller *poller); //!< Poller may be nullptr (thread per client); it's shared by the rooms
     void Close();
 
     // Synchronized public interface
     void createClient(SWInetSocket *sock, RoRnet::UserInfo user);
     void disconnectClient(int client_id, const char* error, bool isError = true, bool doScriptCallback = true);
+    void DisconnectStalledClient(int client_id); //!< Outgoing queue over the hard limit; any thread and locks, done by the teardown scheduler
     int getNumClients();
     void queueMessage(int uid, int type, unsigned int streamid, char *data, unsigned int len);
+    void StartReceiving(Client *client); //!< Client is ready for data
     void sendMOTDSynchronized(int uid);
     void frameStepScripts(float dt);
     void GetHeartbeatUserList(Json::Value &out_array);
@@ -219,17 +313,31 @@ public:
     int AuthorizeNick(std::string token, std::string &nickname);
     std::vector<WebserverClientInfo> GetClientListCopy();
     int getStartTime();
-
-    // Killer thread control
-    void StartKillerThread();
-    void StopKillerThread();
+    RoomConfig const& GetRoom() const { return m_room; }
 
     static unsigned int connCrash, connCount;
 
 private:
+    void                     QueueBundle(int uid, const char *data, unsigned int len); //!< Feeds the entries of a MSG2_BUNDLE to queueMessage()
+
     // Helpers (not thread safe - only call when clients-mutex is locked!)
     Client*                  FindClientById(unsigned int client_id);
     Client*                  getClient(int uid);
+    void                     PublishRecipients(); //!< Call after changing anything RecipientSnapshot holds
+    bool                     RelayStreamData(int uid, int type, unsigned int streamid, const char *data, unsigned int len);
+    void                     FanOutStreamData(RecipientSnapshot const& snapshot, Client *sender, MessagePtr const& msg,
+                                              bool use_aoi, AreaOfInterest::Position const& aoi_pos, unsigned int aoi_index);
+    bool                     HoldForTick(int uid, int type, MessagePtr const& msg,
+                                         bool use_aoi, AreaOfInterest::Position const& aoi_pos, unsigned int aoi_index); //!< Tick mode; true if held
+    void                     RelayHeldStreamData(std::vector<TickRelay::State>& states); //!< Called by the tick relay thread
+    void                     SetUdpRoute(int uid, bool enabled); //!< Called by the UDP channel; locks clients-mutex
+    void                     ConnectBridgeLink(int link_id); //!< Called by the bridge; locks clients-mutex
+    void                     ProcessBridgeMessage(int link_id, MessagePtr const& msg); //!< Called by the bridge, user ID already ours
+    void                     DropBridgeUsers(int link_id); //!< Called by the bridge when a link is closed; locks clients-mutex
+    void                     ProcessMessage(int uid, int type, unsigned int streamid, char *data, unsigned int len, MessagePtr const& inbound);
+    void                     ProcessHubEvents(std::vector<Hub::Event>& events); //!< Called by the hub thread; locks clients-mutex
+    void                     SetClientNick(Client *client, std::string const& nick); //!< Keeps the registry indexes in sync
+    void                     SetClientColour(Client *client, int colour);
     void                     QueueClientForDisconnect(int client_id, const char *error, bool isError = true, bool doScriptCallback = true);
     void                     serverSay(std::string msg, int uid = -1, int type = 0);
     void                     sendMOTD(int id);
@@ -245,36 +353,54 @@ private:
     void                     RecordBan(std::string const& ip_addr, std::string const& nickname, std::string const& by_nickname, std::string const& banmsg);
     void                     RecordReport(int to_report_uid, std::string const& ip_addr, std::string const& nickname, std::string const& by_nickname, std::string const& msg);
     bool                     IsBanned(const char *ip);
+    void                     ForgetBannedIp(std::string const& ip);
     bool                     UnBanIP(std::string ip_addr);
     bool                     UnBan(int bid);
     void                     streamDebug();
     std::vector<ban_t>       GetBanListCopy();
     void                     broadcastUserInfo(int uid);
 
-    // Killer thread
-    void                     KillerThreadMain();
-    KillerThreadState        KillerThreadWaitForClient(Client*& out_client);
-    void                     KillerThreadProcessClient(Client* client);
-
     std::mutex m_clients_mutex;  //!< Protects: m_clients, m_script_engine, m_auth_resolver, m_bot_count, m_num_disconnects_[total/crash]
     ScriptEngine *m_script_engine;
+    RoomConfig m_room;
+    Poller *m_poller;     //!< Only with the epoll network backend, otherwise nullptr. Not owned.
+    Hub *m_hub;           //!< Only in hub-thread mode, otherwise nullptr.
+    float m_hub_utilization; //!< Last minute, 0-1
+    TickRelay *m_tick_relay; //!< Only with a `tick-rate`, otherwise nullptr.
+    size_t m_tick_superseded_last_minute; //!< Stream updates replaced by a newer one within the tick
+    UdpChannel *m_udp_channel; //!< Only with `udp-channel`, otherwise nullptr.
+    UdpChannel::Stats m_udp_stats_last_minute;
+    Bridge *m_bridge;     //!< Only with `bridge-port` or `bridge-peer`, otherwise nullptr.
+    Bridge::Stats m_bridge_stats_last_minute;
+    std::atomic<size_t> m_aoi_filtered; //!< Stream updates not forwarded due to distance
+    size_t m_aoi_filtered_last_minute;
+    size_t m_decimated_last_minute; //!< Stream updates skipped by the recipients' send rate control
+    Broadcaster::QueueDepth m_queue_depths_last_minute[Broadcaster::NUM_PRIORITIES]; //!< Per class: total over clients; peak of any client
+    std::vector<char> m_hub_payload; //!< Hub thread: NUL-terminated copy of the processed payload
     UserAuth *m_auth_resolver;
     int m_bot_count;      //!< Amount of registered bots on the server.
-    unsigned int m_free_user_id;
+    static std::atomic<unsigned int> s_free_user_id; //!< Shared by the rooms, so user IDs are unique in the process
     int m_start_time;
     size_t m_num_disconnects_total; //!< Statistic
     size_t m_num_disconnects_crash; //!< Statistic
     Blacklist m_blacklist;
 
-    std::vector<Client *> m_clients;
+    ClientRegistry m_clients;
+    RecipientSnapshotPtr m_recipients; //!< Only access with std::atomic_load/std::atomic_store
     std::vector<ban_t *> m_bans;
+    std::unordered_map<std::string, unsigned int> m_banned_ips; //!< IP -> number of bans
     std::vector<report_t *> m_reports;
 
-    // Killer thread context
-    std::queue<Client *>     m_kill_queue;
-    std::thread              m_killer_thread;
-    std::condition_variable  m_killer_cond;
-    std::mutex               m_killer_mutex;
-    KillerThreadState        m_killer_state = KillerThreadState::NOT_RUNNING;
+    struct RemoteUser {
+        int                        link_id = 0;
+        RoRnet::UserInfo           user;
+        std::map<unsigned int, RoRnet::StreamRegister> streams;
+    };
+    std::map<unsigned int, RemoteUser> m_remote_users; //!< Users of linked nodes, by our user ID; protected by clients-mutex
+
+    std::atomic<size_t>      m_num_stalled_disconnects; //!< Statistic
+
+    TeardownScheduler        m_teardown; //!< Releases disconnected clients
+    TeardownScheduler::Stats m_teardown_stats_last_minute;
 };
 
@@ -0,0 +1,112 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "streamdelta.h"
+
+#include "broadcaster.h"
+#include "rornet.h"
+
+static const size_t RLE_MAX_RUN = 128;
+
+MessagePtr StreamDeltaEncoder::Encode(MessagePtr const& msg)
+{
+    const uint64_t key = Broadcaster::StreamKey(msg->GetSource(), msg->GetStreamId());
+    switch (msg->GetType()) {
+    case RoRnet::MSG2_STREAM_DATA:
+    case RoRnet::MSG2_STREAM_DATA_DISCARDABLE:
+        break;
+
+    case RoRnet::MSG2_STREAM_REGISTER:
+    case RoRnet::MSG2_STREAM_UNREGISTER:
+        m_references.erase(key); // Stream IDs get reused
+        return msg;
+
+    case RoRnet::MSG2_USER_LEAVE:
+        for (auto itor = m_references.begin(); itor != m_references.end();) {
+            if ((itor->first >> 32) == (key >> 32)) {
+                itor = m_references.erase(itor);
+            } else {
+                ++itor;
+            }
+        }
+        return msg;
+
+    default:
+        return msg;
+    }
+
+    const unsigned int len = msg->GetPayloadLength();
+    const auto now = std::chrono::steady_clock::now();
+    Reference& ref = m_references[key];
+
+    MessagePtr out_msg = msg;
+    bool is_keyframe = (len == 0) || (ref.payload.size() != len) ||
+        (now - ref.keyframe_time >= std::chrono::milliseconds(KEYFRAME_INTERVAL_MS));
+    if (!is_keyframe) {
+        // Only worth it if smaller
+        m_scratch.resize(len);
+        const size_t delta_len = EncodeXorRle(ref.payload.data(), msg->GetPayload(), len, m_scratch.data(), len - 1);
+        if (delta_len > 0) {
+            out_msg = Message::Create(RoRnet::MSG2_STREAM_DATA_DELTA, msg->GetSource(), msg->GetStreamId(),
+                                      static_cast<unsigned int>(delta_len), m_scratch.data());
+        } else {
+            is_keyframe = true;
+        }
+    }
+
+    ref.payload.assign(msg->GetPayload(), msg->GetPayload() + len);
+    if (is_keyframe) {
+        ref.keyframe_time = now;
+    }
+    return out_msg;
+}
+
+size_t StreamDeltaEncoder::EncodeXorRle(const char *reference, const char *current, size_t len, char *out, size_t out_capacity)
+{
+    size_t pos = 0;
+    size_t out_len = 0;
+    while (pos < len) {
+        size_t run = 0;
+        if (reference[pos] == current[pos]) {
+            // Unchanged bytes: 0x80 | (count - 1)
+            while (pos + run < len && run < RLE_MAX_RUN && reference[pos + run] == current[pos + run]) {
+                ++run;
+            }
+            if (out_len + 1 > out_capacity) {
+                return 0;
+            }
+            out[out_len++] = static_cast<char>(0x80 | (run - 1));
+        } else {
+            // Changed bytes: (count - 1), followed by the XORed bytes
+            while (pos + run < len && run < RLE_MAX_RUN && reference[pos + run] != current[pos + run]) {
+                ++run;
+            }
+            if (out_len + 1 + run > out_capacity) {
+                return 0;
+            }
+            out[out_len++] = static_cast<char>(run - 1);
+            for (size_t i = 0; i < run; ++i) {
+                out[out_len++] = reference[pos + i] ^ current[pos + i];
+            }
+        }
+        pos += run;
+    }
+    return out_len;
+}
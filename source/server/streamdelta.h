@@ -0,0 +1,60 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/// @file Delta encoding of stream data for clients which negotiated it (see `RoRnet::MSG2_STREAM_DATA_DELTA`)
+
+#include "message.h"
+
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#define STREAM_DELTA_SESSION_OPTION "delta" //!< Token in `RoRnet::UserInfo::sessionoptions`
+
+/// One instance per recipient, used by whoever sends its queue (single thread).
+/// Remembers the last stream data payload sent per source stream and replaces the next one
+/// by its XOR/RLE difference if that is smaller. Anything sent in full is a keyframe;
+/// one is forced when a stream (re)appears, changes payload size, or on a timer.
+class StreamDeltaEncoder
+{
+public:
+    static const unsigned int KEYFRAME_INTERVAL_MS = 2000;
+
+    /// @return The message to send in place of `msg` - itself or a delta.
+    MessagePtr Encode(MessagePtr const& msg);
+
+    void Clear() { m_references.clear(); }
+
+    /// XOR of `current` against `reference`, run-length encoded; the `MSG2_STREAM_DATA_DELTA` payload.
+    /// @return Encoded length, 0 if it would exceed `out_capacity`.
+    static size_t EncodeXorRle(const char *reference, const char *current, size_t len, char *out, size_t out_capacity);
+
+private:
+    struct Reference {
+        std::vector<char>                      payload;
+        std::chrono::steady_clock::time_point  keyframe_time;
+    };
+
+    std::unordered_map<uint64_t, Reference>  m_references; //!< Key: see Broadcaster::StreamKey()
+    std::vector<char>                        m_scratch;
+};
@@ -0,0 +1,401 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "taskexecutor.h"
+
+#include "logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using TaskExecutor::TaskType;
+using TaskExecutor::NUM_TASK_TYPES;
+
+struct Task {
+    TaskType                 type;
+    std::function<void()>    function;
+    std::chrono::steady_clock::time_point queued;
+};
+
+struct DelayedTask {
+    std::chrono::steady_clock::time_point due;
+    uint64_t                 seq;          //!< Keeps the submission order of tasks due at the same time
+    TaskType                 type;
+    std::function<void()>    function;
+
+    bool operator>(DelayedTask const& other) const {
+        return (due > other.due) || (due == other.due && seq > other.seq);
+    }
+};
+
+struct Worker {
+    std::mutex               mutex;        //!< Protects `tasks`; leaf lock
+    std::deque<Task>         tasks;        //!< The owner works at the back, thieves take from the front
+    std::thread              thread;
+};
+
+struct TypeStats {
+    std::atomic<size_t>      completed;
+    std::atomic<size_t>      rejected;
+    std::atomic<uint64_t>    queued_us;
+    std::atomic<uint64_t>    longest_queued_us;
+    std::atomic<uint64_t>    run_us;
+    std::atomic<uint64_t>    longest_run_us;
+};
+
+class Executor;
+
+thread_local Executor* t_executor = nullptr; //!< Executor whose worker runs on this thread
+thread_local int t_worker_index = -1;        //!< Of the worker within `t_executor`
+
+void UpdateMax(std::atomic<uint64_t>& max, uint64_t value) {
+    uint64_t current = max;
+    while (value > current && !max.compare_exchange_weak(current, value)) {}
+}
+
+class Executor {
+public:
+    Executor();
+    ~Executor() { this->Stop(); }
+
+    void Start(const char* name, unsigned int num_threads);
+    void Stop();
+    bool Submit(TaskType type, std::function<void()> task);
+    bool SubmitAfter(TaskType type, unsigned int delay_ms, std::function<void()> task);
+    void TakeStats(TaskExecutor::Stats (&out_stats)[NUM_TASK_TYPES]);
+
+private:
+    bool Push(Task task);
+    bool TryTake(size_t self, Task& out_task);
+    void Run(Task& task);
+    void WorkerMain(size_t index);
+    void TimerMain();
+
+    const char*              m_name = "";
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<size_t>      m_next_worker;
+    std::atomic<bool>        m_accepting;
+    std::atomic<int64_t>     m_queued;       //!< Tasks in the workers' queues; may dip below 0 momentarily
+
+    std::mutex               m_idle_mutex;   //!< Protects m_running and pushing tasks; waiting workers park on it
+    std::condition_variable  m_idle_cond;
+    bool                     m_running = false;
+
+    std::thread              m_timer_thread;
+    std::mutex               m_timer_mutex;  //!< Protects the below
+    std::condition_variable  m_timer_cond;
+    std::priority_queue<DelayedTask, std::vector<DelayedTask>, std::greater<DelayedTask>> m_delayed;
+    uint64_t                 m_delayed_seq = 0;
+    bool                     m_timer_running = false;
+
+    TypeStats                m_stats[NUM_TASK_TYPES];
+};
+
+Executor::Executor() :
+        m_next_worker(0),
+        m_accepting(false),
+        m_queued(0) {
+    for (TypeStats& stats : m_stats) {
+        stats.completed = 0;
+        stats.rejected = 0;
+        stats.queued_us = 0;
+        stats.longest_queued_us = 0;
+        stats.run_us = 0;
+        stats.longest_run_us = 0;
+    }
+}
+
+void Executor::Start(const char* name, unsigned int num_threads) {
+    {
+        std::lock_guard<std::mutex> lock(m_idle_mutex);
+        if (m_running) {
+            return;
+        }
+        m_name = name;
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            m_workers.emplace_back(new Worker());
+        }
+        m_running = true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_timer_mutex);
+        m_timer_running = true;
+    }
+    m_accepting = true;
+
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        m_workers[i]->thread = std::thread(&Executor::WorkerMain, this, i);
+    }
+    m_timer_thread = std::thread(&Executor::TimerMain, this);
+    Logger::Log(LOG_DEBUG, "Task executor (%s) started with %u threads", m_name, num_threads);
+}
+
+void Executor::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_idle_mutex);
+        if (!m_running) {
+            return;
+        }
+    }
+    m_accepting = false;
+
+    // Delayed tasks run right away, so their owners learn about the shutdown
+    std::vector<DelayedTask> delayed;
+    {
+        std::lock_guard<std::mutex> lock(m_timer_mutex);
+        m_timer_running = false;
+        while (!m_delayed.empty()) {
+            delayed.push_back(m_delayed.top());
+            m_delayed.pop();
+        }
+    }
+    m_timer_cond.notify_all();
+    m_timer_thread.join();
+    for (DelayedTask& task : delayed) {
+        this->Push(Task{task.type, std::move(task.function), std::chrono::steady_clock::now()});
+    }
+
+    // The workers exit when the queues are drained
+    {
+        std::lock_guard<std::mutex> lock(m_idle_mutex);
+        m_running = false;
+    }
+    m_idle_cond.notify_all();
+    for (std::unique_ptr<Worker>& worker : m_workers) {
+        worker->thread.join();
+    }
+    m_workers.clear();
+    Logger::Log(LOG_DEBUG, "Task executor (%s) stopped", m_name);
+}
+
+bool Executor::Submit(TaskType type, std::function<void()> task) {
+    if (!m_accepting) {
+        return false;
+    }
+    if (m_queued >= static_cast<int64_t>(TaskExecutor::MAX_QUEUED_TASKS)) {
+        ++m_stats[type].rejected;
+        return false;
+    }
+    return this->Push(Task{type, std::move(task), std::chrono::steady_clock::now()});
+}
+
+bool Executor::SubmitAfter(TaskType type, unsigned int delay_ms, std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(m_timer_mutex);
+        if (!m_timer_running) {
+            return false;
+        }
+        DelayedTask delayed;
+        delayed.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms);
+        delayed.seq = m_delayed_seq++;
+        delayed.type = type;
+        delayed.function = std::move(task);
+        m_delayed.push(std::move(delayed));
+    }
+    m_timer_cond.notify_one();
+    return true;
+}
+
+bool Executor::Push(Task task) {
+    {
+        // Under the idle lock, so the workers can't miss it - and can't have exited
+        std::lock_guard<std::mutex> idle_lock(m_idle_mutex);
+        if (!m_running) {
+            return false;
+        }
+        // Workers keep what they submit; that's what they get to first
+        size_t index = (t_executor == this) ? static_cast<size_t>(t_worker_index) : m_next_worker++ % m_workers.size();
+        std::lock_guard<std::mutex> lock(m_workers[index]->mutex);
+        m_workers[index]->tasks.push_back(std::move(task));
+        ++m_queued;
+    }
+    m_idle_cond.notify_one();
+    return true;
+}
+
+bool Executor::TryTake(size_t self, Task& out_task) {
+    {
+        Worker& own = *m_workers[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            out_task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < m_workers.size(); ++i) {
+        Worker& victim = *m_workers[(self + i) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            out_task = std::move(victim.tasks.front()); // The oldest
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Executor::Run(Task& task) {
+    TypeStats& stats = m_stats[task.type];
+    const auto start = std::chrono::steady_clock::now();
+    const uint64_t queued_us = std::chrono::duration_cast<std::chrono::microseconds>(start - task.queued).count();
+    try {
+        task.function();
+    } catch (std::exception const& e) {
+        Logger::Log(LOG_ERROR, "Task executor: %s task failed: %s", TaskExecutor::GetTaskTypeName(task.type), e.what());
+    }
+    const uint64_t run_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    task.function = nullptr; // Release the captures before the stats say it's done
+
+    ++stats.completed;
+    stats.queued_us += queued_us;
+    UpdateMax(stats.longest_queued_us, queued_us);
+    stats.run_us += run_us;
+    UpdateMax(stats.longest_run_us, run_us);
+}
+
+void Executor::WorkerMain(size_t index) {
+    t_executor = this;
+    t_worker_index = static_cast<int>(index);
+    for (;;) {
+        Task task;
+        if (this->TryTake(index, task)) {
+            --m_queued;
+            this->Run(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_idle_mutex);
+        m_idle_cond.wait(lock, [this] { return m_queued > 0 || !m_running; });
+        if (!m_running && m_queued <= 0) {
+            break;
+        }
+    }
+    t_executor = nullptr;
+    t_worker_index = -1;
+}
+
+void Executor::TimerMain() {
+    std::unique_lock<std::mutex> lock(m_timer_mutex);
+    while (m_timer_running) {
+        if (m_delayed.empty()) {
+            m_timer_cond.wait(lock);
+            continue;
+        }
+        if (m_delayed.top().due > std::chrono::steady_clock::now()) {
+            m_timer_cond.wait_until(lock, m_delayed.top().due);
+            continue;
+        }
+        DelayedTask due = m_delayed.top();
+        m_delayed.pop();
+        lock.unlock();
+        this->Push(Task{due.type, std::move(due.function), std::chrono::steady_clock::now()}); // Already accepted; not bounded
+        lock.lock();
+    }
+}
+
+void Executor::TakeStats(TaskExecutor::Stats (&out_stats)[NUM_TASK_TYPES]) {
+    for (int type = 0; type < NUM_TASK_TYPES; ++type) {
+        TypeStats& stats = m_stats[type];
+        out_stats[type].completed = stats.completed.exchange(0);
+        out_stats[type].rejected = stats.rejected.exchange(0);
+        out_stats[type].queued_us = stats.queued_us.exchange(0);
+        out_stats[type].longest_queued_us = stats.longest_queued_us.exchange(0);
+        out_stats[type].run_us = stats.run_us.exchange(0);
+        out_stats[type].longest_run_us = stats.longest_run_us.exchange(0);
+    }
+}
+
+enum Lane {
+    LANE_GENERAL,       //!< Short tasks; `task-threads` workers
+    LANE_AUTH,
+    LANE_HTTP_REQUEST,
+    NUM_LANES
+};
+
+Lane GetLane(TaskType type) {
+    switch (type) {
+    case TaskExecutor::TASK_AUTH:         return LANE_AUTH;
+    case TaskExecutor::TASK_HTTP_REQUEST: return LANE_HTTP_REQUEST;
+    default:                              return LANE_GENERAL;
+    }
+}
+
+Executor s_executors[NUM_LANES];
+
+} // anonymous namespace
+
+namespace TaskExecutor {
+
+void Start(unsigned int num_threads) {
+    s_executors[LANE_GENERAL].Start("general", (num_threads > 0) ? num_threads : 1);
+    s_executors[LANE_AUTH].Start("auth", AUTH_THREADS);
+    s_executors[LANE_HTTP_REQUEST].Start("HTTP request", HTTP_REQUEST_THREADS);
+}
+
+void Stop() {
+    // The blocking tasks first - they may submit general ones
+    for (int lane = NUM_LANES - 1; lane >= 0; --lane) {
+        s_executors[lane].Stop();
+    }
+}
+
+bool Submit(TaskType type, std::function<void()> task) {
+    return s_executors[GetLane(type)].Submit(type, std::move(task));
+}
+
+bool SubmitAfter(TaskType type, unsigned int delay_ms, std::function<void()> task) {
+    return s_executors[GetLane(type)].SubmitAfter(type, delay_ms, std::move(task));
+}
+
+void TakeStats(Stats (&out_stats)[NUM_TASK_TYPES]) {
+    for (int lane = 0; lane < NUM_LANES; ++lane) {
+        Stats lane_stats[NUM_TASK_TYPES];
+        s_executors[lane].TakeStats(lane_stats);
+        for (int type = 0; type < NUM_TASK_TYPES; ++type) {
+            if (GetLane(static_cast<TaskType>(type)) == lane) {
+                out_stats[type] = lane_stats[type];
+            }
+        }
+    }
+}
+
+const char* GetTaskTypeName(TaskType type) {
+    switch (type) {
+    case TASK_AUTH:             return "auth";
+    case TASK_CLIENT_TEARDOWN:  return "client teardown";
+    case TASK_SCRIPT_TIMER:     return "script timer";
+    case TASK_HTTP_REQUEST:     return "HTTP request";
+    default:                    return "unknown";
+    }
+}
+
+} // namespace TaskExecutor
@@ -0,0 +1,66 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+/// Shared thread pool for background work (`task-threads` config option), in place of
+/// threads created per job. Each worker has its own queue; tasks submitted by a worker stay
+/// on it, others are spread round-robin, and an idle worker steals from the busy ones.
+/// The number of queued tasks is bounded: Submit() fails when it's reached.
+/// Task types which block on network I/O (authentication, script HTTP requests) get bounded
+/// groups of workers of their own, so they can't hold up the script timer and the client teardown.
+namespace TaskExecutor {
+
+    static const size_t MAX_QUEUED_TASKS = 4096;         //!< Per group of workers
+    static const unsigned int AUTH_THREADS = 16;         //!< Concurrent handshakes
+    static const unsigned int HTTP_REQUEST_THREADS = 4;  //!< Concurrent script HTTP requests
+
+    enum TaskType {
+        TASK_AUTH,              //!< Authentication of a joining client (may query the master server)
+        TASK_CLIENT_TEARDOWN,   //!< Joining the threads of a disconnected client
+        TASK_SCRIPT_TIMER,      //!< Script `frameStep` callbacks
+        TASK_HTTP_REQUEST,      //!< Script `curlRequestAsync()`
+        NUM_TASK_TYPES
+    };
+
+    struct Stats {
+        size_t   completed = 0;
+        size_t   rejected = 0;          //!< Queue was full
+        uint64_t queued_us = 0;         //!< Total time waiting for a worker
+        uint64_t longest_queued_us = 0;
+        uint64_t run_us = 0;            //!< Total time running
+        uint64_t longest_run_us = 0;
+    };
+
+    void  Start(unsigned int num_threads); //!< Workers for the task types without a group of their own
+    void  Stop(); //!< Queued tasks still run; delayed ones run right away. Nothing new is accepted.
+
+    // Any thread; return false if the task was rejected (queue full, or not running).
+    bool  Submit(TaskType type, std::function<void()> task);
+    bool  SubmitAfter(TaskType type, unsigned int delay_ms, std::function<void()> task);
+
+    void  TakeStats(Stats (&out_stats)[NUM_TASK_TYPES]); //!< Since the previous call
+    const char* GetTaskTypeName(TaskType type);
+
+} // namespace TaskExecutor
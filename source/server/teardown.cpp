@@ -0,0 +1,215 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "teardown.h"
+
+#include "logger.h"
+#include "sequencer.h"
+#include "taskexecutor.h"
+
+#include <algorithm>
+
+TeardownScheduler::TeardownScheduler(Sequencer *sequencer) :
+        m_sequencer(sequencer),
+        m_wheel(WHEEL_SLOTS),
+        m_stat_clients(0),
+        m_stat_total_ms(0),
+        m_stat_longest_ms(0) {
+}
+
+TeardownScheduler::~TeardownScheduler() {
+    this->Stop();
+}
+
+void TeardownScheduler::Start() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_running) {
+        return;
+    }
+    m_running = true;
+    m_scheduler_thread = std::thread(&TeardownScheduler::SchedulerThreadMain, this);
+}
+
+void TeardownScheduler::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_running) {
+            return;
+        }
+        m_running = false;
+    }
+    m_scheduler_cond.notify_all();
+    m_scheduler_thread.join();
+
+    // The scheduler is gone - release whatever waits, without grace period
+    std::vector<Entry> pending;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pending.swap(m_incoming);
+        m_disconnects.clear();
+    }
+    for (std::vector<Entry>& slot : m_wheel) {
+        pending.insert(pending.end(), slot.begin(), slot.end());
+        slot.clear();
+    }
+    for (Entry const& entry : pending) {
+        this->Release(entry);
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_released_cond.wait(lock, [this] { return m_releasing == 0; });
+}
+
+void TeardownScheduler::Schedule(Client *client) {
+    Entry entry;
+    entry.client = client;
+    entry.scheduled = std::chrono::steady_clock::now();
+    entry.deadline = entry.scheduled + std::chrono::milliseconds(GRACE_PERIOD_MS);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_incoming.push_back(entry);
+    }
+    m_scheduler_cond.notify_one();
+}
+
+void TeardownScheduler::PostDisconnect(int uid, const char *reason) {
+    Disconnect disconnect;
+    disconnect.uid = uid;
+    disconnect.reason = reason;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_disconnects.push_back(disconnect);
+    }
+    m_scheduler_cond.notify_one();
+}
+
+TeardownScheduler::Stats TeardownScheduler::TakeStats() {
+    Stats stats;
+    stats.clients = m_stat_clients.exchange(0);
+    stats.total_ms = m_stat_total_ms.exchange(0);
+    stats.longest_ms = m_stat_longest_ms.exchange(0);
+    return stats;
+}
+
+void TeardownScheduler::SchedulerThreadMain() {
+    Logger::Log(LOG_DEBUG, "Teardown scheduler thread ready");
+
+    std::vector<Entry> incoming;
+    std::vector<Disconnect> disconnects;
+    m_wheel_time = std::chrono::steady_clock::now();
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_scheduler_cond.wait_for(lock, std::chrono::milliseconds(TICK_MS), [this] {
+                return !m_running || !m_incoming.empty() || !m_disconnects.empty();
+            });
+            if (!m_running) {
+                break;
+            }
+            incoming.swap(m_incoming);
+            disconnects.swap(m_disconnects);
+        }
+
+        for (Disconnect const& disconnect : disconnects) {
+            m_sequencer->disconnectClient(disconnect.uid, disconnect.reason.c_str()); // Schedules the client
+        }
+        disconnects.clear();
+
+        for (Entry const& entry : incoming) {
+            entry.client->ShutdownSocket(/*read_only=*/true); // Reading stops, the queued messages are still sent
+            this->Insert(entry, DRAIN_CHECK_MS);
+        }
+        incoming.clear();
+
+        this->Advance(std::chrono::steady_clock::now());
+    }
+
+    Logger::Log(LOG_DEBUG, "Teardown scheduler thread exits");
+}
+
+void TeardownScheduler::ReleaseClient(Entry const& entry) {
+    // Join the send/recv threads and close socket; with the socket shut down, nothing blocks them
+    entry.client->Disconnect();
+
+    // Stream data may still be relayed through an older snapshot of the client list;
+    // if so, the thread which releases that snapshot finishes the job.
+    entry.client->WhenOutOfSnapshots([this, entry] {
+        if (!TaskExecutor::Submit(TaskExecutor::TASK_CLIENT_TEARDOWN, [this, entry] { this->DeleteClient(entry); })) {
+            this->DeleteClient(entry);
+        }
+    });
+}
+
+void TeardownScheduler::DeleteClient(Entry const& entry) {
+    delete entry.client;
+
+    const unsigned int elapsed_ms = static_cast<unsigned int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - entry.scheduled).count());
+    ++m_stat_clients;
+    m_stat_total_ms += elapsed_ms;
+    unsigned int longest = m_stat_longest_ms;
+    while (elapsed_ms > longest && !m_stat_longest_ms.compare_exchange_weak(longest, elapsed_ms)) {}
+    Logger::Log(LOG_DEBUG, "Client released %u ms after disconnecting", elapsed_ms);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_releasing;
+    }
+    m_released_cond.notify_all();
+}
+
+void TeardownScheduler::Insert(Entry const& entry, unsigned int delay_ms) {
+    const size_t ticks = std::max<size_t>(1, (delay_ms + TICK_MS - 1) / TICK_MS);
+    std::vector<Entry>& slot = m_wheel[(m_wheel_pos + ticks) % WHEEL_SLOTS];
+    slot.push_back(entry);
+    slot.back().rounds = (ticks - 1) / WHEEL_SLOTS;
+}
+
+void TeardownScheduler::Advance(std::chrono::steady_clock::time_point now) {
+    const std::chrono::milliseconds tick(TICK_MS);
+    while (m_wheel_time + tick <= now) {
+        m_wheel_time += tick;
+        m_wheel_pos = (m_wheel_pos + 1) % WHEEL_SLOTS;
+
+        m_expiring.swap(m_wheel[m_wheel_pos]);
+        for (Entry& entry : m_expiring) {
+            if (entry.rounds > 0) {
+                --entry.rounds;
+                m_wheel[m_wheel_pos].push_back(entry);
+            } else if (now >= entry.deadline || entry.client->GetQueuedBytes() == 0) {
+                this->Release(entry);
+            } else {
+                this->Insert(entry, DRAIN_CHECK_MS);
+            }
+        }
+        m_expiring.clear();
+    }
+}
+
+void TeardownScheduler::Release(Entry const& entry) {
+    entry.client->ShutdownSocket(/*read_only=*/false); // Unblocks a broadcaster waiting for the socket
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_releasing;
+    }
+    if (!TaskExecutor::Submit(TaskExecutor::TASK_CLIENT_TEARDOWN, [this, entry] { this->ReleaseClient(entry); })) {
+        this->ReleaseClient(entry); // Executor is saturated or stopped - do it here
+    }
+}
@@ -0,0 +1,105 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "prerequisites.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Releases disconnected clients.
+/// Reading is shut down as soon as a client is scheduled, so its receiver exits right away.
+/// Its broadcaster gets a grace period to send what's still queued (i.e. the kick reason);
+/// the deadlines are kept on a timer wheel. Once the queue drained or the grace period is over,
+/// the socket is shut down completely and a TaskExecutor task joins the client's threads and
+/// deletes it - in parallel, so a mass disconnect doesn't queue up behind one slow client.
+class TeardownScheduler {
+public:
+    static const unsigned int TICK_MS = 50;
+    static const size_t WHEEL_SLOTS = 128;
+    static const unsigned int GRACE_PERIOD_MS = 5000;
+    static const unsigned int DRAIN_CHECK_MS = 100; //!< Outgoing queue is checked this often during the grace period
+
+    struct Stats {
+        size_t       clients = 0;
+        uint64_t     total_ms = 0;      //!< From being scheduled to being deleted
+        unsigned int longest_ms = 0;
+    };
+
+    TeardownScheduler(Sequencer *sequencer);
+    ~TeardownScheduler();
+
+    void Start();
+    void Stop(); //!< Releases the pending clients without grace period.
+
+    // Any thread
+    void Schedule(Client *client); //!< Client must be out of the client list already
+    void PostDisconnect(int uid, const char *reason); //!< For callers which can't lock the clients-mutex
+
+    Stats TakeStats();
+
+private:
+    struct Entry {
+        Client*      client = nullptr;
+        std::chrono::steady_clock::time_point scheduled;
+        std::chrono::steady_clock::time_point deadline;
+        size_t       rounds = 0; //!< Full turns of the wheel left
+    };
+
+    struct Disconnect {
+        int          uid = 0;
+        std::string  reason;
+    };
+
+    void  SchedulerThreadMain();
+    void  Insert(Entry const& entry, unsigned int delay_ms);
+    void  Advance(std::chrono::steady_clock::time_point now);
+    void  Release(Entry const& entry);       //!< Hands the client to the task executor
+    void  ReleaseClient(Entry const& entry); //!< Task
+    void  DeleteClient(Entry const& entry);  //!< Once no RecipientSnapshot references the client
+
+    Sequencer*                m_sequencer;
+    std::thread               m_scheduler_thread;
+
+    std::mutex                m_mutex;      //!< Protects the below
+    std::condition_variable   m_scheduler_cond;
+    std::condition_variable   m_released_cond;
+    bool                      m_running = false;
+    std::vector<Entry>        m_incoming;
+    std::vector<Disconnect>   m_disconnects;
+    size_t                    m_releasing = 0; //!< Clients handed to the task executor, not deleted yet
+
+    // Scheduler thread only
+    std::vector<std::vector<Entry>> m_wheel;
+    std::vector<Entry>        m_expiring;
+    size_t                    m_wheel_pos = 0;
+    std::chrono::steady_clock::time_point m_wheel_time; //!< Time of the current slot
+
+    std::atomic<size_t>       m_stat_clients;
+    std::atomic<uint64_t>     m_stat_total_ms;
+    std::atomic<unsigned int> m_stat_longest_ms;
+};
@@ -0,0 +1,113 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tickrelay.h"
+
+#include "broadcaster.h"
+#include "logger.h"
+#include "sequencer.h"
+
+TickRelay::TickRelay(Sequencer *sequencer) :
+        m_sequencer(sequencer),
+        m_interval(0),
+        m_superseded(0) {
+}
+
+TickRelay::~TickRelay() {
+    this->Stop();
+}
+
+void TickRelay::Start(unsigned int rate_hz) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_running || rate_hz == 0) {
+        return;
+    }
+    m_interval = std::chrono::microseconds(1000000 / rate_hz);
+    m_running = true;
+    m_thread = std::thread(&TickRelay::ThreadMain, this);
+}
+
+void TickRelay::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_running) {
+            return;
+        }
+        m_running = false;
+        m_held.clear();
+        m_held_index.clear();
+    }
+    m_stop_cond.notify_all();
+    m_thread.join();
+}
+
+void TickRelay::Hold(State const& state) {
+    const uint64_t key = Broadcaster::StreamKey(state.uid, state.streamid);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto found = m_held_index.find(key);
+    if (found != m_held_index.end()) {
+        State& held = m_held[found->second];
+        if (held.message != nullptr) {
+            ++m_superseded;
+        }
+        held = state;
+    } else {
+        m_held_index.emplace(key, m_held.size());
+        m_held.push_back(state);
+    }
+}
+
+void TickRelay::Withdraw(int uid, unsigned int streamid) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto found = m_held_index.find(Broadcaster::StreamKey(uid, streamid));
+    if (found != m_held_index.end()) {
+        m_held[found->second].message.reset(); // Keep the position; the index stays valid
+    }
+}
+
+void TickRelay::ThreadMain() {
+    Logger::Log(LOG_DEBUG, "Started tick relay thread, interval %u us", (unsigned int) m_interval.count());
+
+    auto next_tick = std::chrono::steady_clock::now() + m_interval;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_stop_cond.wait_until(lock, next_tick, [this]{ return !m_running; })) {
+                break;
+            }
+            m_flushing.swap(m_held);
+            m_held_index.clear();
+        }
+
+        // Fixed schedule; if a flush overran, skip the missed ticks instead of bursting
+        next_tick += m_interval;
+        const auto now = std::chrono::steady_clock::now();
+        if (next_tick < now) {
+            next_tick = now + m_interval;
+        }
+
+        if (!m_flushing.empty()) {
+            m_sequencer->RelayHeldStreamData(m_flushing);
+            m_flushing.clear(); // Release the buffers
+        }
+    }
+
+    Logger::Log(LOG_DEBUG, "Tick relay thread exits");
+}
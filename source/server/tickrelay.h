@@ -0,0 +1,79 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "aoi.h"
+#include "message.h"
+#include "prerequisites.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/// Fixed-tick relay of discardable stream data (`tick-rate` config option).
+/// Instead of being forwarded on arrival, the latest discardable update of each stream is held
+/// here; a scheduler thread hands all held updates to the Sequencer for fan-out once per tick.
+/// Updates superseded within a tick are never queued, so the outbound rate per stream is
+/// capped at the tick rate regardless of how fast the clients send.
+class TickRelay {
+public:
+    struct State {
+        int                       uid = 0;
+        unsigned int              streamid = 0;
+        MessagePtr                message;      //!< Null if withdrawn
+        bool                      use_aoi = false;
+        AreaOfInterest::Position  aoi_pos;
+        unsigned int              aoi_index = 0;
+    };
+
+    TickRelay(Sequencer *sequencer);
+    ~TickRelay();
+
+    void Start(unsigned int rate_hz);
+    void Stop(); //!< Held updates are discarded.
+
+    // Any thread
+    void Hold(State const& state);              //!< Replaces the held update of the same stream
+    void Withdraw(int uid, unsigned int streamid); //!< Drops the held update, i.e. when superseded by reliable data
+
+    size_t TakeSupersededCount() { return m_superseded.exchange(0); }
+
+private:
+    void ThreadMain();
+
+    Sequencer*                m_sequencer;
+    std::thread               m_thread;
+    std::chrono::microseconds m_interval;
+
+    std::mutex                m_mutex;      //!< Protects the below, and is the stop signal's mutex
+    std::condition_variable   m_stop_cond;
+    bool                      m_running = false;
+    std::vector<State>        m_held;       //!< In arrival order
+    std::unordered_map<uint64_t, size_t> m_held_index; //!< Stream (see Broadcaster::StreamKey()) -> position in m_held
+
+    std::vector<State>        m_flushing;   //!< Scheduler thread only
+    std::atomic<size_t>       m_superseded;
+};
@@ -0,0 +1,363 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "udpchannel.h"
+
+#include "logger.h"
+#include "rornet.h"
+#include "sequencer.h"
+
+#include <cstring>
+
+#ifdef __linux__
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif // __linux__
+
+static const size_t UDP_HEADERS_LEN = sizeof(RoRnet::UdpDatagramHeader) + sizeof(RoRnet::Header);
+static const size_t UDP_MAX_DATAGRAM = UDP_HEADERS_LEN + RORNET_MAX_MESSAGE_LENGTH;
+static const int    UDP_SOCKET_BUFFER = 1024 * 1024;
+
+UdpChannel::UdpChannel(Sequencer *sequencer) :
+        m_sequencer(sequencer),
+        m_running(false),
+        m_outbox(OUTBOX_CAPACITY),
+        m_sender_parked(false),
+        m_datagrams_in(0),
+        m_datagrams_out(0),
+        m_stale(0),
+        m_rejected(0),
+        m_outbox_full(0) {
+}
+
+UdpChannel::~UdpChannel() {
+    this->Stop();
+}
+
+uint32_t UdpChannel::AddPeer(int uid) {
+    std::lock_guard<std::mutex> lock(m_peers_mutex);
+    Peer& peer = m_peers[uid];
+    peer = Peer();
+    while (peer.token == 0) {
+        peer.token = static_cast<uint32_t>(m_random());
+    }
+    return peer.token;
+}
+
+void UdpChannel::RemovePeer(int uid) {
+    std::lock_guard<std::mutex> lock(m_peers_mutex);
+    m_peers.erase(uid);
+}
+
+void UdpChannel::Send(int uid, MessagePtr const& msg) {
+    Outgoing out;
+    out.uid = uid;
+    out.message = msg;
+    if (!m_outbox.TryPush(out)) {
+        ++m_outbox_full; // Discardable by definition
+        return;
+    }
+
+    // Pairs with the fence in TryParkSender(): either we see the sender parked, or it sees our datagram.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sender_parked.load(std::memory_order_relaxed) && m_sender_parked.exchange(false)) {
+        this->WakeSender();
+    }
+}
+
+UdpChannel::Stats UdpChannel::TakeStats() {
+    Stats stats;
+    stats.datagrams_in = m_datagrams_in.exchange(0);
+    stats.datagrams_out = m_datagrams_out.exchange(0);
+    stats.stale = m_stale.exchange(0);
+    stats.rejected = m_rejected.exchange(0);
+    stats.outbox_full = m_outbox_full.exchange(0);
+    return stats;
+}
+
+void UdpChannel::ProcessDatagram(const char *data, size_t len, const void *addr, unsigned int addr_len) {
+    RoRnet::UdpDatagramHeader udp_head;
+    RoRnet::Header head;
+    if (len < UDP_HEADERS_LEN || addr_len == 0 || addr_len > sizeof(Peer::addr)) {
+        ++m_rejected;
+        return;
+    }
+    std::memcpy(&udp_head, data, sizeof(udp_head)); // Buffer is unaligned
+    std::memcpy(&head, data + sizeof(udp_head), sizeof(head));
+    if (head.size != len - UDP_HEADERS_LEN) {
+        ++m_rejected;
+        return;
+    }
+
+    bool is_new_route = false;
+    {
+        std::lock_guard<std::mutex> lock(m_peers_mutex);
+        auto found = m_peers.find(udp_head.uid);
+        if (found == m_peers.end() || found->second.token != udp_head.token) {
+            ++m_rejected;
+            return;
+        }
+        Peer& peer = found->second;
+        if (peer.addr_len == 0) {
+            is_new_route = true;
+        } else if (static_cast<int32_t>(udp_head.sequence - peer.recv_sequence) <= 0) {
+            ++m_stale;
+            return;
+        }
+        // The newest datagram decides where we send to (NAT rebinding)
+        peer.recv_sequence = udp_head.sequence;
+        std::memcpy(peer.addr, addr, addr_len);
+        peer.addr_len = addr_len;
+        peer.last_recv = std::chrono::steady_clock::now();
+    }
+    ++m_datagrams_in;
+
+    if (is_new_route) {
+        Logger::Log(LOG_VERBOSE, "UID %d: discardable stream data now goes over UDP", udp_head.uid);
+        m_sequencer->SetUdpRoute(udp_head.uid, true);
+    }
+
+    if (head.command == RoRnet::MSG2_UDP_CHANNEL) {
+        return; // Keepalive
+    }
+    if (head.command != RoRnet::MSG2_STREAM_DATA_DISCARDABLE) {
+        ++m_rejected; // Everything else belongs to TCP
+        return;
+    }
+
+    // Processing may modify the payload (and expects it terminated)
+    char payload[RORNET_MAX_MESSAGE_LENGTH + 1];
+    std::memcpy(payload, data + UDP_HEADERS_LEN, head.size);
+    payload[head.size] = '\0';
+    // Concurrently with the client's TCP data; its inbound state (drop state, area of interest) allows that
+    m_sequencer->queueMessage(udp_head.uid, static_cast<int>(head.command), head.streamid, payload, head.size);
+}
+
+void UdpChannel::ExpirePeers() {
+    const auto deadline = std::chrono::steady_clock::now() - std::chrono::seconds(PEER_TIMEOUT_SEC);
+    std::vector<int> expired;
+    {
+        std::lock_guard<std::mutex> lock(m_peers_mutex);
+        for (auto& entry : m_peers) {
+            if (entry.second.addr_len != 0 && entry.second.last_recv < deadline) {
+                entry.second.addr_len = 0;
+                expired.push_back(entry.first);
+            }
+        }
+    }
+    for (int uid : expired) {
+        Logger::Log(LOG_VERBOSE, "UID %d: no UDP datagrams for %u seconds, back to TCP", uid, PEER_TIMEOUT_SEC);
+        m_sequencer->SetUdpRoute(uid, false);
+    }
+}
+
+bool UdpChannel::TryParkSender() {
+    m_sender_parked.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_outbox.IsEmpty() && m_running) {
+        return true;
+    }
+    m_sender_parked.store(false);
+    return false;
+}
+
+void UdpChannel::WakeSender() {
+    {
+        std::lock_guard<std::mutex> lock(m_wake_mutex);
+        m_wake_pending = true;
+    }
+    m_wake_cond.notify_one();
+}
+
+#ifdef __linux__
+
+bool UdpChannel::Start(unsigned int port) {
+    m_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (m_socket < 0) {
+        Logger::Log(LOG_ERROR, "UDP channel: failed to create socket: %s", strerror(errno));
+        return false;
+    }
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    timeval timeout = {1, 0}; // Lets the receiver check for shutdown and expire peers
+    if (bind(m_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        Logger::Log(LOG_ERROR, "UDP channel: failed to bind port %u: %s", port, strerror(errno));
+        close(m_socket);
+        m_socket = -1;
+        return false;
+    }
+    setsockopt(m_socket, SOL_SOCKET, SO_RCVBUF, &UDP_SOCKET_BUFFER, sizeof(UDP_SOCKET_BUFFER));
+    setsockopt(m_socket, SOL_SOCKET, SO_SNDBUF, &UDP_SOCKET_BUFFER, sizeof(UDP_SOCKET_BUFFER));
+
+    m_random.seed(std::random_device()());
+    m_port = port;
+    m_running = true;
+    m_receiver_thread = std::thread(&UdpChannel::ReceiverThreadMain, this);
+    m_sender_thread = std::thread(&UdpChannel::SenderThreadMain, this);
+    return true;
+}
+
+void UdpChannel::Stop() {
+    if (!m_running.exchange(false)) {
+        return;
+    }
+    shutdown(m_socket, SHUT_RDWR);
+    this->WakeSender();
+    m_receiver_thread.join();
+    m_sender_thread.join();
+    close(m_socket);
+    m_socket = -1;
+}
+
+void UdpChannel::ReceiverThreadMain() {
+    Logger::Log(LOG_DEBUG, "Started UDP receiver thread");
+
+    std::vector<char> buffers(BATCH_MAX_DATAGRAMS * UDP_MAX_DATAGRAM);
+    mmsghdr msgs[BATCH_MAX_DATAGRAMS];
+    iovec iovs[BATCH_MAX_DATAGRAMS];
+    sockaddr_storage addrs[BATCH_MAX_DATAGRAMS];
+    auto last_expiry = std::chrono::steady_clock::now();
+
+    while (m_running) {
+        for (size_t i = 0; i < BATCH_MAX_DATAGRAMS; ++i) {
+            iovs[i].iov_base = buffers.data() + i * UDP_MAX_DATAGRAM;
+            iovs[i].iov_len = UDP_MAX_DATAGRAM;
+            std::memset(&msgs[i], 0, sizeof(mmsghdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        }
+
+        // Blocks for the first datagram only, then takes what's already there
+        const int num = recvmmsg(m_socket, msgs, BATCH_MAX_DATAGRAMS, MSG_WAITFORONE, nullptr);
+        if (num < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && m_running) {
+            Logger::Log(LOG_WARN, "UDP channel: receive error: %s", strerror(errno));
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        for (int i = 0; i < num; ++i) {
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                ++m_rejected;
+                continue;
+            }
+            this->ProcessDatagram(static_cast<const char*>(iovs[i].iov_base), msgs[i].msg_len,
+                                  &addrs[i], msgs[i].msg_hdr.msg_namelen);
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now - last_expiry >= std::chrono::seconds(1)) {
+            this->ExpirePeers();
+            last_expiry = now;
+        }
+    }
+
+    Logger::Log(LOG_DEBUG, "UDP receiver thread exits");
+}
+
+void UdpChannel::SenderThreadMain() {
+    Logger::Log(LOG_DEBUG, "Started UDP sender thread");
+
+    std::vector<Outgoing> batch;
+    batch.reserve(BATCH_MAX_DATAGRAMS);
+    mmsghdr msgs[BATCH_MAX_DATAGRAMS];
+    iovec iovs[BATCH_MAX_DATAGRAMS][2];
+    RoRnet::UdpDatagramHeader headers[BATCH_MAX_DATAGRAMS];
+    sockaddr_storage addrs[BATCH_MAX_DATAGRAMS];
+
+    while (m_running) {
+        Outgoing out;
+        while (batch.size() < BATCH_MAX_DATAGRAMS && m_outbox.TryPop(out)) {
+            batch.push_back(std::move(out));
+        }
+        if (batch.empty()) {
+            if (this->TryParkSender()) {
+                std::unique_lock<std::mutex> lock(m_wake_mutex);
+                m_wake_cond.wait(lock, [this] { return m_wake_pending; });
+                m_wake_pending = false;
+            }
+            continue;
+        }
+
+        unsigned int count = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_peers_mutex);
+            for (Outgoing const& item : batch) {
+                auto found = m_peers.find(item.uid);
+                if (found == m_peers.end() || found->second.addr_len == 0) {
+                    continue; // Left, or fell back to TCP meanwhile; it's discardable
+                }
+                Peer& peer = found->second;
+                headers[count].uid = item.uid;
+                headers[count].token = peer.token;
+                headers[count].sequence = ++peer.send_sequence;
+                std::memcpy(&addrs[count], peer.addr, peer.addr_len);
+
+                iovs[count][0].iov_base = &headers[count];
+                iovs[count][0].iov_len = sizeof(RoRnet::UdpDatagramHeader);
+                iovs[count][1].iov_base = const_cast<char*>(item.message->GetWireData());
+                iovs[count][1].iov_len = item.message->GetWireLength();
+                std::memset(&msgs[count], 0, sizeof(mmsghdr));
+                msgs[count].msg_hdr.msg_iov = iovs[count];
+                msgs[count].msg_hdr.msg_iovlen = 2;
+                msgs[count].msg_hdr.msg_name = &addrs[count];
+                msgs[count].msg_hdr.msg_namelen = peer.addr_len;
+                ++count;
+            }
+        }
+
+        unsigned int sent = 0;
+        while (sent < count) {
+            const int res = sendmmsg(m_socket, msgs + sent, count - sent, 0);
+            if (res < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break; // Drop the rest, like the network would
+            }
+            sent += static_cast<unsigned int>(res);
+        }
+        m_datagrams_out += sent;
+        batch.clear(); // Release the buffers
+    }
+
+    Logger::Log(LOG_DEBUG, "UDP sender thread exits");
+}
+
+#else // __linux__
+
+bool UdpChannel::Start(unsigned int port) {
+    Logger::Log(LOG_ERROR, "UDP channel: not available on this platform");
+    return false;
+}
+
+void UdpChannel::Stop() {}
+
+void UdpChannel::ReceiverThreadMain() {}
+
+void UdpChannel::SenderThreadMain() {}
+
+#endif // __linux__
@@ -0,0 +1,119 @@
+/*
+This file is part of "Rigs of Rods Server" (Relay mode)
+
+Copyright 2007   Pierre-Michel Ricordel
+Copyright 2014+  Rigs of Rods Community
+
+"Rigs of Rods Server" is free software: you can redistribute it
+and/or modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, either version 3
+of the License, or (at your option) any later version.
+
+"Rigs of Rods Server" is distributed in the hope that it will
+be useful, but WITHOUT ANY WARRANTY; without even the implied
+warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rigs of Rods Server. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "message.h"
+#include "mpsc_ring.h"
+#include "prerequisites.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define UDP_SESSION_OPTION "udp" //!< Token in `RoRnet::UserInfo::sessionoptions`
+
+/// UDP side-channel for discardable stream data (Linux; `udp-channel` config option),
+/// so that a lost TCP segment doesn't hold back the vehicle updates behind it.
+/// Clients which ask for it get a token (`RoRnet::MSG2_UDP_CHANNEL`); once a datagram with
+/// it arrives, their discardable stream data goes both ways over UDP, everything else stays on TCP.
+/// If their datagrams stop coming, they fall back to TCP. Datagrams older than the newest one
+/// received (sequence numbers) are dropped. One thread receives and one sends, in batches
+/// (recvmmsg/sendmmsg).
+class UdpChannel {
+public:
+    static const size_t BATCH_MAX_DATAGRAMS = 64;
+    static const size_t OUTBOX_CAPACITY = 8192;
+    static const unsigned int PEER_TIMEOUT_SEC = 10; //!< Back to TCP without datagrams for this long
+
+    struct Stats {
+        size_t datagrams_in = 0;
+        size_t datagrams_out = 0;
+        size_t stale = 0;          //!< Dropped as out of order
+        size_t rejected = 0;       //!< Malformed or bad token
+        size_t outbox_full = 0;    //!< Dropped before sending
+    };
+
+    UdpChannel(Sequencer *sequencer);
+    ~UdpChannel();
+
+    bool Start(unsigned int port); //!< @return false if UDP is not available.
+    void Stop();
+    unsigned int GetPort() const { return m_port; }
+
+    uint32_t AddPeer(int uid); //!< @return The client's token
+    void     RemovePeer(int uid);
+
+    /// Any thread; only for clients whose route is enabled (see Sequencer::SetUdpRoute()).
+    void     Send(int uid, MessagePtr const& msg);
+
+    Stats    TakeStats();
+
+private:
+    struct Peer {
+        uint32_t     token = 0;
+        char         addr[128];                 //!< sockaddr_storage
+        unsigned int addr_len = 0;              //!< 0 until the first datagram
+        uint32_t     recv_sequence = 0;         //!< Newest received
+        uint32_t     send_sequence = 0;
+        std::chrono::steady_clock::time_point last_recv;
+    };
+
+    struct Outgoing {
+        int          uid = 0;
+        MessagePtr   message;
+    };
+
+    void  ReceiverThreadMain();
+    void  SenderThreadMain();
+    void  ProcessDatagram(const char *data, size_t len, const void *addr, unsigned int addr_len);
+    void  ExpirePeers();
+    bool  TryParkSender();
+    void  WakeSender();
+
+    Sequencer*                m_sequencer;
+    int                       m_socket = -1;
+    unsigned int              m_port = 0;
+    std::atomic<bool>         m_running;
+    std::thread               m_receiver_thread;
+    std::thread               m_sender_thread;
+
+    std::mutex                m_peers_mutex;  //!< Protects m_peers and m_random; never held while calling the Sequencer
+    std::unordered_map<int, Peer> m_peers;    //!< Key: user ID
+    std::mt19937              m_random;
+
+    MpscRing<Outgoing>        m_outbox;
+    std::atomic<bool>         m_sender_parked;
+    std::mutex                m_wake_mutex;
+    std::condition_variable   m_wake_cond;
+    bool                      m_wake_pending = false;
+
+    std::atomic<size_t>       m_datagrams_in;
+    std::atomic<size_t>       m_datagrams_out;
+    std::atomic<size_t>       m_stale;
+    std::atomic<size_t>       m_rejected;
+    std::atomic<size_t>       m_outbox_full;
+};
@@ -151,7 +151,7 @@ int UserAuth::sendUserEvent(std::string user_token, std::string type, std::strin
     return -1;
 }
 
-int UserAuth::resolve(std::string user_token, std::string &user_nick, int clientid) {
+int UserAuth::resolveRemote(std::string user_token, std::string user_nick) {
     // initialize the authlevel on none = normal user
     int authlevel = RoRnet::AUTH_NONE;
 
@@ -178,6 +178,10 @@ int UserAuth::resolve(std::string user_token, std::string &user_nick, int client
         Logger::Log(LOG_INFO, "User authentication failed, result code: %d", result_code);
     }
 
+    return authlevel;
+}
+
+int UserAuth::resolveLocal(std::string user_token, std::string &user_nick, int authlevel) {
     //then check for overrides in the authorizations file (server admins, etc)
     if (local_auth.find(user_token) != local_auth.end()) {
         // local auth hit!
@@ -32,7 +32,9 @@ class UserAuth {
 public:
     UserAuth(std::string authFile);
 
-    int resolve(std::string user_token, std::string &user_nick, int clientid);
+    int resolveRemote(std::string user_token, std::string user_nick); //!< Master server lookup only; thread-safe.
+
+    int resolveLocal(std::string user_token, std::string &user_nick, int authlevel); //!< Applies the authorizations file.
 
     int setUserAuth(int flags, std::string user_nick, std::string token);
 